@@ -0,0 +1,465 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "tinyoslib.h"
+
+
+/*
+	A standalone program to measure the performance of TinyOS streams.
+
+	Each benchmark runs inside the VM and reports one record per
+	configuration on the host's standard output, as a CSV line or
+	as an element of a JSON array.
+
+	The benchmarks are:
+	- throughput: a producer thread streams messages of a fixed size
+	  into a channel, and the main thread reads to exhaustion.
+	- scaling: as above, with several producers sharing the write end.
+	- latency: the main thread sends a message through one channel and an
+	  echo thread returns it through another; each round trip is timed,
+	  and the percentiles are reported.
+	- connect: a client thread repeatedly connects to a listener, sends a
+	  message of the given size and closes, while the main thread accepts,
+	  reads the message and closes. This measures the rate of connection
+	  setup and teardown.
+
+	A channel is a pipe, a single-producer/single-consumer pipe or
+	a connected pair of sockets.
+ */
+
+
+/* Upper bounds for the work of a single configuration */
+#define BENCH_BYTES (16*1024*1024)
+#define BENCH_MAX_MSGS 200000
+#define BENCH_MAX_ROUNDS 20000
+#define BENCH_CONNECTIONS 20000
+
+#define BENCH_MAX_MSG_SIZE (64*1024)
+#define BENCH_MAX_PRODUCERS 8
+
+/* The port used by socket channels */
+#define BENCH_PORT 100
+
+
+static double now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1E-9*t.tv_nsec;
+}
+
+static unsigned int bench_messages(unsigned int msg_size)
+{
+	unsigned int msgs = BENCH_BYTES / msg_size;
+	return (msgs > BENCH_MAX_MSGS) ? BENCH_MAX_MSGS : msgs;
+}
+
+static void write_full(Fid_t fid, const char* buf, unsigned int size)
+{
+	unsigned int count = 0;
+	while(count < size) {
+		int rc = Write(fid, buf+count, size-count);
+		CHECK_CONDITION(rc>0);
+		count += rc;
+	}
+}
+
+static void read_full(Fid_t fid, char* buf, unsigned int size)
+{
+	unsigned int count = 0;
+	while(count < size) {
+		int rc = Read(fid, buf+count, size-count);
+		CHECK_CONDITION(rc>0);
+		count += rc;
+	}
+}
+
+
+/****************************************************
+
+	Reporting
+
+ ****************************************************/
+
+/* The output format, set from the command line */
+static int json_output = 0;
+static int records = 0;
+
+struct result {
+	const char* benchmark;
+	const char* channel;
+	unsigned int msg_size;
+	unsigned int producers;
+	unsigned int messages;
+	size_t bytes;
+	double seconds;
+	/* Round-trip percentiles in usec, for latency benchmarks */
+	double p50, p90, p99, max;
+};
+
+static void report_begin()
+{
+	if(json_output)
+		printf("[\n");
+	else
+		printf("benchmark,channel,cores,msg_size,producers,messages,bytes,seconds,"
+			"MB_per_s,msgs_per_s,p50_us,p90_us,p99_us,max_us\n");
+}
+
+static void report(const struct result* R)
+{
+	double mbps = R->bytes/R->seconds/(1024.0*1024.0);
+	double mps = R->messages/R->seconds;
+
+	if(json_output)
+		printf("%s  {\"benchmark\": \"%s\", \"channel\": \"%s\", \"cores\": %u, "
+			"\"msg_size\": %u, \"producers\": %u, \"messages\": %u, \"bytes\": %zu, "
+			"\"seconds\": %.6f, \"MB_per_s\": %.3f, \"msgs_per_s\": %.0f, "
+			"\"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f}",
+			records ? ",\n" : "",
+			R->benchmark, R->channel, cpu_cores(), R->msg_size, R->producers,
+			R->messages, R->bytes, R->seconds, mbps, mps, R->p50, R->p90, R->p99, R->max);
+	else
+		printf("%s,%s,%u,%u,%u,%u,%zu,%.6f,%.3f,%.0f,%.2f,%.2f,%.2f,%.2f\n",
+			R->benchmark, R->channel, cpu_cores(), R->msg_size, R->producers,
+			R->messages, R->bytes, R->seconds, mbps, mps, R->p50, R->p90, R->p99, R->max);
+	records++;
+	fflush(stdout);
+}
+
+static void report_end()
+{
+	if(json_output)
+		printf("\n]\n");
+}
+
+
+/****************************************************
+
+	Channels
+
+ ****************************************************/
+
+struct channel {
+	const char* name;
+	int (*open)(Fid_t* rd, Fid_t* wr);
+};
+
+static int open_pipe(Fid_t* rd, Fid_t* wr)
+{
+	pipe_t pipe;
+	if(Pipe(&pipe)) return -1;
+	*rd = pipe.read;
+	*wr = pipe.write;
+	return 0;
+}
+
+static int open_spsc_pipe(Fid_t* rd, Fid_t* wr)
+{
+	pipe_t pipe;
+	if(PipeSPSC(&pipe, PIPE_GROWTH_LIMIT)) return -1;
+	*rd = pipe.read;
+	*wr = pipe.write;
+	return 0;
+}
+
+static int socket_connector(int argl, void* args)
+{
+	return Connect(*(Fid_t*)args, BENCH_PORT, 1000);
+}
+
+/* Data written to the client socket is read from the server socket */
+static int open_socket(Fid_t* rd, Fid_t* wr)
+{
+	Fid_t lsock = Socket(BENCH_PORT);
+	if(lsock == NOFILE || Listen(lsock)) return -1;
+
+	Fid_t cli = Socket(NOPORT);
+	Tid_t t = CreateThread(socket_connector, 0, &cli);
+	Fid_t srv = Accept(lsock);
+
+	int rc;
+	ThreadJoin(t, &rc);
+	Close(lsock);
+	if(srv == NOFILE || rc != 0) return -1;
+
+	/* The directions we do not use */
+	ShutDown(cli, SHUTDOWN_READ);
+	ShutDown(srv, SHUTDOWN_WRITE);
+
+	*rd = srv;
+	*wr = cli;
+	return 0;
+}
+
+static struct channel channels[] = {
+	{ "pipe", open_pipe },
+	{ "spsc_pipe", open_spsc_pipe },
+	{ "socket", open_socket },
+	{ NULL, NULL }
+};
+
+
+/****************************************************
+
+	Throughput and scaling
+
+ ****************************************************/
+
+struct producer_args {
+	Fid_t fid;
+	unsigned int msg_size;
+	unsigned int msgs;
+	unsigned int* running;	/* The last producer to finish closes fid */
+};
+
+static int stream_producer(int argl, void* args)
+{
+	struct producer_args* A = args;
+	char* buffer = malloc(A->msg_size);
+	memset(buffer, 'x', A->msg_size);
+
+	for(unsigned int i=0; i<A->msgs; i++)
+		write_full(A->fid, buffer, A->msg_size);
+
+	if(__atomic_sub_fetch(A->running, 1, __ATOMIC_SEQ_CST) == 0)
+		Close(A->fid);
+	free(buffer);
+	return 0;
+}
+
+static void bench_throughput(const char* name, struct channel* ch,
+	unsigned int msg_size, unsigned int producers)
+{
+	Fid_t rd, wr;
+	CHECK(ch->open(&rd, &wr));
+
+	unsigned int running = producers;
+	struct producer_args A = {
+		.fid=wr, .msg_size=msg_size, .msgs=bench_messages(msg_size)/producers,
+		.running=&running
+	};
+
+	static char buffer[BENCH_MAX_MSG_SIZE];
+	size_t total = 0;
+
+	double t0 = now();
+	Tid_t t[BENCH_MAX_PRODUCERS];
+	for(unsigned int i=0; i<producers; i++)
+		t[i] = CreateThread(stream_producer, 0, &A);
+	int rc;
+	while((rc = Read(rd, buffer, sizeof(buffer))) > 0)
+		total += rc;
+	for(unsigned int i=0; i<producers; i++)
+		ThreadJoin(t[i], NULL);
+	double dt = now() - t0;
+
+	Close(rd);
+	CHECK_CONDITION(total == (size_t)A.msgs * producers * msg_size);
+
+	struct result R = {
+		.benchmark=name, .channel=ch->name, .msg_size=msg_size, .producers=producers,
+		.messages=A.msgs*producers, .bytes=total, .seconds=dt
+	};
+	report(&R);
+}
+
+
+/****************************************************
+
+	Latency
+
+ ****************************************************/
+
+struct echo_args {
+	Fid_t in, out;
+	unsigned int msg_size;
+	unsigned int rounds;
+};
+
+static int echo_server(int argl, void* args)
+{
+	struct echo_args* A = args;
+	char* buffer = malloc(A->msg_size);
+	for(unsigned int i=0; i<A->rounds; i++) {
+		read_full(A->in, buffer, A->msg_size);
+		write_full(A->out, buffer, A->msg_size);
+	}
+	free(buffer);
+	return 0;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double* sorted, unsigned int n, double p)
+{
+	unsigned int i = (unsigned int)(p * (n-1));
+	return sorted[i];
+}
+
+static void bench_latency(struct channel* ch, unsigned int msg_size)
+{
+	/* A channel in each direction */
+	Fid_t ping_rd, ping_wr, pong_rd, pong_wr;
+	CHECK(ch->open(&ping_rd, &ping_wr));
+	CHECK(ch->open(&pong_rd, &pong_wr));
+
+	unsigned int rounds = bench_messages(msg_size);
+	if(rounds > BENCH_MAX_ROUNDS) rounds = BENCH_MAX_ROUNDS;
+
+	struct echo_args A = { .in=ping_rd, .out=pong_wr, .msg_size=msg_size, .rounds=rounds };
+	Tid_t t = CreateThread(echo_server, 0, &A);
+
+	char* buffer = malloc(msg_size);
+	memset(buffer, 'x', msg_size);
+	double* rtt = malloc(rounds * sizeof(double));
+
+	double t0 = now();
+	for(unsigned int i=0; i<rounds; i++) {
+		double t1 = now();
+		write_full(ping_wr, buffer, msg_size);
+		read_full(pong_rd, buffer, msg_size);
+		rtt[i] = 1E6*(now() - t1);
+	}
+	double dt = now() - t0;
+	ThreadJoin(t, NULL);
+
+	qsort(rtt, rounds, sizeof(double), compare_doubles);
+	struct result R = {
+		.benchmark="latency", .channel=ch->name, .msg_size=msg_size, .producers=1,
+		.messages=rounds, .bytes=2*(size_t)rounds*msg_size, .seconds=dt,
+		.p50=percentile(rtt, rounds, 0.50), .p90=percentile(rtt, rounds, 0.90),
+		.p99=percentile(rtt, rounds, 0.99), .max=rtt[rounds-1]
+	};
+	report(&R);
+
+	free(rtt);
+	free(buffer);
+	Close(ping_rd); Close(ping_wr); Close(pong_rd); Close(pong_wr);
+}
+
+
+/****************************************************
+
+	Connection setup and teardown
+
+ ****************************************************/
+
+struct client_args {
+	unsigned int msg_size;
+	unsigned int connections;
+};
+
+static int connect_client(int argl, void* args)
+{
+	struct client_args* A = args;
+	char* buffer = malloc(A->msg_size);
+	memset(buffer, 'x', A->msg_size);
+
+	for(unsigned int i=0; i<A->connections; i++) {
+		Fid_t sock = Socket(NOPORT);
+		CHECK_CONDITION(sock != NOFILE);
+		CHECK(Connect(sock, BENCH_PORT, 1000));
+		write_full(sock, buffer, A->msg_size);
+		Close(sock);
+	}
+	free(buffer);
+	return 0;
+}
+
+static void bench_connect(unsigned int msg_size)
+{
+	Fid_t lsock = Socket(BENCH_PORT);
+	CHECK_CONDITION(lsock != NOFILE);
+	CHECK(Listen(lsock));
+
+	struct client_args A = { .msg_size=msg_size, .connections=BENCH_CONNECTIONS };
+	char* buffer = malloc(msg_size);
+	double* rtt = malloc(A.connections * sizeof(double));
+
+	double t0 = now();
+	Tid_t t = CreateThread(connect_client, 0, &A);
+	for(unsigned int i=0; i<A.connections; i++) {
+		double t1 = now();
+		Fid_t sock = Accept(lsock);
+		CHECK_CONDITION(sock != NOFILE);
+		read_full(sock, buffer, msg_size);
+		Close(sock);
+		rtt[i] = 1E6*(now() - t1);
+	}
+	ThreadJoin(t, NULL);
+	double dt = now() - t0;
+	Close(lsock);
+
+	/* The percentiles are of the time to serve each connection */
+	qsort(rtt, A.connections, sizeof(double), compare_doubles);
+	struct result R = {
+		.benchmark="connect", .channel="socket", .msg_size=msg_size, .producers=1,
+		.messages=A.connections, .bytes=(size_t)A.connections*msg_size, .seconds=dt,
+		.p50=percentile(rtt, A.connections, 0.50), .p90=percentile(rtt, A.connections, 0.90),
+		.p99=percentile(rtt, A.connections, 0.99), .max=rtt[A.connections-1]
+	};
+	report(&R);
+
+	free(rtt);
+	free(buffer);
+}
+
+
+static int bench_boot(int argl, void* args)
+{
+	report_begin();
+	for(struct channel* ch = channels; ch->name; ch++) {
+		for(unsigned int sz=1; sz <= BENCH_MAX_MSG_SIZE; sz *= 4)
+			bench_throughput("throughput", ch, sz, 1);
+		for(unsigned int sz=1; sz <= BENCH_MAX_MSG_SIZE; sz *= 16)
+			bench_latency(ch, sz);
+
+		/* Single-producer pipes cannot be shared */
+		if(ch->open == open_spsc_pipe) continue;
+		for(unsigned int p=2; p <= BENCH_MAX_PRODUCERS; p *= 2)
+			for(unsigned int sz=64; sz <= 4096; sz *= 64)
+				bench_throughput("scaling", ch, sz, p);
+	}
+	for(unsigned int sz=1; sz <= 4096; sz *= 64)
+		bench_connect(sz);
+	report_end();
+	return 0;
+}
+
+/****************************************************/
+
+void usage(const char* pname)
+{
+  printf("usage:\n  %s [-j] [<ncores>]\n\n  \
+    where:\n\
+    -j prints the results as JSON (the default is CSV)\n\
+    <ncores> is the number of cpu cores to use (default 1).\n",
+	 pname);
+  exit(1);
+}
+
+
+int main(int argc, const char** argv)
+{
+  unsigned int ncores = 1;
+  const char* pname = argv[0];
+
+  if(argc > 1 && strcmp(argv[1], "-j")==0) {
+    json_output = 1;
+    argc--; argv++;
+  }
+
+  if(argc > 2) usage(pname);
+  if(argc == 2) ncores = atoi(argv[1]);
+  if(ncores < 1 || ncores > MAX_CORES) usage(pname);
+
+  boot(ncores, 0, bench_boot, 0, NULL);
+  return 0;
+}
@@ -10,6 +10,8 @@
 #include <sys/stat.h>
 #include <sys/select.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/sysinfo.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -410,6 +412,7 @@ typedef struct io_device
 {
 	int fd;              		/* file descriptor */
 	io_direction iodir;  		/* device direction */
+	Interrupt intno;			/* interrupt raised when ready */
 
 	Core* volatile int_core;	/* core to receive interrupts */
 	volatile int ready;  		/* ready flag */
@@ -451,10 +454,11 @@ static int io_device_check(io_device* dev)
 /*
 	Initialize device
  */
-static void io_device_init(io_device* this, int fd, io_direction iodir)
+static void io_device_init(io_device* this, int fd, io_direction iodir, Interrupt intno)
 {
 	this->fd = fd;
 	this->iodir = iodir;
+	this->intno = intno;
 	this->int_core = &CORE[0];
 	this->ready = io_device_ready(fd, iodir);
 	this->last_int = get_coarse_time();
@@ -536,8 +540,8 @@ static uint nterm = 0;
  */
 static void terminal_init(terminal* this, int fdin, int fdout)
 {
-	io_device_init(& this->kbd, fdin, IODIR_RX);
-	io_device_init(& this->con, fdout, IODIR_TX);
+	io_device_init(& this->kbd, fdin, IODIR_RX, SERIAL_RX_READY);
+	io_device_init(& this->con, fdout, IODIR_TX, SERIAL_TX_READY);
 }
 
 /*
@@ -551,6 +555,88 @@ static int terminal_destroy(terminal* this)
 
 
 
+/*
+	A socket bridge encapsulates a listening Unix-domain socket, as an
+	io_device which is ready when a client is pending.
+
+	Each accepted connection is a pair of io_devices on the same
+	socket, one for each direction. The connection table is shared by the
+	cores (which accept and close connections) and the PIC thread, so it is
+	protected by a mutex. A closed connection is only marked, and its socket 
+	is closed by the PIC thread, so that it is never closed under select().
+ */
+typedef struct bridge
+{
+	uint port;
+	struct sockaddr_un addr;
+	io_device lsn;
+} bridge;
+
+typedef struct bridge_conn
+{
+	int used;					/* the slot holds a connection */
+	int closing;				/* the connection is to be closed by the PIC */
+	io_device rx, tx;
+} bridge_conn;
+
+/* The bridge table */
+static bridge BRIDGE[MAX_BRIDGES];
+
+/* Current number of bridges */
+static uint nbridge = 0;
+
+/* The connection table and its lock */
+static bridge_conn BCONN[MAX_BRIDGE_CONNECTIONS];
+static pthread_mutex_t bridge_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	Create the listening socket of the bridge
+ */
+static void bridge_init(bridge* this, uint port, const char* path)
+{
+	this->port = port;
+	memset(& this->addr, 0, sizeof(this->addr));
+	this->addr.sun_family = AF_UNIX;
+	CHECK_CONDITION(strlen(path) < sizeof(this->addr.sun_path));
+	strcpy(this->addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	CHECK(fd);
+	unlink(path);
+	CHECK(bind(fd, (struct sockaddr*) & this->addr, sizeof(this->addr)));
+	CHECK(listen(fd, SOMAXCONN));
+
+	io_device_init(& this->lsn, fd, IODIR_RX, BRIDGE_READY);
+}
+
+/*
+	Close the listening socket and remove its path
+ */
+static int bridge_destroy(bridge* this)
+{
+	int rc = io_device_destroy(& this->lsn);
+	unlink(this->addr.sun_path);
+	return rc;
+}
+
+/*
+	Close the connections marked as closing (or all of them). 
+	Must be called with the bridge_mutex held.
+ */
+static void bridge_collect(int all)
+{
+	for(uint c=0; c<MAX_BRIDGE_CONNECTIONS; c++) {
+		bridge_conn* conn = & BCONN[c];
+		if(conn->used && (conn->closing || all)) {
+			io_device_destroy(& conn->rx);
+			conn->used = 0;
+			conn->closing = 0;
+		}
+	}
+}
+
+
+
 
 
 /*
@@ -693,7 +779,22 @@ static inline void pic_add_terminal(pic_selector* ps, terminal* term)
 }
 
 
-static void term_dev_raise_if_ready(io_device* dev, pic_selector* ps)
+static inline void pic_add_bridges(pic_selector* ps)
+{
+	for(uint b=0; b<nbridge; b++)
+		pic_add_io_device(ps, & BRIDGE[b].lsn);
+
+	for(uint c=0; c<MAX_BRIDGE_CONNECTIONS; c++) {
+		bridge_conn* conn = & BCONN[c];
+		if(conn->used && !conn->closing) {
+			pic_add_io_device(ps, & conn->rx);
+			pic_add_io_device(ps, & conn->tx);
+		}
+	}
+}
+
+
+static void io_device_raise_if_ready(io_device* dev, pic_selector* ps)
 {
 	if(    pic_is_ready(ps, dev->iodir, dev->fd) 
 		|| (ps->system_clock - dev->last_int) > SERIAL_TIMEOUT 
@@ -702,11 +803,21 @@ static void term_dev_raise_if_ready(io_device* dev, pic_selector* ps)
 		dev->ready = 1;
 		dev->last_int = ps->system_clock;
 		Core* core = (Core*) dev->int_core;
-		switch(dev->iodir) {
-			case IODIR_RX:
-				raise_interrupt(core, SERIAL_RX_READY); break;
-			case IODIR_TX:
-				raise_interrupt(core, SERIAL_TX_READY); break;
+		raise_interrupt(core, dev->intno);
+	}
+}
+
+
+static void bridges_raise_if_ready(pic_selector* ps)
+{
+	for(uint b=0; b<nbridge; b++)
+		io_device_raise_if_ready(& BRIDGE[b].lsn, ps);
+
+	for(uint c=0; c<MAX_BRIDGE_CONNECTIONS; c++) {
+		bridge_conn* conn = & BCONN[c];
+		if(conn->used && !conn->closing) {
+			io_device_raise_if_ready(& conn->rx, ps);
+			io_device_raise_if_ready(& conn->tx, ps);
 		}
 	}
 }
@@ -743,6 +854,11 @@ static void PIC_daemon(void)
 		for(uint i=0; i<nterm; i++)
 			pic_add_terminal(&ps, & TERM[i]);
 
+		CHECKRC(pthread_mutex_lock(& bridge_mutex));
+		bridge_collect(0);
+		pic_add_bridges(&ps);
+		CHECKRC(pthread_mutex_unlock(& bridge_mutex));
+
 		pic_add_fd(&ps, IODIR_RX, sigalrmfd);
 		pic_add_fd(&ps, IODIR_RX, sigusr1fd);
 
@@ -769,10 +885,14 @@ static void PIC_daemon(void)
 		for(uint i=0; i<nterm; i++) {
 			terminal* term = & TERM[i];			
 
-			term_dev_raise_if_ready(& term->con, &ps);
-			term_dev_raise_if_ready(& term->kbd, &ps);
+			io_device_raise_if_ready(& term->con, &ps);
+			io_device_raise_if_ready(& term->kbd, &ps);
 		}
 
+		CHECKRC(pthread_mutex_lock(& bridge_mutex));
+		bridges_raise_if_ready(&ps);
+		CHECKRC(pthread_mutex_unlock(& bridge_mutex));
+
 
 	}
 
@@ -852,10 +972,23 @@ int vm_config_terminals(vm_config* vmc, uint serialno, int nowait)
 }
 
 
+int vm_config_bridge(vm_config* vmc, uint port, const char* path)
+{
+	if(vmc->bridgeno >= MAX_BRIDGES) return -1;
+	if(strlen(path) >= sizeof(((struct sockaddr_un*)NULL)->sun_path)) return -1;
+
+	vmc->bridge_port[vmc->bridgeno] = port;
+	vmc->bridge_path[vmc->bridgeno] = path;
+	vmc->bridgeno++;
+	return 0;
+}
+
+
 void vm_configure(vm_config* vmc, interrupt_handler bootfunc, uint cores, uint serialno)
 {
 	vmc->bootfunc = bootfunc;
 	vmc->cores = cores;
+	vmc->bridgeno = 0;
 	CHECK(vm_config_terminals(vmc, serialno, 0));
 }
 
@@ -876,6 +1009,7 @@ void vm_run(vm_config* vmc)
 	CHECK_CONDITION(vmc->cores > 0 && vmc->cores <= MAX_CORES);
 	CHECK_CONDITION(ncores==0);
 	CHECK_CONDITION(vmc->serialno <= MAX_TERMINALS);
+	CHECK_CONDITION(vmc->bridgeno <= MAX_BRIDGES);
 
 	/* This is called only once in the life of the process. */
 	CHECKRC(pthread_once(&init_control, initialize));
@@ -892,6 +1026,11 @@ void vm_run(vm_config* vmc)
 	for(uint i=0; i<nterm; i++)
 		terminal_init(& TERM[i], vmc->serial_in[i], vmc->serial_out[i]);
 
+	/* Initialize socket bridges */
+	nbridge = vmc->bridgeno;
+	for(uint b=0; b<nbridge; b++)
+		bridge_init(& BRIDGE[b], vmc->bridge_port[b], vmc->bridge_path[b]);
+
 	/* Init the cores */
 	ncores = vmc->cores;
 
@@ -956,6 +1095,12 @@ void vm_run(vm_config* vmc)
 		CHECK(terminal_destroy(& TERM[i]));
 	nterm = 0;
 
+	/* Finalize socket bridges, dropping any open connections */
+	bridge_collect(1);
+	for(uint b=0; b<nbridge; b++)
+		CHECK(bridge_destroy(& BRIDGE[b]));
+	nbridge = 0;
+
 	/* Restore signal mask before VM execution */
 	CHECK(sigaction(SIGUSR1, &USR1_saved_sigaction, NULL));
 
@@ -1223,3 +1368,113 @@ int bios_write_serial(uint serial, char value)
 }
 
 
+
+uint bios_bridges()
+{
+	return nbridge;
+}
+
+
+uint bios_bridge_port(uint bridge)
+{
+	return BRIDGE[bridge].port;
+}
+
+
+/*
+	Accept a pending client of 'bridge' into a free connection slot.
+ */
+int bios_bridge_accept(uint bridge)
+{
+	io_device* lsn = & BRIDGE[bridge].lsn;
+
+	CHECKRC(pthread_mutex_lock(& bridge_mutex));
+
+	int c = 0;
+	while(c < MAX_BRIDGE_CONNECTIONS && BCONN[c].used) c++;
+
+	int fd = -1;
+	if(c < MAX_BRIDGE_CONNECTIONS)
+		while((fd = accept4(lsn->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC))==-1 && errno==EINTR);
+
+	if(fd == -1) {
+		CHECKRC(pthread_mutex_unlock(& bridge_mutex));
+		if(lsn->ready) {
+			lsn->ready = 0;
+			interrupt_pic_thread();
+		}
+		return -1;
+	}
+
+	bridge_conn* conn = & BCONN[c];
+	io_device_init(& conn->rx, fd, IODIR_RX, BRIDGE_READY);
+	io_device_init(& conn->tx, fd, IODIR_TX, BRIDGE_READY);
+	conn->closing = 0;
+	conn->used = 1;
+
+	CHECKRC(pthread_mutex_unlock(& bridge_mutex));
+
+	/* Have the PIC watch the new connection */
+	interrupt_pic_thread();
+	return c;
+}
+
+
+int bios_bridge_read(uint conn, char* buf, uint size)
+{
+	io_device* dev = & BCONN[conn].rx;
+	int rc;
+	while((rc=read(dev->fd, buf, size))==-1 && errno == EINTR);
+
+	if(rc >= 0) return rc;
+	if(errno != EAGAIN && errno != EWOULDBLOCK) return 0;	/* reset by the client */
+
+	if(dev->ready) {
+		dev->ready = 0;
+		interrupt_pic_thread();
+	}
+	return -1;
+}
+
+
+int bios_bridge_write(uint conn, const char* buf, uint size)
+{
+	io_device* dev = & BCONN[conn].tx;
+	int rc;
+	while((rc=send(dev->fd, buf, size, MSG_NOSIGNAL))==-1 && errno == EINTR);
+
+	if(rc >= 0) return rc;
+	if(errno != EAGAIN && errno != EWOULDBLOCK) return -1;	/* closed by the client */
+
+	if(dev->ready) {
+		dev->ready = 0;
+		interrupt_pic_thread();
+	}
+	return 0;
+}
+
+
+int bios_bridge_ready(uint conn)
+{
+	struct pollfd pfd = { .fd = BCONN[conn].rx.fd, .events = POLLIN | POLLOUT };
+	CHECK(poll(&pfd, 1, 0));
+	return ((pfd.revents & (POLLIN|POLLHUP|POLLERR)) ? BRIDGE_READABLE : 0)
+		| ((pfd.revents & (POLLOUT|POLLHUP|POLLERR)) ? BRIDGE_WRITABLE : 0);
+}
+
+
+void bios_bridge_shutdown(uint conn, int how)
+{
+	static const int mode[] = { -1, SHUT_RD, SHUT_WR, SHUT_RDWR };
+	if(how < 1 || how > 3) return;
+	shutdown(BCONN[conn].rx.fd, mode[how]);
+}
+
+
+void bios_bridge_close(uint conn)
+{
+	CHECKRC(pthread_mutex_lock(& bridge_mutex));
+	BCONN[conn].closing = 1;
+	CHECKRC(pthread_mutex_unlock(& bridge_mutex));
+	interrupt_pic_thread();
+}
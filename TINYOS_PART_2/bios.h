@@ -98,6 +98,21 @@
 	Also, each interrupt is sent if the serial device timeouts (is inactive for
 	about 300 msec).
 
+	Socket bridges
+	--------------
+
+	The virtual machine may also have a number of socket bridges, which
+	connect it to clients on the host. Each bridge is a Unix-domain socket
+	listening on a host path, and it is tagged with a number (which the
+	kernel takes to be a port).
+
+	Connections made by host clients to the path are accepted by the VM
+	one at a time, and each is given a connection number, up to 
+	@c MAX_BRIDGE_CONNECTIONS-1. Data is transferred to and from a
+	connection in blocks. As for serial ports, a transfer may fail if the
+	connection is not ready, and a @c BRIDGE_READY interrupt is raised when
+	a non-ready bridge or connection becomes ready (or timeouts).
+
  */
 
 
@@ -123,6 +138,8 @@ typedef enum Interrupt
 						   from a serial port */
 	SERIAL_TX_READY,	/**< Raised when a serial port is ready to accept 
 						   data */
+	BRIDGE_READY,		/**< Raised when a socket bridge has a pending 
+						   connection, or a bridge connection is ready */
 
 	maximum_interrupt_no 
 } Interrupt;
@@ -134,6 +151,11 @@ typedef enum Interrupt
 /** @brief Maximum number of terminals for a virtual machine. */
 #define MAX_TERMINALS 4
 
+/** @brief Maximum number of socket bridges for a virtual machine. */
+#define MAX_BRIDGES 4
+
+/** @brief Maximum number of open socket bridge connections. */
+#define MAX_BRIDGE_CONNECTIONS 64
 
 
 /**
@@ -154,6 +176,9 @@ typedef enum Interrupt
 	  (@c serial_out) file descriptor will be written to. These file descriptors
 	  should correspond to some pipe-like Linux stream (e.g., pipe, FIFO or socket).
 
+	- The number of socket bridges, stored in @c bridgeno, and for each one
+	  its port and host path.
+
  */
 typedef struct vm_config {
 
@@ -198,6 +223,19 @@ typedef struct vm_config {
 		must be valid in this structure.
 	*/
 	int serial_out[MAX_TERMINALS];
+
+	/** @brief The number of socket bridges, between 0 and @c MAX_BRIDGES. */
+	uint bridgeno;
+
+	/** @brief The port of each socket bridge. */
+	uint bridge_port[MAX_BRIDGES];
+
+	/** @brief The host path of each socket bridge. 
+
+		A Unix-domain socket is created at this path when the VM boots 
+		(replacing any file already there), and removed when it shuts down.
+	*/
+	const char* bridge_path[MAX_BRIDGES];
 } vm_config;
 
 
@@ -222,6 +260,21 @@ typedef struct vm_config {
 int vm_config_terminals(vm_config* vmc, uint serialno, int nowait);
 
 
+/**
+	@brief Add a socket bridge to a VM configuration.
+
+	Host clients connecting to the Unix-domain socket at @c path will be
+	reported to the VM as connections on bridge @c port.
+
+	@param vmc the configuration to add to
+	@param port the port of the bridge
+	@param path the host path of the bridge, which must remain valid until the VM runs
+	@return 0 on success, -1 if there are already @c MAX_BRIDGES bridges, or the
+		path is too long
+*/
+int vm_config_bridge(vm_config* vmc, uint port, const char* path);
+
+
 /**
 	@brief Initialize a VM configuration with passed parameters.
 
@@ -546,4 +599,73 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Return the number of socket bridges.
+
+	This is the number specified at the initialization of the VM.
+ */
+uint bios_bridges();
+
+/**
+	@brief Return the port of a socket bridge.
+ */
+uint bios_bridge_port(uint bridge);
+
+/**
+	@brief Accept a host connection on a socket bridge.
+
+	If a host client has connected to the bridge, return its connection number.
+	If not, or if there are already @c MAX_BRIDGE_CONNECTIONS open, return -1;
+	a @c BRIDGE_READY interrupt will be raised when a client may be pending.
+
+	@param bridge the bridge to accept on
+	@return a connection number, or -1
+ */
+int bios_bridge_accept(uint bridge);
+
+/**
+	@brief Read from a bridge connection.
+
+	Read up to @c size bytes into @c buf. Return the number of bytes read, 0 if
+	the host client has closed the connection, or -1 if there is no data; then, 
+	a @c BRIDGE_READY interrupt will be raised when there is.
+ */
+int bios_bridge_read(uint conn, char* buf, uint size);
+
+/**
+	@brief Write to a bridge connection.
+
+	Write up to @c size bytes from @c buf. Return the number of bytes written,
+	0 if the connection cannot accept data (then, a @c BRIDGE_READY interrupt will 
+	be raised when it can), or -1 if the host client has closed the connection.
+ */
+int bios_bridge_write(uint conn, const char* buf, uint size);
+
+/** @brief Returned by @c bios_bridge_ready if a read would not fail. */
+#define BRIDGE_READABLE 1
+/** @brief Returned by @c bios_bridge_ready if a write would not fail. */
+#define BRIDGE_WRITABLE 2
+
+/**
+	@brief Return which transfers on a bridge connection would not fail now.
+
+	@return a mask of @c BRIDGE_READABLE and @c BRIDGE_WRITABLE
+ */
+int bios_bridge_ready(uint conn);
+
+/**
+	@brief Shut down one or both directions of a bridge connection.
+
+	@param how 1 for reading, 2 for writing, 3 for both
+ */
+void bios_bridge_shutdown(uint conn, int how);
+
+/**
+	@brief Close a bridge connection.
+
+	The connection number may be returned again by @c bios_bridge_accept.
+ */
+void bios_bridge_close(uint conn);
+
+
 #endif
@@ -29,37 +29,116 @@
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
+ 	Spinning is adaptive: a waiter keeps spinning only while the owner of
+ 	the mutex is the current thread of some other core. If the owner has been
+ 	descheduled, spinning is wasted CPU, so the waiter yields at once. 
+ 	The owner is only a hint (it may be stale or NULL); when it is not known,
+ 	we spin for a bounded number of iterations as before.
+
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
+
+#if defined(MUTEX_STATISTICS)
+static mutex_statistics mutex_stats;
+#define MUTEX_STAT(field, n) __atomic_fetch_add(& mutex_stats.field, (n), __ATOMIC_RELAXED)
+#else
+#define MUTEX_STAT(field, n) ((void)(n))
+#endif
+
+
+/*
+	Return 1 if the spinner should keep spinning on the lock.
+	We do not dereference the owner TCB (it may have been released);
+	we only compare it with the current thread of each core.
+ */
+static inline int mutex_owner_running(Mutex* lock)
+{
+	TCB* owner = __atomic_load_n(& lock->owner, __ATOMIC_RELAXED);
+	if(owner == NULL) return 1;   /* Owner unknown, it has just locked */
+
+	for(uint core=0; core < cpu_cores(); core++)
+		if(__atomic_load_n(& cctx[core].current_thread, __ATOMIC_RELAXED) == owner)
+			return 1;
+	return 0;
+}
+
+
 void Mutex_Lock(Mutex* lock)
 {
 #define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+  if(__atomic_test_and_set(& lock->lock,__ATOMIC_ACQUIRE)) {
+    int can_yield = cpu_interrupts_enabled();
+    unsigned long spins = 0, yields = 0, owner_idle = 0;
+
+    do {
+      int spin=MUTEX_SPINS;
+      while(__atomic_load_n(& lock->lock, __ATOMIC_RELAXED)) {
 #if defined(__x86__) || defined(__x86_64__)
-      __builtin_ia32_pause();
+        __builtin_ia32_pause();
 #endif
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
-      		yield(SCHED_MUTEX); 
+        spins++;
+        if(spin>0 && mutex_owner_running(lock)) 
+          spin--; 
+        else if(can_yield) { 
+          yields++;
+          if(spin>0) owner_idle++;
+          spin=MUTEX_SPINS; 
+          yield(SCHED_MUTEX); 
+        }
+        else
+          spin=MUTEX_SPINS;
       }
-    }
+    } while(__atomic_test_and_set(& lock->lock,__ATOMIC_ACQUIRE));
+
+    /* The counters are shared, so we update them once per acquisition */
+    MUTEX_STAT(contended, 1);
+    MUTEX_STAT(spins, spins);
+    MUTEX_STAT(yields, yields);
+    MUTEX_STAT(owner_idle, owner_idle);
+    MUTEX_STAT(spin_wins, yields==0);
   }
 #undef MUTEX_SPINS
+
+  /* 
+    Record the owner, for the benefit of spinners. We may be preempted and
+    moved to another core at any time, so we record only the thread; 
+    cur_thread() finds it without toggling preemption.
+   */
+  __atomic_store_n(& lock->owner, cur_thread(), __ATOMIC_RELAXED);
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  __atomic_store_n(& lock->owner, NULL, __ATOMIC_RELAXED);
+  __atomic_clear(& lock->lock, __ATOMIC_RELEASE);
+}
+
+
+#if defined(MUTEX_STATISTICS)
+
+void get_mutex_statistics(mutex_statistics* stats)
+{
+	stats->contended = __atomic_load_n(& mutex_stats.contended, __ATOMIC_RELAXED);
+	stats->spins = __atomic_load_n(& mutex_stats.spins, __ATOMIC_RELAXED);
+	stats->yields = __atomic_load_n(& mutex_stats.yields, __ATOMIC_RELAXED);
+	stats->owner_idle = __atomic_load_n(& mutex_stats.owner_idle, __ATOMIC_RELAXED);
+	stats->spin_wins = __atomic_load_n(& mutex_stats.spin_wins, __ATOMIC_RELAXED);
+}
+
+void print_mutex_statistics()
+{
+	mutex_statistics st;
+	get_mutex_statistics(&st);
+	fprintf(stderr, "Mutex: contended=%lu spins=%lu (avg %.1lf) spin_wins=%lu yields=%lu owner_idle=%lu\n",
+		st.contended, st.spins, st.contended ? (double)st.spins/st.contended : 0.0,
+		st.spin_wins, st.yields, st.owner_idle);
 }
 
+#endif
+
 
 /*
 	Condition variables.	
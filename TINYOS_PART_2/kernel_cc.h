@@ -30,6 +30,44 @@
 #include "kernel_sched.h"
 
 
+/*
+	Define this to collect contention statistics for Mutex_Lock. 
+	The statistics are printed to stderr when the kernel shuts down.
+ */
+#if 0
+#define MUTEX_STATISTICS
+#endif
+
+#if defined(MUTEX_STATISTICS)
+
+/**
+	@brief Contention statistics for mutexes.
+
+	These counters are shared by all mutexes and are updated only on
+	the contended path of @c Mutex_Lock, once per acquisition. They are 
+	meant to help tune the spinning policy.
+  */
+typedef struct mutex_statistics {
+	unsigned long contended;   /**< @brief Lock attempts that found the mutex held */
+	unsigned long spins;       /**< @brief Total spin iterations */
+	unsigned long spin_wins;   /**< @brief Contended locks acquired without yielding */
+	unsigned long yields;      /**< @brief Times a spinner yielded the core */
+	unsigned long owner_idle;  /**< @brief Yields because the owner was not running */
+} mutex_statistics;
+
+/**
+	@brief Return a snapshot of the mutex statistics.
+  */
+void get_mutex_statistics(mutex_statistics* stats);
+
+/**
+	@brief Print the mutex statistics to stderr.
+  */
+void print_mutex_statistics();
+
+#endif
+
+
 
 
 /*
@@ -42,7 +42,7 @@ int nulldev_close(void* dev)
   return 0;
 }
 
-void* nulldev_open(uint minor)
+void* nulldev_open(uint minor, FCB* fcb)
 {
   return NULL;
 }
@@ -70,10 +70,21 @@ typedef struct serial_device_control_block {
   uint devno;
   Mutex spinlock;
   CondVar rx_ready;
+  int peeked;       /* set if 'peek' holds a byte read by serial_ready */
+  char peek;
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
 
+/* 
+  Each open of a serial device gets its own stream object, 
+  so that reads can check the flags of their FCB.
+ */
+typedef struct serial_stream {
+  serial_dcb_t* dcb;
+  FCB* fcb;
+} serial_stream_t;
+
 
 
 /*
@@ -100,18 +111,28 @@ void serial_rx_handler()
  */
 int serial_read(void* dev, char *buf, unsigned int size)
 {
-  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  serial_stream_t* stream = (serial_stream_t*)dev;
+  serial_dcb_t* dcb = stream->dcb;
 
   preempt_off;            /* Stop preemption */
 
   uint count =  0;
 
+  if(dcb->peeked && size>0) {
+    buf[count++] = dcb->peek;
+    dcb->peeked = 0;
+  }
+
   while(count<size) {
     int valid = bios_read_serial(dcb->devno, &buf[count]);
     
     if (valid) {
       count++;
     }
+    else if(count==0 && is_nonblocking(stream->fcb)) {
+      preempt_on;
+      return WOULDBLOCK;
+    }
     else if(count==0) {
       kernel_wait(&dcb->rx_ready, SCHED_IO);
     }
@@ -141,7 +162,8 @@ void serial_tx_handler()
 */
 int serial_write(void* dev, const char* buf, unsigned int size)
 {
-  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  serial_stream_t* stream = (serial_stream_t*)dev;
+  serial_dcb_t* dcb = stream->dcb;
 
   unsigned int count = 0;
   while(count < size) {
@@ -150,6 +172,10 @@ int serial_write(void* dev, const char* buf, unsigned int size)
     if(success) {
       count++;
     } 
+    else if(count==0 && is_nonblocking(stream->fcb))
+    {
+      return WOULDBLOCK;
+    }
     else if(count==0)
     {
       yield(SCHED_IO);
@@ -162,16 +188,39 @@ int serial_write(void* dev, const char* buf, unsigned int size)
 }
 
 
+/*
+  There is no way to test for input without reading it, so
+  keep the byte we read for the next serial_read. The byte is kept 
+  in the device, so that it is read through any stream on the terminal.
+ */
+int serial_ready(void* dev)
+{
+  serial_dcb_t* dcb = ((serial_stream_t*)dev)->dcb;
+
+  if(! dcb->peeked) {
+    int pre = preempt_off;
+    dcb->peeked = bios_read_serial(dcb->devno, &dcb->peek);
+    if(pre) preempt_on;
+  }
+
+  return STREAM_WRITABLE | (dcb->peeked ? STREAM_READABLE : 0);
+}
+
+
 int serial_close(void* dev) 
 {
+  free(dev);
   return 0;
 }
 
 
-void* serial_open(uint term)
+void* serial_open(uint term, FCB* fcb)
 {
   assert(term<bios_serial_ports());
-  return & serial_dcb[term];  
+  serial_stream_t* stream = (serial_stream_t*) xmalloc(sizeof(serial_stream_t));
+  stream->dcb = & serial_dcb[term];
+  stream->fcb = fcb;
+  return stream;
 }
 
 
@@ -180,11 +229,66 @@ file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
-  .Close = serial_close
+  .Close = serial_close,
+  .Ready = serial_ready,
+  .Polled = 1   /* Input arrives in interrupt context */
 };
 
 
 
+/*============================================
+
+  The socket bridge driver
+
+ ============================================*/
+
+/*
+  The streams of bridge connections are sockets (see kernel_socket.c); 
+  the driver only provides the condition variables to wait on, for each 
+  bridge and each connection.
+ */
+static CondVar bridge_accept_ready[MAX_BRIDGES];
+static CondVar bridge_conn_ready[MAX_BRIDGE_CONNECTIONS];
+
+/*
+  Interrupt-driven driver for bridges.
+ */
+void bridge_handler()
+{
+  int pre = preempt_off;
+
+  /* 
+    As for serial devices, we do not know what 
+    is ready, so we must signal everyone !
+   */
+  for(uint b=0; b<bios_bridges(); b++)
+    Cond_Broadcast(&bridge_accept_ready[b]);
+  for(uint c=0; c<MAX_BRIDGE_CONNECTIONS; c++)
+    Cond_Broadcast(&bridge_conn_ready[c]);
+
+  if(pre) preempt_on;
+}
+
+int bridge_lookup(int port)
+{
+  for(uint b=0; b<bios_bridges(); b++)
+    if(bios_bridge_port(b) == port)
+      return b;
+  return -1;
+}
+
+CondVar* bridge_accept_cv(uint bridge)
+{
+  return &bridge_accept_ready[bridge];
+}
+
+CondVar* bridge_conn_cv(uint conn)
+{
+  return &bridge_conn_ready[conn];
+}
+
+
+
 /***********************************
 
   The device table
@@ -211,19 +315,28 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].peeked = 0;
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
   cpu_interrupt_handler(SERIAL_TX_READY, serial_tx_handler);
+
+  /* Initialize the socket bridges */
+  for(uint b=0; b<MAX_BRIDGES; b++)
+    bridge_accept_ready[b] = COND_INIT;
+  for(uint c=0; c<MAX_BRIDGE_CONNECTIONS; c++)
+    bridge_conn_ready[c] = COND_INIT;
+
+  cpu_interrupt_handler(BRIDGE_READY, bridge_handler);
 }
 
 
-int device_open(Device_type major, uint minor, void** obj, file_ops** ops)
+int device_open(Device_type major, uint minor, FCB* fcb, void** obj, file_ops** ops)
 {
   assert(major < DEV_MAX);  
   if(minor >= devtable[major].devnum)
     return -1;
-  *obj = devtable[major].dev_fops.Open(minor);
+  *obj = devtable[major].dev_fops.Open(minor, fcb);
   *ops = &devtable[major].dev_fops;
   return 0;
 }
@@ -9,6 +9,7 @@
 
 #include "util.h"
 #include "bios.h"
+#include "tinyos.h"
 
 /**
   @file kernel_dev.h
@@ -45,14 +46,18 @@
   field of the FCB.
   @see FCB
  */
+struct iovec_s;
+
 typedef struct file_operations {
 
 	/**
 		@brief Return a stream object on which the other methods will operate.
 
-		This function is passed the minor number of the device to be accessed.
+		This function is passed the minor number of the device to be accessed,
+		and the FCB that the stream is opened for (so that the stream can
+		check its flags).
 	*/
-  	void* (*Open)(uint minor);
+  	void* (*Open)(uint minor, struct file_control_block* fcb);
 
 
   /** @brief Read operation.
@@ -92,6 +97,55 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+    /** @brief Splice operation (optional).
+
+      Move up to 'size' bytes from stream 'this' to the stream 'out', whose
+      operations are 'outops', by passing the stream's own storage directly 
+      to outops->Write, without an intermediate buffer.
+      Blocking and the return value are as for Read: the number of bytes
+      moved, 0 for "end of data", or -1 on error.
+
+      If this is NULL, Splice() copies through a kernel buffer.
+     */
+    int (*Splice)(void* this, void* out, struct file_operations* outops, unsigned int size);
+
+    /** @brief Vectored read operation (optional).
+
+      Read into the 'iovcnt' segments of 'iov', as Read would into their
+      concatenation. If this is NULL, ReadV() calls Read through a kernel buffer.
+     */
+    int (*ReadV)(void* this, const struct iovec_s* iov, unsigned int iovcnt);
+
+    /** @brief Vectored write operation (optional).
+
+      Write the 'iovcnt' segments of 'iov', as Write would their 
+      concatenation. If this is NULL, WriteV() calls Write once per segment.
+     */
+    int (*WriteV)(void* this, const struct iovec_s* iov, unsigned int iovcnt);
+
+    /** @brief Readiness operation (optional).
+
+      Return a mask of @c STREAM_READABLE, @c STREAM_WRITABLE, @c STREAM_HANGUP 
+      and @c STREAM_ERROR, describing which operations on 'this' would not block 
+      right now. It must not block.
+
+      A stream that provides it must call @c FCB_notify on its FCB(s) when 
+      the mask may have changed, unless 'Polled' is set. 
+      If this is NULL, the stream is considered always readable and writable.
+     */
+    int (*Ready)(void* this);
+
+    /** @brief Set if the stream cannot call @c FCB_notify (e.g., it changes
+      state in interrupt context). Then, @c Ready is re-checked periodically.
+     */
+    int Polled;
+
+    /** @brief Set if the stream serves Read and Write without the kernel lock,
+      in @c fast_Read and @c fast_Write. Then, @c sys_Read and @c sys_Write
+      cache the FCB in the calling thread (see @c fid_cache_enter).
+     */
+    int Unlocked;
 } file_ops;
 
 
@@ -142,11 +196,13 @@ void initialize_devices();
 
   This function opens a device by major and minor number, and
   returns a stream object, storing its pointer in @c obj, and a
-  @c file_ops record (storing it in @c ops).
+  @c file_ops record (storing it in @c ops). The stream is opened for
+  FCB @c fcb.
 
   It returns 0 on success and -1 on failure.
   */
-int device_open(Device_type major, uint minor, void** obj, file_ops** ops);
+int device_open(Device_type major, uint minor, struct file_control_block* fcb, 
+  void** obj, file_ops** ops);
 
 /**
   @brief Get the number of devices of a particular major number.
@@ -156,6 +212,25 @@ int device_open(Device_type major, uint minor, void** obj, file_ops** ops);
   */
 uint device_no(Device_type major);
 
+
+/**
+  @brief Return the socket bridge of a port, or -1 if the port is not bridged.
+
+  Connections from host clients to a bridged port are accepted by the 
+  listeners of the port (see kernel_socket.c).
+  */
+int bridge_lookup(int port);
+
+/**
+  @brief The condition variable signalled when a bridge may have a pending client.
+  */
+CondVar* bridge_accept_cv(uint bridge);
+
+/**
+  @brief The condition variable signalled when a bridge connection may be ready.
+  */
+CondVar* bridge_conn_cv(uint conn);
+
 /** @} */
 
 #endif
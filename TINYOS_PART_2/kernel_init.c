@@ -6,6 +6,7 @@
 #include "bios.h"
 #include "tinyos.h"
 #include "kernel_sched.h"
+#include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
@@ -55,6 +56,9 @@ void boot_tinyos_kernel()
 
   if(cpu_core_id==0) {
     /* Here, we could add cleanup after the scheduler has ended. */    
+#if defined(MUTEX_STATISTICS)
+    print_mutex_statistics();
+#endif
   }
 }
 
@@ -69,6 +73,17 @@ void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
 }
 
 
+void boot_vm(vm_config* vmc, Task boot_task, int argl, void* args)
+{
+  boot_rec.init_task = boot_task;
+  boot_rec.argl = argl;
+  boot_rec.args = args;
+
+  vmc->bootfunc = boot_tinyos_kernel;
+  vm_run(vmc);
+}
+
+
 
 
 
@@ -1,76 +1,590 @@
-
 #include "tinyos.h"
 #include "kernel_streams.h"
 #include "kernel_cc.h"
 
-int is_empty(int data_size){
-	if(data_size == 0){
-		return 1;
+int is_empty(pipe_cb* pipe){
+	return pipe->data_size == 0;
+}
+
+int is_full(pipe_cb* pipe){
+	return pipe->data_size == pipe->capacity;
+}
+
+/* The number of times a writer must find the buffer full before it grows */
+#define PIPE_GROW_BACKLOG 4
+
+
+/*
+	Pipes with the default capacity are recycled through a small cache,
+	so that short-lived pipes (e.g., those of socket connections) do not
+	cost two allocations and two frees each. The cache is protected by 
+	the kernel lock, like the rest of the pipe state.
+ */
+#define PIPE_CACHE_SIZE 128
+
+static pipe_cb* pipe_cache[PIPE_CACHE_SIZE];
+static uint pipe_cached = 0;
+
+pipe_cb* pipe_create(uint capacity, uint max_capacity)
+{
+	pipe_cb* pipe;
+	if(capacity == PIPE_BUFFER_SIZE && pipe_cached > 0) {
+		pipe = pipe_cache[--pipe_cached];
 	}
-	return 0;
+	else {
+		pipe = (pipe_cb*) xmalloc(sizeof(pipe_cb));
+		pipe->BUFFER = (char*) xmalloc(capacity);
+	}
+	pipe->reader = NULL;
+	pipe->writer = NULL;
+	pipe->has_space = COND_INIT;
+	pipe->has_data = COND_INIT;
+	pipe->r_position = 0;
+	pipe->w_position = 0;
+	pipe->data_size = 0;
+	pipe->capacity = capacity;
+	pipe->max_capacity = (max_capacity < capacity) ? capacity : max_capacity;
+	pipe->backlog = 0;
+	pipe->splicing = 0;
+	pipe->low_watermark = 0;
+	pipe->handoff_buf = NULL;
+	pipe->handoff_size = 0;
+	pipe->handoff_done = 0;
+	pipe->read_timeout = 0;
+	pipe->write_timeout = 0;
+	return pipe;
 }
 
-int is_full(int data_size){
-	if(data_size%(PIPE_BUFFER_SIZE-1)){
-		return 1;
+void pipe_destroy(pipe_cb* pipe)
+{
+	/* Only pipes whose buffer has not grown are recycled */
+	if(pipe->capacity == PIPE_BUFFER_SIZE && pipe_cached < PIPE_CACHE_SIZE) {
+		pipe_cache[pipe_cached++] = pipe;
+		return;
 	}
-	return 0;
+	free(pipe->BUFFER);
+	free(pipe);
+}
+
+/*
+	Copy up to n bytes from buf into the ring buffer, returning the 
+	number of bytes copied. The free space of the ring consists of at most
+	two contiguous segments, [w_position, end) and [0, r_position), so the
+	copy takes at most two memcpy calls.
+ */
+static unsigned int pipe_copy_in(pipe_cb* pipe, const char* buf, unsigned int n)
+{
+	unsigned int space = pipe->capacity - pipe->data_size;
+	if(n > space) n = space;
+
+	unsigned int first = pipe->capacity - pipe->w_position;
+	if(first > n) first = n;
+
+	memcpy(pipe->BUFFER + pipe->w_position, buf, first);
+	memcpy(pipe->BUFFER, buf + first, n - first);
+
+	pipe->w_position = (pipe->w_position + n) % pipe->capacity;
+	pipe->data_size += n;
+	return n;
+}
+
+/*
+	Copy up to n bytes from the ring buffer into buf, returning the
+	number of bytes copied. As above, at most two memcpy calls are needed.
+ */
+static unsigned int pipe_copy_out(pipe_cb* pipe, char* buf, unsigned int n)
+{
+	if(n > pipe->data_size) n = pipe->data_size;
+
+	unsigned int first = pipe->capacity - pipe->r_position;
+	if(first > n) first = n;
+
+	memcpy(buf, pipe->BUFFER + pipe->r_position, first);
+	memcpy(buf + first, pipe->BUFFER, n - first);
+
+	pipe->r_position = (pipe->r_position + n) % pipe->capacity;
+	pipe->data_size -= n;
+	if(pipe->data_size == 0)
+		pipe->backlog = 0;
+	return n;
+}
+
+/*
+	Move the contents of the pipe into a new buffer of the given capacity,
+	which must be at least data_size.
+ */
+static void pipe_resize(pipe_cb* pipe, uint capacity)
+{
+	assert(capacity >= pipe->data_size);
+	char* buffer = (char*) xmalloc(capacity);
+	uint size = pipe->data_size;
+
+	pipe_copy_out(pipe, buffer, size);
+	free(pipe->BUFFER);
+
+	pipe->BUFFER = buffer;
+	pipe->capacity = capacity;
+	pipe->r_position = 0;
+	pipe->w_position = size % capacity;
+	pipe->data_size = size;
+}
+
+/*
+	Called when a writer finds the buffer full. If this has happened 
+	often enough since the buffer was last empty, grow the buffer
+	(within max_capacity) and return 1. Else, return 0.
+ */
+static int pipe_try_grow(pipe_cb* pipe)
+{
+	if(pipe->capacity >= pipe->max_capacity || pipe->splicing)
+		return 0;
+	if(++pipe->backlog < PIPE_GROW_BACKLOG)
+		return 0;
+
+	uint capacity = 2*pipe->capacity;
+	if(capacity > pipe->max_capacity) capacity = pipe->max_capacity;
+	pipe_resize(pipe, capacity);
+	pipe->backlog = 0;
+	return 1;
+}
+
+
+/*
+	Flow control.
+
+	Readers return credit (free space) to the writers. Blocked writers are 
+	woken only when the free space reaches the low watermark (clamped to 
+	the capacity), so that a writer facing a slow reader sleeps until it
+	can write a large batch, instead of being woken for every read.
+ */
+static uint pipe_credit(pipe_cb* pipe)
+{
+	uint lowat = pipe->low_watermark;
+	if(lowat > pipe->capacity) lowat = pipe->capacity;
+	return (lowat > 0) ? lowat : 1;
+}
+
+static void pipe_return_credit(pipe_cb* pipe)
+{
+	if(pipe->capacity - pipe->data_size >= pipe_credit(pipe)) {
+		kernel_broadcast(&pipe->has_space);
+		FCB_notify(pipe->writer);
+	}
+}
+
+/*
+	If a reader is blocked on the empty pipe, copy up to n bytes from buf 
+	straight into its buffer, bypassing the ring buffer. Return the number
+	of bytes copied.
+ */
+static unsigned int pipe_handoff(pipe_cb* pipe, const char* buf, unsigned int n)
+{
+	if(pipe->handoff_buf == NULL || pipe->handoff_done > 0 || !is_empty(pipe))
+		return 0;
+
+	if(n > pipe->handoff_size) n = pipe->handoff_size;
+	memcpy(pipe->handoff_buf, buf, n);
+	pipe->handoff_done = n;
+	kernel_broadcast(&pipe->has_data);
+	return n;
 }
 
+
 int pipe_write(void* pipecb_t, const char *buf, unsigned int n){
 
  	pipe_cb* pipe = (pipe_cb*) pipecb_t;
 
    	uint count = 0;
+   	int timedout = 0;
+   	TimerDuration deadline = stream_deadline(pipe->write_timeout);
 
   	if((pipe->writer == NULL) || (pipe->reader == NULL)){
     	return -1;
    	}
 
-  	while (is_full(pipe->data_size) && (pipe->reader == NULL)) {   
-    	kernel_wait(&pipe->has_space, SCHED_PIPE); //koimise ton writer
-  	}
-
-  	while(count < n){
-    	pipe->BUFFER[pipe->w_position] = buf[count];
-		count ++;
-		pipe->data_size++;
-		pipe->w_position = (pipe->w_position + 1) % PIPE_BUFFER_SIZE;
- 	}
-  
-  	kernel_broadcast(&pipe->has_data);
+   	/* 
+   		Copy as much as fits, wake up the readers, and block for more 
+   		space until all of buf has been written, or the reader is gone.
+   	 */
+   	while(count < n) {
+   		uint handed = pipe_handoff(pipe, buf + count, n - count);
+   		if(handed > 0) {
+   			count += handed;
+   			continue;
+   		}
+
+	  	while(is_full(pipe) && pipe->reader != NULL && pipe->writer != NULL) {   
+	  		if(pipe_try_grow(pipe) || is_nonblocking(pipe->writer)) break;
+	    	if(stream_wait(&pipe->has_space, deadline) == TIMEDOUT) {
+	    		timedout = 1;
+	    		break;
+	    	}
+	  	}
+
+	  	if(pipe->reader == NULL || pipe->writer == NULL)
+	  		break;
+
+	  	/* A non-blocking or timed out writer stops when the buffer is full */
+	  	if(is_full(pipe)) {
+	  		if(count == 0) return timedout ? TIMEDOUT : WOULDBLOCK;
+	  		break;
+	  	}
+
+	  	count += pipe_copy_in(pipe, buf + count, n - count);
+	  	kernel_broadcast(&pipe->has_data);
+	  	FCB_notify(pipe->reader);
+	}
+
+	/* If nothing could be written, this is an error */
+	if(count == 0 && n > 0)
+		return -1;
+
   	return count;
 }
 
 
 
+/*
+	Wait until there is data to read, or the writer is gone.
+	Return 1 if there is data, 0 for end of data, -1 if the reader 
+	is closed, WOULDBLOCK, or TIMEDOUT.
+ */
+static int pipe_wait_data(pipe_cb* pipe, TimerDuration deadline)
+{
+	if((pipe->writer == NULL) && is_empty(pipe)){
+		return 0;
+	}
+
+	if(pipe->reader == NULL){
+		return -1;
+	}
+
+	while(pipe->splicing || (is_empty(pipe) && pipe->writer != NULL)){
+			if(is_nonblocking(pipe->reader)) return WOULDBLOCK;
+			if(stream_wait(&pipe->has_data, deadline) == TIMEDOUT) return TIMEDOUT;
+	}
+
+	return is_empty(pipe) ? 0 : 1;
+}
+
+
+/*
+	Wait on an empty pipe with buf published for pipe_handoff. Return the 
+	number of bytes handed off, or 0 if the reader must take the usual path.
+ */
+static uint pipe_wait_handoff(pipe_cb* pipe, char* buf, unsigned int n, TimerDuration deadline)
+{
+	if(n == 0 || !is_empty(pipe) || pipe->splicing || pipe->handoff_buf != NULL
+		|| pipe->writer == NULL || pipe->reader == NULL || is_nonblocking(pipe->reader))
+		return 0;
+
+	pipe->handoff_buf = buf;
+	pipe->handoff_size = n;
+	pipe->handoff_done = 0;
+
+	while(pipe->handoff_done == 0 && is_empty(pipe) && pipe->writer != NULL)
+		if(stream_wait(&pipe->has_data, deadline) == TIMEDOUT) break;
+
+	uint done = pipe->handoff_done;
+	pipe->handoff_buf = NULL;
+	pipe->handoff_done = 0;
+	return done;
+}
+
+
 int pipe_read(void* pipecb_t, char *buf,unsigned int n){
 	pipe_cb* pipe = (pipe_cb*)pipecb_t;
 
+	TimerDuration deadline = stream_deadline(pipe->read_timeout);
+
+	uint count = pipe_wait_handoff(pipe, buf, n, deadline);
+	if(count > 0)
+		return count;
+
+	int rc = pipe_wait_data(pipe, deadline);
+	if(rc <= 0)
+		return rc;
+
+	count = pipe_copy_out(pipe, buf, n);
+
+	if(count > 0)
+		pipe_return_credit(pipe);
+	return count;
+}
+
+static size_t iov_total(const iovec_t* iov, unsigned int iovcnt)
+{
+	size_t total = 0;
+	for(unsigned int i=0; i<iovcnt; i++)
+		total += iov[i].len;
+	return total;
+}
+
+/*
+	Called when an atomic writer needs 'need' bytes of free space. 
+	If the buffer is too small for them, it is grown at once (within 
+	max_capacity), else it grows as in pipe_try_grow. 
+	Return 1 if there is enough free space.
+ */
+static int pipe_make_room(pipe_cb* pipe, uint need)
+{
+	if(pipe->capacity < need && pipe->capacity < pipe->max_capacity && !pipe->splicing) {
+		uint capacity = 2*pipe->capacity;
+		if(capacity < need) capacity = need;
+		if(capacity > pipe->max_capacity) capacity = pipe->max_capacity;
+		pipe_resize(pipe, capacity);
+		pipe->backlog = 0;
+	}
+	else if(pipe->capacity - pipe->data_size < need)
+		pipe_try_grow(pipe);
+
+	return pipe->capacity - pipe->data_size >= need;
+}
+
+/*
+	Wait until there are 'need' bytes of free space. 
+	Return 0 on success, -1 if either end is closed or the pipe 
+	can never hold 'need' bytes, WOULDBLOCK, or TIMEDOUT.
+ */
+static int pipe_wait_room(pipe_cb* pipe, uint need)
+{
+	TimerDuration deadline = stream_deadline(pipe->write_timeout);
+
+	while(!pipe_make_room(pipe, need)) {
+		if(pipe->reader == NULL || pipe->writer == NULL || need > pipe->max_capacity)
+			return -1;
+		if(is_nonblocking(pipe->writer)) return WOULDBLOCK;
+		if(stream_wait(&pipe->has_space, deadline) == TIMEDOUT) return TIMEDOUT;
+	}
+	return (pipe->reader == NULL || pipe->writer == NULL) ? -1 : 0;
+}
+
+
+int pipe_writev(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt){
+	pipe_cb* pipe = (pipe_cb*) pipecb_t;
+
+	if((pipe->writer == NULL) || (pipe->reader == NULL)){
+		return -1;
+	}
+
+	size_t total = iov_total(iov, iovcnt);
+
+	/* 
+		A vector that is too large for the pipe is written segment by segment,
+		and may be interleaved with other writers.
+	 */
+	if(total > pipe->max_capacity) {
+		int count = 0, rc = 0;
+		for(unsigned int i=0; i<iovcnt; i++) {
+			if(iov[i].len == 0) continue;
+			rc = pipe_write(pipe, iov[i].base, iov[i].len);
+			if(rc <= 0) break;
+			count += rc;
+			if((size_t)rc < iov[i].len) break;
+		}
+		return (count > 0) ? count : rc;
+	}
+
+	/* Else, wait until all of it fits, and write it at once */
+	int rc = pipe_wait_room(pipe, total);
+	if(rc < 0)
+		return rc;
+
+	for(unsigned int i=0; i<iovcnt; i++)
+		pipe_copy_in(pipe, iov[i].base, iov[i].len);
+
+	if(total > 0) {
+		kernel_broadcast(&pipe->has_data);
+		FCB_notify(pipe->reader);
+	}
+	return total;
+}
+
+
+int pipe_readv(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt){
+	pipe_cb* pipe = (pipe_cb*)pipecb_t;
+
 	uint count = 0;
 
-	if((pipe->writer == NULL) && is_empty(pipe->data_size)){
+	int rc = pipe_wait_data(pipe, stream_deadline(pipe->read_timeout));
+	if(rc <= 0)
+		return rc;
+
+	for(unsigned int i=0; i<iovcnt && !is_empty(pipe); i++)
+		count += pipe_copy_out(pipe, iov[i].base, iov[i].len);
+
+	if(count > 0)
+		pipe_return_credit(pipe);
+	return count;
+}
+
+
+/*
+	Packet pipes.
+	-------------
+
+	These use the same ring buffer, but each message is stored as a
+	header holding its length, followed by its bytes. A message is
+	written only when all of it fits, so the ring always holds whole
+	messages, and a reader takes exactly one message per call.
+ */
+
+#define PACKET_HEADER sizeof(uint)
+
+/* Drop n bytes from the front of the ring */
+static void pipe_discard(pipe_cb* pipe, uint n)
+{
+	pipe->r_position = (pipe->r_position + n) % pipe->capacity;
+	pipe->data_size -= n;
+	if(pipe->data_size == 0)
+		pipe->backlog = 0;
+}
+
+
+int packet_writev(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt){
+	pipe_cb* pipe = (pipe_cb*) pipecb_t;
+
+	if((pipe->writer == NULL) || (pipe->reader == NULL)){
+		return -1;
+	}
+
+	/* Empty messages cannot be told apart from end of data, so they are not sent */
+	size_t total = iov_total(iov, iovcnt);
+	if(total == 0)
 		return 0;
+	if(total > pipe->max_capacity - PACKET_HEADER)
+		return -1;
+
+	uint len = total;
+	int rc = pipe_wait_room(pipe, PACKET_HEADER + len);
+	if(rc < 0)
+		return rc;
+
+	pipe_copy_in(pipe, (const char*) &len, PACKET_HEADER);
+	for(unsigned int i=0; i<iovcnt; i++)
+		pipe_copy_in(pipe, iov[i].base, iov[i].len);
+
+	kernel_broadcast(&pipe->has_data);
+	FCB_notify(pipe->reader);
+	return len;
+}
+
+
+int packet_write(void* pipecb_t, const char *buf, unsigned int n){
+	iovec_t iov = { .base = (void*) buf, .len = n };
+	return packet_writev(pipecb_t, &iov, 1);
+}
+
+
+int packet_readv(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt){
+	pipe_cb* pipe = (pipe_cb*)pipecb_t;
+
+	/* A read of nothing must not take (and discard) a message */
+	size_t total = 0;
+	for(unsigned int i=0; i<iovcnt; i++)
+		total += iov[i].len;
+	if(total == 0)
+		return 0;
+
+	int rc = pipe_wait_data(pipe, stream_deadline(pipe->read_timeout));
+	if(rc <= 0)
+		return rc;
+
+	uint len;
+	pipe_copy_out(pipe, (char*) &len, PACKET_HEADER);
+
+	/* The part of the message that does not fit is discarded */
+	uint count = 0;
+	for(unsigned int i=0; i<iovcnt && count < len; i++) {
+		uint seg = (iov[i].len < len - count) ? iov[i].len : len - count;
+		count += pipe_copy_out(pipe, iov[i].base, seg);
 	}
+	pipe_discard(pipe, len - count);
 
-	if(pipe->reader == NULL){
+	pipe_return_credit(pipe);
+	return count;
+}
+
+
+int packet_read(void* pipecb_t, char *buf, unsigned int n){
+	iovec_t iov = { .base = buf, .len = n };
+	return packet_readv(pipecb_t, &iov, 1);
+}
+
+
+/* Take one message out of the pipe, and write it to out */
+int packet_splice(void* pipecb_t, void* out, file_ops* outops, unsigned int n){
+	pipe_cb* pipe = (pipe_cb*)pipecb_t;
+
+	if(outops->Write == NULL)
 		return -1;
+
+	uint size = (n < pipe->max_capacity) ? n : pipe->max_capacity;
+	char* buffer = (char*) xmalloc(size);
+
+	int count = packet_read(pipe, buffer, size);
+	int rc = count;
+	if(count > 0) {
+		int written = 0;
+		while(written < count) {
+			rc = outops->Write(out, buffer + written, count - written);
+			if(rc <= 0) break;
+			written += rc;
+		}
+		rc = (written > 0) ? written : -1;
 	}
 
-	
-	while(is_empty(pipe->data_size) && pipe->writer != NULL){
-			kernel_wait(&pipe->has_data,SCHED_PIPE);
+	free(buffer);
+	return rc;
+}
+
+
+int pipe_splice(void* pipecb_t, void* out, file_ops* outops, unsigned int n){
+	pipe_cb* pipe = (pipe_cb*)pipecb_t;
+
+	uint count = 0;
+	int rc = -1;
+
+	if(pipe->reader == NULL || outops->Write == NULL){
+		return -1;
 	}
 
-	while(count < n && !is_empty(pipe->data_size)){
+	int wait = pipe_wait_data(pipe, stream_deadline(pipe->read_timeout));
+	if(wait <= 0){
+		return wait;
+	}
 
-		buf[count]= pipe->BUFFER[pipe->r_position];
-		pipe->data_size --;
-		count++;
-		pipe->r_position = (pipe->r_position+1)%PIPE_BUFFER_SIZE;
+	if(n > pipe->data_size) n = pipe->data_size;
+
+	/* 
+		outops->Write may block, so keep other readers and buffer resizing
+		away from BUFFER until we are done. Writers only touch free space.
+	 */
+	pipe->splicing = 1;
+	while(count < n) {
+		uint seg = pipe->capacity - pipe->r_position;
+		if(seg > n - count) seg = n - count;
+
+		rc = outops->Write(out, pipe->BUFFER + pipe->r_position, seg);
+		if(rc <= 0) break;
+
+		pipe->r_position = (pipe->r_position + rc) % pipe->capacity;
+		pipe->data_size -= rc;
+		count += rc;
+		pipe_return_credit(pipe);
+
+		if((uint)rc < seg) break;
 	}
+	pipe->splicing = 0;
 
-	kernel_broadcast(&pipe->has_space);
+	if(pipe->data_size == 0)
+		pipe->backlog = 0;
+
+	/* Wake up the readers that waited for us */
+	kernel_broadcast(&pipe->has_data);
+
+	if(count == 0)
+		return (rc == WOULDBLOCK) ? WOULDBLOCK : -1;
 	return count;
 }
 
@@ -87,9 +601,10 @@ int pipe_writer_close(void* pipecb_t){
 
 	if(pipe->reader != NULL){
 		kernel_broadcast(&(pipe->has_data));
+		FCB_notify(pipe->reader);
 	}
 	else{
-		free(pipe);
+		pipe_destroy(pipe);
 	}
 	return 0;
 }
@@ -105,9 +620,10 @@ int pipe_reader_close(void* pipecb_t){
 
 	if(pipe->writer != NULL){
 		kernel_broadcast(&(pipe->has_space))	;
+		FCB_notify(pipe->writer);
 	}
 	else{
-		free(pipe);
+		pipe_destroy(pipe);
 	}
 	return 0;
 }
@@ -120,44 +636,500 @@ int write_error(void* pipecb_t, const char *buf, unsigned int n){
 	return -1;
 }
 
+int pipe_read_ready(void* pipecb_t){
+	pipe_cb* pipe = (pipe_cb*)pipecb_t;
+
+	if(pipe->writer == NULL)
+		return STREAM_READABLE | STREAM_HANGUP;
+	return (is_empty(pipe) || pipe->splicing) ? 0 : STREAM_READABLE;
+}
+
+int pipe_write_ready(void* pipecb_t){
+	pipe_cb* pipe = (pipe_cb*)pipecb_t;
+
+	if(pipe->reader == NULL)
+		return STREAM_WRITABLE | STREAM_ERROR;
+	return (pipe->capacity - pipe->data_size >= pipe_credit(pipe)) ? STREAM_WRITABLE : 0;
+}
+
 static file_ops read_fops ={
 	.Read = pipe_read,
 	.Write = write_error,
-	.Close = pipe_reader_close
+	.ReadV = pipe_readv,
+	.Close = pipe_reader_close,
+	.Splice = pipe_splice,
+	.Ready = pipe_read_ready
 };
 
 static file_ops write_fops = {
 	.Write = pipe_write,
 	.Read = read_error,
-	.Close = pipe_writer_close
+	.WriteV = pipe_writev,
+	.Close = pipe_writer_close,
+	.Ready = pipe_write_ready
+};
+
+static file_ops packet_read_fops ={
+	.Read = packet_read,
+	.Write = write_error,
+	.ReadV = packet_readv,
+	.Close = pipe_reader_close,
+	.Splice = packet_splice,
+	.Ready = pipe_read_ready
 };
 
+static file_ops packet_write_fops = {
+	.Write = packet_write,
+	.Read = read_error,
+	.WriteV = packet_writev,
+	.Close = pipe_writer_close,
+	.Ready = pipe_write_ready
+};
 
-int sys_Pipe(pipe_t* pipe)
+static int is_pipe_end(FCB* fcb)
+{
+	return fcb->streamfunc == &read_fops || fcb->streamfunc == &write_fops
+		|| fcb->streamfunc == &packet_read_fops || fcb->streamfunc == &packet_write_fops;
+}
+
+
+static int pipe_open(pipe_t* pipe, size_t capacity, file_ops* rfops, file_ops* wfops)
 {
 	Fid_t fid[2];
 	FCB* fcb[2];
 
+	if(capacity == 0 || capacity > PIPE_MAX_BUFFER_SIZE)
+		return -1;
+
 	int reserve_check = FCB_reserve(2,fid,fcb);
 
 	if(reserve_check != 0){
-		pipe_cb *pipe_control_block = (pipe_cb*) xmalloc(sizeof(pipe_cb));
+		pipe_cb *pipe_control_block = pipe_create(capacity, PIPE_GROWTH_LIMIT);
 		pipe->read = fid[0];
 		pipe->write = fid[1];
-		pipe_control_block->r_position = 0;
-		pipe_control_block->w_position = 0;
 		pipe_control_block->reader = fcb[0];
 		pipe_control_block->writer = fcb[1];
-		pipe_control_block->has_space = COND_INIT;
-		pipe_control_block->has_data = COND_INIT;
-		pipe_control_block->data_size = 0;
 		fcb[0]->streamobj = pipe_control_block;
 		fcb[1]->streamobj = pipe_control_block;
-		fcb[0]->streamfunc = &read_fops;
-		fcb[1]->streamfunc = &write_fops; 
+		fcb[0]->streamfunc = rfops;
+		fcb[1]->streamfunc = wfops; 
 		return 0;
 	}
 	else{
 		return -1;
 	}
-}
\ No newline at end of file
+}
+
+
+int sys_PipeEx(pipe_t* pipe, size_t capacity)
+{
+	return pipe_open(pipe, capacity, &read_fops, &write_fops);
+}
+
+
+int sys_PipePacket(pipe_t* pipe, size_t capacity)
+{
+	/* There must be room for at least a header and one byte */
+	if(capacity <= PACKET_HEADER)
+		return -1;
+	return pipe_open(pipe, capacity, &packet_read_fops, &packet_write_fops);
+}
+
+
+int sys_Pipe(pipe_t* pipe)
+{
+	return sys_PipeEx(pipe, PIPE_BUFFER_SIZE);
+}
+
+
+int sys_SetPipeSize(Fid_t fid, size_t capacity)
+{
+	FCB* fcb = get_fcb(fid);
+
+	if(fcb == NULL || !is_pipe_end(fcb))
+		return -1;
+
+	pipe_cb* pipe = fcb->streamobj;
+
+	if((fcb->streamfunc == &packet_read_fops || fcb->streamfunc == &packet_write_fops)
+		&& capacity <= PACKET_HEADER)
+		return -1;
+
+	return pipe_set_capacity(pipe, capacity);
+}
+
+
+/*
+	Give the pipe a fixed capacity. Return 0 on success, or -1 if the 
+	capacity is illegal or too small for the buffered data.
+ */
+int pipe_set_capacity(pipe_cb* pipe, uint capacity)
+{
+	if(capacity == 0 || capacity > PIPE_MAX_BUFFER_SIZE || capacity < pipe->data_size
+		|| pipe->splicing)
+		return -1;
+
+	if(capacity != pipe->capacity)
+		pipe_resize(pipe, capacity);
+	pipe->max_capacity = capacity;
+	pipe->backlog = 0;
+
+	/* Blocked writers may now have space */
+	kernel_broadcast(&pipe->has_space);
+	FCB_notify(pipe->writer);
+	return 0;
+}
+
+
+/*
+	Single-producer/single-consumer pipes.
+	--------------------------------------
+
+	The writer owns 'head' and the reader owns 'tail'; both count bytes
+	since the pipe was created, so the buffered data is head-tail. 
+	Each side publishes its index with an atomic store and reads the 
+	other's with an atomic load, so data moves without the kernel lock.
+
+	A side that finds the buffer empty (full) enters the kernel, sets
+	reader_waiting (writer_waiting) and checks again before sleeping. 
+	The other side checks the flag after publishing its index, and only 
+	then takes the kernel lock to wake it. Both use sequentially 
+	consistent accesses, so at least one of them sees the other.
+ */
+
+typedef struct spsc_pipe_control_block {
+	FCB *reader, *writer;
+	CondVar has_space;
+	CondVar has_data;
+
+	int reader_waiting, writer_waiting;
+
+	uint capacity;    /* a power of 2 */
+	char* BUFFER;
+
+	/* Keep the indices on separate cache lines */
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail __attribute__((aligned(64)));
+} spsc_cb;
+
+
+static uint spsc_push(spsc_cb* pipe, const char* buf, uint n)
+{
+	unsigned long head = pipe->head;
+	unsigned long tail = __atomic_load_n(&pipe->tail, __ATOMIC_SEQ_CST);
+
+	uint space = pipe->capacity - (uint)(head - tail);
+	if(n > space) n = space;
+	if(n == 0) return 0;
+
+	uint pos = head & (pipe->capacity-1);
+	uint first = pipe->capacity - pos;
+	if(first > n) first = n;
+
+	memcpy(pipe->BUFFER + pos, buf, first);
+	memcpy(pipe->BUFFER, buf + first, n - first);
+
+	__atomic_store_n(&pipe->head, head + n, __ATOMIC_SEQ_CST);
+	return n;
+}
+
+static uint spsc_pop(spsc_cb* pipe, char* buf, uint n)
+{
+	unsigned long tail = pipe->tail;
+	unsigned long head = __atomic_load_n(&pipe->head, __ATOMIC_SEQ_CST);
+
+	uint avail = (uint)(head - tail);
+	if(n > avail) n = avail;
+	if(n == 0) return 0;
+
+	uint pos = tail & (pipe->capacity-1);
+	uint first = pipe->capacity - pos;
+	if(first > n) first = n;
+
+	memcpy(buf, pipe->BUFFER + pos, first);
+	memcpy(buf + first, pipe->BUFFER, n - first);
+
+	__atomic_store_n(&pipe->tail, tail + n, __ATOMIC_SEQ_CST);
+	return n;
+}
+
+static inline int spsc_waiting(int* flag)
+{
+	return __atomic_load_n(flag, __ATOMIC_SEQ_CST);
+}
+
+static inline void spsc_set_waiting(int* flag, int value)
+{
+	__atomic_store_n(flag, value, __ATOMIC_SEQ_CST);
+}
+
+/* True if the given end is in some poll set, and must be notified of changes */
+static inline int spsc_watched(FCB** end)
+{
+	FCB* fcb = __atomic_load_n(end, __ATOMIC_SEQ_CST);
+	return fcb != NULL && __atomic_load_n(&fcb->nwatchers, __ATOMIC_SEQ_CST) > 0;
+}
+
+/* True if the writer (reader) may be sleeping or polled, and must be woken up on progress */
+static inline int spsc_writer_asleep(spsc_cb* pipe)
+{
+	return spsc_waiting(&pipe->writer_waiting) || spsc_watched(&pipe->writer);
+}
+
+static inline int spsc_reader_asleep(spsc_cb* pipe)
+{
+	return spsc_waiting(&pipe->reader_waiting) || spsc_watched(&pipe->reader);
+}
+
+
+/* The kernel side, called with the kernel lock held */
+
+int spsc_read(void* pipecb_t, char* buf, unsigned int n)
+{
+	spsc_cb* pipe = (spsc_cb*) pipecb_t;
+	uint count;
+
+	if(pipe->reader == NULL)
+		return -1;
+
+	while((count = spsc_pop(pipe, buf, n)) == 0 && n > 0) {
+		if(pipe->writer == NULL)
+			return 0;
+		if(is_nonblocking(pipe->reader))
+			return WOULDBLOCK;
+
+		spsc_set_waiting(&pipe->reader_waiting, 1);
+		if(__atomic_load_n(&pipe->head, __ATOMIC_SEQ_CST) == pipe->tail)
+			kernel_wait(&pipe->has_data, SCHED_PIPE);
+		spsc_set_waiting(&pipe->reader_waiting, 0);
+	}
+
+	if(count > 0 && spsc_writer_asleep(pipe)) {
+		kernel_broadcast(&pipe->has_space);
+		FCB_notify(pipe->writer);
+	}
+	return count;
+}
+
+int spsc_write(void* pipecb_t, const char* buf, unsigned int n)
+{
+	spsc_cb* pipe = (spsc_cb*) pipecb_t;
+	uint count = 0;
+
+	if(pipe->reader == NULL || pipe->writer == NULL)
+		return -1;
+
+	while(count < n) {
+		uint rc = spsc_push(pipe, buf + count, n - count);
+		if(rc > 0) {
+			count += rc;
+			if(spsc_reader_asleep(pipe)) {
+				kernel_broadcast(&pipe->has_data);
+				FCB_notify(pipe->reader);
+			}
+			continue;
+		}
+
+		if(pipe->reader == NULL)
+			break;
+		if(is_nonblocking(pipe->writer))
+			return (count > 0) ? (int)count : WOULDBLOCK;
+
+		spsc_set_waiting(&pipe->writer_waiting, 1);
+		if(pipe->head - __atomic_load_n(&pipe->tail, __ATOMIC_SEQ_CST) == pipe->capacity)
+			kernel_wait(&pipe->has_space, SCHED_PIPE);
+		spsc_set_waiting(&pipe->writer_waiting, 0);
+	}
+
+	if(count == 0 && n > 0)
+		return -1;
+	return count;
+}
+
+static void spsc_destroy(spsc_cb* pipe)
+{
+	free(pipe->BUFFER);
+	free(pipe);
+}
+
+int spsc_reader_close(void* pipecb_t)
+{
+	spsc_cb* pipe = (spsc_cb*) pipecb_t;
+
+	__atomic_store_n(&pipe->reader, NULL, __ATOMIC_SEQ_CST);
+	if(pipe->writer != NULL) {
+		kernel_broadcast(&pipe->has_space);
+		FCB_notify(pipe->writer);
+	}
+	else
+		spsc_destroy(pipe);
+	return 0;
+}
+
+int spsc_writer_close(void* pipecb_t)
+{
+	spsc_cb* pipe = (spsc_cb*) pipecb_t;
+
+	__atomic_store_n(&pipe->writer, NULL, __ATOMIC_SEQ_CST);
+	if(pipe->reader != NULL) {
+		kernel_broadcast(&pipe->has_data);
+		FCB_notify(pipe->reader);
+	}
+	else
+		spsc_destroy(pipe);
+	return 0;
+}
+
+int spsc_read_ready(void* pipecb_t)
+{
+	spsc_cb* pipe = (spsc_cb*) pipecb_t;
+
+	if(__atomic_load_n(&pipe->head, __ATOMIC_SEQ_CST) 
+		!= __atomic_load_n(&pipe->tail, __ATOMIC_SEQ_CST))
+		return STREAM_READABLE;
+	if(pipe->writer == NULL)
+		return STREAM_READABLE | STREAM_HANGUP;
+	return 0;
+}
+
+int spsc_write_ready(void* pipecb_t)
+{
+	spsc_cb* pipe = (spsc_cb*) pipecb_t;
+
+	if(pipe->reader == NULL)
+		return STREAM_WRITABLE | STREAM_ERROR;
+	if(__atomic_load_n(&pipe->head, __ATOMIC_SEQ_CST) 
+		- __atomic_load_n(&pipe->tail, __ATOMIC_SEQ_CST) < pipe->capacity)
+		return STREAM_WRITABLE;
+	return 0;
+}
+
+static file_ops spsc_read_fops = {
+	.Read = spsc_read,
+	.Write = write_error,
+	.Close = spsc_reader_close,
+	.Ready = spsc_read_ready,
+	.Unlocked = 1
+};
+
+static file_ops spsc_write_fops = {
+	.Write = spsc_write,
+	.Read = read_error,
+	.Close = spsc_writer_close,
+	.Ready = spsc_write_ready,
+	.Unlocked = 1
+};
+
+
+int sys_PipeSPSC(pipe_t* pipe, size_t capacity)
+{
+	Fid_t fid[2];
+	FCB* fcb[2];
+
+	if(capacity == 0 || capacity > PIPE_MAX_BUFFER_SIZE)
+		return -1;
+
+	uint size = 1;
+	while(size < capacity) size <<= 1;
+
+	if(! FCB_reserve(2, fid, fcb))
+		return -1;
+
+	spsc_cb* p = (spsc_cb*) aligned_alloc(64, sizeof(spsc_cb));
+	p->reader = fcb[0];
+	p->writer = fcb[1];
+	p->has_space = COND_INIT;
+	p->has_data = COND_INIT;
+	p->reader_waiting = 0;
+	p->writer_waiting = 0;
+	p->capacity = size;
+	p->BUFFER = (char*) xmalloc(size);
+	p->head = 0;
+	p->tail = 0;
+
+	fcb[0]->streamobj = p;
+	fcb[1]->streamobj = p;
+	fcb[0]->streamfunc = &spsc_read_fops;
+	fcb[1]->streamfunc = &spsc_write_fops;
+
+	pipe->read = fid[0];
+	pipe->write = fid[1];
+	return 0;
+}
+
+
+/* 
+	The user side, called without the kernel lock. 
+	Only the file ids cached by the calling thread take this path (see 
+	fid_cache_enter); other file ids, other streams, and SPSC pipes that 
+	must block, fall back to the kernel.
+ */
+
+int fast_Read(int* ret, Fid_t fd, char* buf, unsigned int size)
+{
+	FCB* fcb = fid_cache_enter(FID_CACHE_READ, fd);
+	if(fcb == NULL)
+		return 0;
+
+	uint count = 0;
+	if(fcb->streamfunc == &spsc_read_fops) {
+		spsc_cb* pipe = (spsc_cb*) fcb->streamobj;
+		count = spsc_pop(pipe, buf, size);
+		if(count > 0 && spsc_writer_asleep(pipe)) {
+			kernel_lock();
+			kernel_broadcast(&pipe->has_space);
+			FCB_notify(pipe->writer);
+			kernel_unlock();
+		}
+	}
+	fid_cache_leave();
+
+	if(count == 0)
+		return 0;
+	*ret = count;
+	return 1;
+}
+
+int fast_Write(int* ret, Fid_t fd, const char* buf, unsigned int size)
+{
+	FCB* fcb = fid_cache_enter(FID_CACHE_WRITE, fd);
+	if(fcb == NULL)
+		return 0;
+
+	spsc_cb* pipe = (spsc_cb*) fcb->streamobj;
+	if(fcb->streamfunc != &spsc_write_fops
+		|| __atomic_load_n(&pipe->reader, __ATOMIC_SEQ_CST) == NULL) {
+		fid_cache_leave();
+		return 0;
+	}
+
+	uint count = spsc_push(pipe, buf, size);
+	if(count == size && !spsc_reader_asleep(pipe)) {
+		fid_cache_leave();
+		*ret = count;
+		return 1;
+	}
+
+	/* Wake up the reader and/or block for the rest */
+	kernel_lock();
+	if(count > 0) {
+		kernel_broadcast(&pipe->has_data);
+		FCB_notify(pipe->reader);
+	}
+
+	if(count < size) {
+		int rc = spsc_write(pipe, buf + count, size - count);
+		if(rc > 0) count += rc;
+		else if(count == 0) {
+			kernel_unlock();
+			fid_cache_leave();
+			*ret = rc;
+			return 1;
+		}
+	}
+	kernel_unlock();
+	fid_cache_leave();
+
+	*ret = count;
+	return 1;
+}
@@ -0,0 +1,386 @@
+#include "tinyos.h"
+#include "kernel_streams.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+
+/*
+	Readiness multiplexing.
+
+	A poll set holds a list of watches, one for each (stream, fid) of
+	interest. Each watch is also linked into the @c watchers list of its
+	FCB. When a stream calls FCB_notify, its watches are queued into the
+	ready list of their set, and the set's waiters are woken up.
+
+	A waiter only examines the queued watches, calling the Ready operation
+	of each. Watches that are still ready stay queued, so the next wait
+	reports them again (level-triggered). Watches on Polled streams
+	(which cannot notify) always stay queued, and waiters with such
+	watches sleep for at most POLL_INTERVAL at a time.
+
+	Poll uses a temporary set on its stack; EpollCreate makes a stream
+	out of one. Rings (see kernel_ring.c) use the kernel interface at 
+	the end of this file.
+ */
+
+/* How often Polled streams are re-checked, in msec */
+#define POLL_INTERVAL 20
+
+typedef struct poll_watch {
+	FCB* fcb;			/* The watched stream */
+	Fid_t fd;			/* The fid reported to the user */
+	int events;			/* The events of interest */
+	poll_set* set;		/* The set this watch belongs to */
+	int queued;			/* True if in the ready list of the set */
+
+	rlnode fcb_node;	/* In fcb->watchers */
+	rlnode set_node;	/* In set->interests */
+	rlnode ready_node;	/* In set->ready */
+} poll_watch;
+
+struct poll_set {
+	rlnode interests;	/* All watches */
+	rlnode ready;		/* The watches that may be ready */
+	uint polled;		/* The number of watches on Polled streams */
+	CondVar changed;	/* Signalled when a watch is queued */
+};
+
+
+int FCB_ready(FCB* fcb)
+{
+	if(fcb->streamfunc->Ready == NULL)
+		return STREAM_READABLE | STREAM_WRITABLE;
+	return fcb->streamfunc->Ready(fcb->streamobj);
+}
+
+
+static void watch_queue(poll_watch* w)
+{
+	if(! w->queued) {
+		w->queued = 1;
+		rlist_push_back(& w->set->ready, & w->ready_node);
+	}
+}
+
+
+void FCB_notify(FCB* fcb)
+{
+	if(fcb == NULL) return;
+
+	for(rlnode* n = fcb->watchers.next; n != &fcb->watchers; n = n->next) {
+		poll_watch* w = n->obj;
+		if(! w->queued) {
+			watch_queue(w);
+			kernel_broadcast(& w->set->changed);
+		}
+	}
+}
+
+
+static void poll_set_init(poll_set* set)
+{
+	rlnode_new(& set->interests);
+	rlnode_new(& set->ready);
+	set->polled = 0;
+	set->changed = COND_INIT;
+}
+
+
+static poll_watch* watch_add(poll_set* set, FCB* fcb, Fid_t fd, int events)
+{
+	poll_watch* w = (poll_watch*) xmalloc(sizeof(poll_watch));
+	w->fcb = fcb;
+	w->fd = fd;
+	w->events = events;
+	w->set = set;
+	w->queued = 0;
+
+	rlist_push_back(& fcb->watchers, rlnode_init(& w->fcb_node, w));
+	__atomic_add_fetch(& fcb->nwatchers, 1, __ATOMIC_SEQ_CST);
+	rlist_push_back(& set->interests, rlnode_init(& w->set_node, w));
+	rlnode_init(& w->ready_node, w);
+	if(fcb->streamfunc->Polled) set->polled++;
+
+	/* It may already be ready */
+	watch_queue(w);
+	kernel_broadcast(& set->changed);
+	return w;
+}
+
+
+static void watch_remove(poll_watch* w)
+{
+	rlist_remove(& w->fcb_node);
+	__atomic_sub_fetch(& w->fcb->nwatchers, 1, __ATOMIC_SEQ_CST);
+	rlist_remove(& w->set_node);
+	if(w->queued) rlist_remove(& w->ready_node);
+	if(w->fcb->streamfunc->Polled) w->set->polled--;
+	free(w);
+}
+
+
+void FCB_unwatch(FCB* fcb)
+{
+	while(! is_rlist_empty(& fcb->watchers))
+		watch_remove(fcb->watchers.next->obj);
+}
+
+
+static void poll_set_clear(poll_set* set)
+{
+	while(! is_rlist_empty(& set->interests))
+		watch_remove(set->interests.next->obj);
+}
+
+
+static poll_watch* poll_set_find(poll_set* set, FCB* fcb, Fid_t fd)
+{
+	for(rlnode* n = fcb->watchers.next; n != &fcb->watchers; n = n->next) {
+		poll_watch* w = n->obj;
+		if(w->set == set && w->fd == fd) return w;
+	}
+	return NULL;
+}
+
+
+/*
+	Store up to max ready watches into out, and return their number.
+	Only the queued watches are examined.
+ */
+static unsigned int poll_set_collect(poll_set* set, poll_fd* out, unsigned int max)
+{
+	rlnode pending;
+	rlnode_new(& pending);
+	rlist_append(& pending, & set->ready);
+
+	unsigned int count = 0;
+	while(! is_rlist_empty(& pending)) {
+		poll_watch* w = rlist_pop_front(& pending)->obj;
+
+		int revents = FCB_ready(w->fcb) & (w->events | STREAM_HANGUP | STREAM_ERROR);
+		if(revents && count < max) {
+			out[count].fd = w->fd;
+			out[count].events = w->events;
+			out[count].revents = revents;
+			count++;
+		}
+
+		if(revents || w->fcb->streamfunc->Polled)
+			rlist_push_back(& set->ready, & w->ready_node);
+		else
+			w->queued = 0;
+	}
+	return count;
+}
+
+
+/*
+	Collect the ready watches, waiting for up to timeout msec for
+	some to become ready.
+ */
+static unsigned int poll_set_wait(poll_set* set, poll_fd* out, unsigned int max, timeout_t timeout)
+{
+	TimerDuration deadline = (timeout == TIMEOUT_INFINITE) ? NO_TIMEOUT
+		: bios_clock() + 1000*(TimerDuration)timeout;
+
+	while(1) {
+		unsigned int count = poll_set_collect(set, out, max);
+		if(count > 0) return count;
+
+		TimerDuration now = bios_clock();
+		if(deadline != NO_TIMEOUT && now >= deadline) return 0;
+
+		TimerDuration t = (deadline == NO_TIMEOUT) ? NO_TIMEOUT : deadline - now;
+		if(set->polled && t > 1000*POLL_INTERVAL)
+			t = 1000*POLL_INTERVAL;
+
+		kernel_timedwait(& set->changed, SCHED_POLL, t);
+	}
+}
+
+
+int sys_Poll(poll_fd* fds, unsigned int n, timeout_t timeout)
+{
+	for(unsigned int i=0; i<n; i++) {
+		fds[i].revents = 0;
+		if(fds[i].fd >= 0 && get_fcb(fds[i].fd) == NULL)
+			return -1;
+	}
+
+	poll_set set;
+	poll_set_init(& set);
+
+	/* The watches report the index into fds */
+	for(unsigned int i=0; i<n; i++)
+		if(fds[i].fd >= 0)
+			watch_add(& set, get_fcb(fds[i].fd), i, fds[i].events);
+
+	poll_fd* ready = (poll_fd*) xmalloc((n>0 ? n : 1)*sizeof(poll_fd));
+	unsigned int count = poll_set_wait(& set, ready, n, timeout);
+	for(unsigned int k=0; k<count; k++)
+		fds[ready[k].fd].revents = ready[k].revents;
+	free(ready);
+
+	poll_set_clear(& set);
+	return count;
+}
+
+
+/* Interest sets as streams */
+
+static int epoll_ready(void* this)
+{
+	poll_set* set = (poll_set*) this;
+	return is_rlist_empty(& set->ready) ? 0 : STREAM_READABLE;
+}
+
+static int epoll_close(void* this)
+{
+	poll_set* set = (poll_set*) this;
+	poll_set_clear(set);
+	free(set);
+	return 0;
+}
+
+/* An interest set cannot notify its own watchers, so it is Polled */
+static file_ops epoll_fops = {
+	.Open = NULL,
+	.Read = NULL,
+	.Write = NULL,
+	.Close = epoll_close,
+	.Ready = epoll_ready,
+	.Polled = 1
+};
+
+
+Fid_t sys_EpollCreate()
+{
+	Fid_t fid;
+	FCB* fcb;
+
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	poll_set* set = (poll_set*) xmalloc(sizeof(poll_set));
+	poll_set_init(set);
+
+	fcb->streamobj = set;
+	fcb->streamfunc = &epoll_fops;
+	return fid;
+}
+
+
+static poll_set* get_poll_set(Fid_t epfd)
+{
+	FCB* fcb = get_fcb(epfd);
+	if(fcb == NULL || fcb->streamfunc != &epoll_fops)
+		return NULL;
+	return fcb->streamobj;
+}
+
+
+int sys_EpollCtl(Fid_t epfd, int op, Fid_t fd, int events)
+{
+	poll_set* set = get_poll_set(epfd);
+	FCB* fcb = get_fcb(fd);
+
+	if(set == NULL || fcb == NULL || fcb == get_fcb(epfd))
+		return -1;
+
+	poll_watch* w = poll_set_find(set, fcb, fd);
+
+	switch(op) {
+		case EPOLL_ADD:
+			if(w != NULL) return -1;
+			watch_add(set, fcb, fd, events);
+			break;
+		case EPOLL_MOD:
+			if(w == NULL) return -1;
+			w->events = events;
+			watch_queue(w);
+			kernel_broadcast(& set->changed);
+			break;
+		case EPOLL_DEL:
+			if(w == NULL) return -1;
+			watch_remove(w);
+			break;
+		default:
+			return -1;
+	}
+	return 0;
+}
+
+
+int sys_EpollWait(Fid_t epfd, poll_fd* events, unsigned int maxevents, timeout_t timeout)
+{
+	FCB* fcb = get_fcb(epfd);
+	if(fcb == NULL || fcb->streamfunc != &epoll_fops || maxevents == 0)
+		return -1;
+
+	/* make sure that the set will not be closed while we wait on it */
+	FCB_incref(fcb);
+	int count = poll_set_wait(fcb->streamobj, events, maxevents, timeout);
+	FCB_decref(fcb);
+
+	return count;
+}
+
+
+/* The kernel interface to interest sets */
+
+poll_set* poll_set_create()
+{
+	poll_set* set = (poll_set*) xmalloc(sizeof(poll_set));
+	poll_set_init(set);
+	return set;
+}
+
+
+void poll_set_destroy(poll_set* set)
+{
+	poll_set_clear(set);
+	free(set);
+}
+
+
+poll_watch* poll_watch_add(poll_set* set, FCB* fcb, Fid_t fd, int events)
+{
+	return watch_add(set, fcb, fd, events);
+}
+
+
+void poll_watch_remove(poll_watch* w)
+{
+	watch_remove(w);
+}
+
+
+Fid_t poll_set_take(poll_set* set)
+{
+	if(is_rlist_empty(& set->ready)) return NOFILE;
+
+	poll_watch* w = rlist_pop_front(& set->ready)->obj;
+	w->queued = 0;
+	return w->fd;
+}
+
+
+void poll_set_sleep(poll_set* set, TimerDuration deadline)
+{
+	if(! is_rlist_empty(& set->ready)) return;
+
+	TimerDuration now = bios_clock();
+	if(deadline != NO_TIMEOUT && now >= deadline) return;
+
+	TimerDuration t = (deadline == NO_TIMEOUT) ? NO_TIMEOUT : deadline - now;
+	if(set->polled && t > 1000*POLL_INTERVAL)
+		t = 1000*POLL_INTERVAL;
+
+	kernel_timedwait(& set->changed, SCHED_POLL, t);
+
+	/* Polled streams cannot notify, so they are taken again */
+	if(set->polled)
+		for(rlnode* n = set->interests.next; n != &set->interests; n = n->next) {
+			poll_watch* w = n->obj;
+			if(w->fcb->streamfunc->Polled) watch_queue(w);
+		}
+}
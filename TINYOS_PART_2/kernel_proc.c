@@ -38,8 +38,7 @@ static inline void initialize_PCB(PCB* pcb)
   pcb->args = NULL;
   pcb->thread_count = 0;
 
-  for(int i=0;i<MAX_FILEID;i++)
-    pcb->FIDT[i] = NULL;
+  pcb->FIDT = NULL;
   
   rlnode_init(& pcb->ptcb_list, NULL);
   rlnode_init(& pcb->children_list, NULL);
@@ -137,18 +136,58 @@ void start_main_thread()
 	System call to create a new process.
  */
 Pid_t sys_Exec(Task call, int argl, void* args)
+{
+  return sys_ExecEx(call, argl, args, 0, NULL, 0);
+}
+
+
+/*
+  Return a new table holding just the given fids of the current process,
+  or NULL if one of them is not open.
+ */
+static fid_table* select_fids(const Fid_t* fids, unsigned int nfids)
+{
+  fid_table* fidt = fidt_create(CURPROC->FIDT->limit);
+  for(unsigned int i=0; i<nfids; i++) {
+    FCB* fcb = get_fcb(fids[i]);
+    if(fcb == NULL) {
+      fidt_release(fidt);
+      return NULL;
+    }
+    if(fidt_get(fidt, fids[i]) == NULL) {
+      fidt_set(fidt, fids[i], fcb);
+      FCB_incref(fcb);
+    }
+  }
+  return fidt;
+}
+
+
+Pid_t sys_ExecEx(Task call, int argl, void* args, int flags, const Fid_t* fids, unsigned int nfids)
 {
   PCB *curproc, *newproc;
+  fid_table* fidt = NULL;
+
+  if(flags & ~EXEC_SELECT_FIDS) return NOPROC;
+  if(flags & EXEC_SELECT_FIDS) {
+    if(nfids > 0 && fids == NULL) return NOPROC;
+    if((fidt = select_fids(fids, nfids)) == NULL) return NOPROC;
+  }
   
   /* The new process PCB */
   newproc = acquire_PCB();
 
-  if(newproc == NULL) goto finish;  /* We have run out of PIDs! */
+  if(newproc == NULL) {
+    /* We have run out of PIDs! */
+    if(fidt) fidt_release(fidt);
+    goto finish;
+  }
 
   if(get_pid(newproc)<=1) {
     /* Processes with pid<=1 (the scheduler and the init process) 
        are parentless and are treated specially. */
     newproc->parent = NULL;
+    newproc->FIDT = fidt_create(MAX_FILEID);
   }
   else
   {
@@ -159,12 +198,9 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     newproc->parent = curproc;
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
-    /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
-    }
+    /* Inherit file streams from parent, sharing its table until 
+       one of the two changes it (see fidt_own) */
+    newproc->FIDT = (fidt != NULL) ? fidt : fidt_share(curproc->FIDT);
   }
 
 
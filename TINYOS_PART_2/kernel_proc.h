@@ -17,6 +17,7 @@
 
 #include "tinyos.h"
 #include "kernel_sched.h"
+#include "kernel_streams.h"
 
 /**
   @brief PID state
@@ -58,7 +59,7 @@ typedef struct process_control_block {
                              process terminates. It is used in the implementation of
                              @c WaitChild() */
 
-  FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
+  fid_table* FIDT;        /**< @brief The fileid table of the process (maybe shared) */
 
   rlnode ptcb_list;
   int thread_count;
@@ -0,0 +1,345 @@
+#include "tinyos.h"
+#include "kernel_streams.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+
+/*
+	Asynchronous I/O rings.
+
+	Each operation in flight occupies a slot of the ring, holds a reference
+	to its FCB, and has a watch on it in the interest set of the ring,
+	which reports the slot (see kernel_poll.c). An operation is tried when
+	it is submitted, and again whenever its stream notifies, as a
+	non-blocking call; it completes when the call does not return WOULDBLOCK.
+
+	A connect queues its request when it is submitted. The socket is
+	notified when the request is admitted or refused, and the connect
+	completes then, or at its deadline.
+
+	There are as many slots as completion entries, and entries are only
+	submitted while there is room for their completions, so the completion
+	queue never overflows.
+ */
+
+typedef struct ring_op {
+	int opcode;					/* A ring_opcode */
+	Fid_t fd;
+	FCB* fcb;					/* The stream, referenced while in flight */
+	void* buf;
+	unsigned int len;
+	int events;
+	TimerDuration deadline;		/* Of a connect */
+	uintptr_t user_data;
+	poll_watch* watch;			/* NULL if the slot is free */
+	request req;				/* Of a connect */
+	int next_free;				/* The next free slot, if free */
+} ring_op;
+
+typedef struct ring_control_block {
+	io_ring queues;				/* Shared with the process */
+	FCB* fcb;					/* The FCB of the ring */
+	poll_set* set;				/* The watches of the operations in flight */
+	ring_op* ops;				/* The slots, cq_mask+1 of them */
+	int free_op;				/* The first free slot, or -1 */
+	unsigned int inflight;		/* The number of operations in flight */
+	unsigned int connecting;	/* The number of connects in flight */
+	int entered;				/* Set while a thread is in RingEnter */
+} ring_cb;
+
+
+static unsigned int ring_completions(ring_cb* ring)
+{
+	io_ring* q = & ring->queues;
+	return q->cq_tail - __atomic_load_n(& q->cq_head, __ATOMIC_ACQUIRE);
+}
+
+
+static void ring_post(ring_cb* ring, uintptr_t user_data, int res)
+{
+	io_ring* q = & ring->queues;
+	ring_cqe* cqe = & q->cq[q->cq_tail & q->cq_mask];
+	cqe->user_data = user_data;
+	cqe->res = res;
+	__atomic_store_n(& q->cq_tail, q->cq_tail + 1, __ATOMIC_RELEASE);
+	FCB_notify(ring->fcb);
+}
+
+
+/* Free the slot of an operation that has completed, or is cancelled */
+static void ring_release(ring_cb* ring, int slot)
+{
+	ring_op* op = & ring->ops[slot];
+
+	poll_watch_remove(op->watch);
+	op->watch = NULL;
+	if(op->opcode == RING_CONNECT) ring->connecting--;
+	ring->inflight--;
+
+	op->next_free = ring->free_op;
+	ring->free_op = slot;
+
+	FCB_decref(op->fcb);
+}
+
+
+static void ring_submit(ring_cb* ring, const ring_sqe* sqe)
+{
+	FCB* fcb = get_fcb(sqe->fd);
+
+	if(fcb == NULL || fcb == ring->fcb
+		|| sqe->opcode < RING_READ || sqe->opcode > RING_POLL) {
+		ring_post(ring, sqe->user_data, -1);
+		return;
+	}
+
+	int slot = ring->free_op;
+	ring_op* op = & ring->ops[slot];
+	op->opcode = sqe->opcode;
+	op->fd = sqe->fd;
+	op->fcb = fcb;
+	op->buf = sqe->buf;
+	op->len = sqe->len;
+	op->user_data = sqe->user_data;
+
+	int events;
+	switch(op->opcode) {
+		case RING_READ:
+		case RING_ACCEPT: events = STREAM_READABLE; break;
+		case RING_POLL: events = op->events = sqe->events; break;
+		default: events = STREAM_WRITABLE;
+	}
+
+	if(op->opcode == RING_CONNECT) {
+		if(socket_connect_start(fcb, sqe->port, & op->req) != 0) {
+			ring_post(ring, sqe->user_data, -1);
+			return;
+		}
+		op->deadline = (sqe->timeout == TIMEOUT_INFINITE) ? NO_TIMEOUT
+			: bios_clock() + 1000*(TimerDuration)sqe->timeout;
+		ring->connecting++;
+	}
+
+	/* The new watch is reported at once, so the operation is tried soon */
+	ring->free_op = op->next_free;
+	ring->inflight++;
+	FCB_incref(fcb);
+	op->watch = poll_watch_add(ring->set, fcb, slot, events);
+}
+
+
+/* Call the stream as if it was non-blocking */
+static int ring_call(ring_op* op)
+{
+	FCB* fcb = op->fcb;
+	int flags = fcb->flags;
+	int rc = -1;
+
+	fcb->flags |= STREAM_NONBLOCK;
+	switch(op->opcode) {
+		case RING_READ:
+			if(fcb->streamfunc->Read)
+				rc = fcb->streamfunc->Read(fcb->streamobj, op->buf, op->len);
+			break;
+		case RING_WRITE:
+			if(fcb->streamfunc->Write)
+				rc = fcb->streamfunc->Write(fcb->streamobj, op->buf, op->len);
+			break;
+		case RING_ACCEPT:
+			/* The new socket gets a fid of the current process */
+			if(get_fcb(op->fd) == fcb)
+				rc = sys_Accept(op->fd);
+			break;
+	}
+	fcb->flags = flags;
+	return rc;
+}
+
+
+/* Try an operation, returning 1 and storing its result if it has completed */
+static int ring_try(ring_op* op, int* res)
+{
+	switch(op->opcode) {
+		case RING_POLL:
+			*res = FCB_ready(op->fcb) & (op->events | STREAM_HANGUP | STREAM_ERROR);
+			return *res != 0;
+		case RING_CONNECT:
+			if(! socket_connect_settled(& op->req) && bios_clock() < op->deadline)
+				return 0;
+			*res = socket_connect_finish(& op->req);
+			return 1;
+		default:
+			*res = ring_call(op);
+			return *res != WOULDBLOCK;
+	}
+}
+
+
+static void ring_complete(ring_cb* ring, int slot)
+{
+	ring_op* op = & ring->ops[slot];
+	int res;
+	if(ring_try(op, & res)) {
+		ring_post(ring, op->user_data, res);
+		ring_release(ring, slot);
+	}
+}
+
+
+/* Try the operations whose streams have notified, and the expired connects */
+static void ring_progress(ring_cb* ring)
+{
+	/* Each pass is bounded, in case a stream notifies itself */
+	unsigned int n = ring->inflight;
+	Fid_t slot;
+	while(n-- > 0 && (slot = poll_set_take(ring->set)) != NOFILE)
+		ring_complete(ring, slot);
+
+	if(ring->connecting > 0) {
+		TimerDuration now = bios_clock();
+		for(unsigned int i=0; i<=ring->queues.cq_mask; i++) {
+			ring_op* op = & ring->ops[i];
+			if(op->watch != NULL && op->opcode == RING_CONNECT && now >= op->deadline)
+				ring_complete(ring, i);
+		}
+	}
+}
+
+
+/* The earliest deadline of a connect in flight, or NO_TIMEOUT */
+static TimerDuration ring_deadline(ring_cb* ring)
+{
+	TimerDuration deadline = NO_TIMEOUT;
+	if(ring->connecting > 0)
+		for(unsigned int i=0; i<=ring->queues.cq_mask; i++) {
+			ring_op* op = & ring->ops[i];
+			if(op->watch != NULL && op->opcode == RING_CONNECT && op->deadline < deadline)
+				deadline = op->deadline;
+		}
+	return deadline;
+}
+
+
+static int ring_ready(void* this)
+{
+	ring_cb* ring = (ring_cb*) this;
+	return ring_completions(ring) > 0 ? STREAM_READABLE : 0;
+}
+
+
+static int ring_close(void* this)
+{
+	ring_cb* ring = (ring_cb*) this;
+
+	/* Cancel the operations in flight */
+	for(unsigned int i=0; i<=ring->queues.cq_mask; i++) {
+		ring_op* op = & ring->ops[i];
+		if(op->watch == NULL) continue;
+		if(op->opcode == RING_CONNECT)
+			socket_connect_finish(& op->req);
+		ring_release(ring, i);
+	}
+
+	poll_set_destroy(ring->set);
+	free(ring->queues.sq);
+	free(ring->queues.cq);
+	free(ring->ops);
+	free(ring);
+	return 0;
+}
+
+
+static file_ops ring_fops = {
+	.Open = NULL,
+	.Read = NULL,
+	.Write = NULL,
+	.Close = ring_close,
+	.Ready = ring_ready
+};
+
+
+Fid_t sys_RingCreate(unsigned int entries, io_ring** ring)
+{
+	Fid_t fid;
+	FCB* fcb;
+
+	if(entries == 0 || entries > MAX_RING_ENTRIES || ring == NULL)
+		return NOFILE;
+
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	unsigned int size = 1;
+	while(size < entries) size <<= 1;
+
+	ring_cb* r = (ring_cb*) xmalloc(sizeof(ring_cb));
+	io_ring* q = & r->queues;
+	q->sq = (ring_sqe*) xmalloc(size*sizeof(ring_sqe));
+	q->sq_mask = size - 1;
+	q->sq_head = q->sq_tail = 0;
+	q->cq = (ring_cqe*) xmalloc(2*size*sizeof(ring_cqe));
+	q->cq_mask = 2*size - 1;
+	q->cq_head = q->cq_tail = 0;
+
+	r->fcb = fcb;
+	r->set = poll_set_create();
+	r->ops = (ring_op*) xmalloc(2*size*sizeof(ring_op));
+	for(unsigned int i=0; i<2*size; i++) {
+		r->ops[i].watch = NULL;
+		r->ops[i].next_free = (i+1 < 2*size) ? (int)(i+1) : -1;
+	}
+	r->free_op = 0;
+	r->inflight = 0;
+	r->connecting = 0;
+	r->entered = 0;
+
+	fcb->streamobj = r;
+	fcb->streamfunc = &ring_fops;
+	*ring = q;
+	return fid;
+}
+
+
+int sys_RingEnter(Fid_t fd, unsigned int to_submit, unsigned int min_complete, timeout_t timeout)
+{
+	FCB* fcb = get_fcb(fd);
+	if(fcb == NULL || fcb->streamfunc != &ring_fops)
+		return -1;
+
+	ring_cb* ring = fcb->streamobj;
+	if(ring->entered)
+		return -1;
+
+	/* make sure that the ring will not be closed while we use it */
+	ring->entered = 1;
+	FCB_incref(fcb);
+
+	TimerDuration deadline = (timeout == TIMEOUT_INFINITE) ? NO_TIMEOUT
+		: bios_clock() + 1000*(TimerDuration)timeout;
+
+	/* Submit, while there is room for the completions */
+	io_ring* q = & ring->queues;
+	unsigned int submitted = 0;
+	while(submitted < to_submit
+		&& q->sq_head != __atomic_load_n(& q->sq_tail, __ATOMIC_ACQUIRE)
+		&& ring->inflight + ring_completions(ring) <= q->cq_mask) {
+		ring_submit(ring, & q->sq[q->sq_head & q->sq_mask]);
+		__atomic_store_n(& q->sq_head, q->sq_head + 1, __ATOMIC_RELEASE);
+		submitted++;
+	}
+
+	/* Complete, until there are enough completions */
+	while(1) {
+		ring_progress(ring);
+		if(ring_completions(ring) >= min_complete || ring->inflight == 0)
+			break;
+		if(deadline != NO_TIMEOUT && bios_clock() >= deadline)
+			break;
+
+		TimerDuration wake = ring_deadline(ring);
+		poll_set_sleep(ring->set, (deadline < wake) ? deadline : wake);
+	}
+
+	ring->entered = 0;
+	FCB_decref(fcb);
+	return submitted;
+}
@@ -37,17 +37,6 @@ CCB cctx[MAX_CORES];
 #define CURTHREAD (CURCORE.current_thread)
 
 
-/*
-	This can be used in the preemptive context to
-	obtain the current thread.
- */
-TCB* cur_thread()
-{
-  int preempt = preempt_off;
-  TCB* cur = CURTHREAD;
-  if(preempt) preempt_on;
-  return cur;
-}
 
 
 
@@ -94,6 +83,29 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 
 #define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
 
+
+/*
+	This can be used in the preemptive context to
+	obtain the current thread.
+
+	If we are preempted and moved to another core while reading
+	CURTHREAD, we may read some other thread. But a thread's stack lies 
+	in the memory block that starts at its TCB, so if our stack is in the 
+	block of the TCB we read, it is our own, and we can avoid the cost 
+	of disabling preemption.
+ */
+TCB* cur_thread()
+{
+  TCB* cur = CURTHREAD;
+  if((uintptr_t)&cur - (uintptr_t)cur < THREAD_SIZE)
+    return cur;
+
+  int preempt = preempt_off;
+  cur = CURTHREAD;
+  if(preempt) preempt_on;
+  return cur;
+}
+
 //#define MMAPPED_THREAD_MEM
 #ifdef MMAPPED_THREAD_MEM
 
@@ -170,6 +182,10 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->curr_cause = SCHED_IDLE;
 	tcb->priority_variable = PRIORITY_QUEUES -1;
 
+	tcb->fid_cache[0] = tcb->fid_cache[1] = NOFILE;
+	tcb->fcb_cache[0] = tcb->fcb_cache[1] = NULL;
+	tcb->fid_cache_busy = 0;
+
 	/* Compute the stack segment address and size */
 	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
 
@@ -409,33 +425,28 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 		preempt_on;
 }
 
+/*
+  Move every thread of the scheduler queues up by one priority level.
+  The queues are visited from the top, so that no thread is moved twice.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void sched_boost()
+{
+	for (int i = PRIORITY_QUEUES - 2; i >= 0; i--) {
+		while (!is_rlist_empty(&SCHED[i])) {
+			TCB* tcb = rlist_pop_front(&SCHED[i])->tcb;
+			tcb->priority_variable = i + 1;
+			rlist_push_back(&SCHED[i + 1], &tcb->sched_node);
+		}
+	}
+}
+
 int yield_counter;
 /* This function is the entry point to the scheduler's context switching */
 
 void yield(enum SCHED_CAUSE cause)
 {
-	/*Boost*/
-  if (yield_counter == (PRIORITY_QUEUES * 4)) {
-        for (int i = PRIORITY_QUEUES - 2; i >= 0; i--) {
-            if (!is_rlist_empty(&SCHED[i])) {
-                rlnode* head = &SCHED[i];
-                rlnode* current = head;
-
-                do {
-                    rlnode* t = rlist_pop_front(current);
-
-                    if (t->tcb != NULL) {
-                        t->tcb->priority_variable++;
-                        rlist_push_back(&SCHED[t->tcb->priority_variable], &(t->tcb->sched_node));
-                    }
-
-                    current = current->next;
-                } while (current->next != head);
-            }
-        }
-        yield_counter = 0;
-    }
-
 	/* Reset the timer, so that we are not interrupted by ALARM */
 	TimerDuration remaining = bios_cancel_timer();
 
@@ -478,7 +489,11 @@ void yield(enum SCHED_CAUSE cause)
 		break;
 	}
 
-	yield_counter ++;
+	/* Periodically boost the waiting threads, so that the lower queues are not starved */
+	if (++yield_counter >= PRIORITY_QUEUES * 4) {
+		sched_boost();
+		yield_counter = 0;
+	}
 
 	/* Wake up threads whose sleep timeout has expired */
 	sched_wakeup_expired_timeouts();
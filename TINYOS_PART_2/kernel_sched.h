@@ -120,6 +120,10 @@ typedef struct thread_control_block {
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
+	Fid_t fid_cache[2]; /**< @brief The file ids cached for lock-free Read and Write (see kernel_streams.h) */
+	FCB* fcb_cache[2]; /**< @brief The FCBs of the cached file ids, each holding a reference */
+	int fid_cache_busy; /**< @brief Set while the thread uses its cache without the kernel lock */
+
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
 
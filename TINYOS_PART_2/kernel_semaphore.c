@@ -0,0 +1,124 @@
+#include <limits.h>
+#include "tinyos.h"
+#include "kernel_streams.h"
+#include "kernel_cc.h"
+
+/*
+	Semaphore streams.
+
+	A semaphore stream is a counter, protected by the kernel lock, and a
+	condition variable where readers (P) wait for the counter to become 
+	positive. As for a Linux eventfd, Read and Write transfer a single 
+	unsigned int: the units to add, or the units to take and then taken, 
+	so that a single call can acquire or release many units at once.
+ */
+
+void sem_counter_init(sem_counter* sem, unsigned int initial, FCB* fcb)
+{
+	sem->count = initial;
+	sem->positive = COND_INIT;
+	sem->fcb = fcb;
+}
+
+
+int sem_counter_take(sem_counter* sem, char *buf, unsigned int n)
+{
+	unsigned int max;
+	if(n != sizeof(max)) return -1;
+	memcpy(&max, buf, sizeof(max));
+
+	while(sem->count == 0) {
+		if(is_nonblocking(sem->fcb)) return WOULDBLOCK;
+		kernel_wait(&sem->positive, SCHED_PIPE);
+	}
+
+	unsigned int taken = (max == 0 || sem->count < max) ? sem->count : max;
+	sem->count -= taken;
+	memcpy(buf, &taken, sizeof(taken));
+
+	/* Let other waiters take what we left */
+	if(sem->count > 0)
+		kernel_signal(&sem->positive);
+
+	return sizeof(taken);
+}
+
+
+int sem_counter_give(sem_counter* sem, const char *buf, unsigned int n)
+{
+	unsigned int units;
+	if(n != sizeof(units)) return -1;
+	memcpy(&units, buf, sizeof(units));
+
+	if(sem->count > UINT_MAX - units)
+		return -1;
+
+	if(units > 0) {
+		sem->count += units;
+		if(units == 1)
+			kernel_signal(&sem->positive);
+		else
+			kernel_broadcast(&sem->positive);
+		FCB_notify(sem->fcb);
+	}
+
+	return sizeof(units);
+}
+
+
+int sem_counter_ready(sem_counter* sem)
+{
+	return STREAM_WRITABLE | (sem->count > 0 ? STREAM_READABLE : 0);
+}
+
+
+static int sem_read(void* semcb_t, char *buf, unsigned int n)
+{
+	return sem_counter_take((sem_counter*) semcb_t, buf, n);
+}
+
+
+static int sem_write(void* semcb_t, const char *buf, unsigned int n)
+{
+	return sem_counter_give((sem_counter*) semcb_t, buf, n);
+}
+
+
+static int sem_ready(void* semcb_t)
+{
+	return sem_counter_ready((sem_counter*) semcb_t);
+}
+
+
+static int sem_close(void* semcb_t)
+{
+	free(semcb_t);
+	return 0;
+}
+
+
+static file_ops sem_fops = {
+	.Open = NULL,
+	.Read = sem_read,
+	.Write = sem_write,
+	.Close = sem_close,
+	.Ready = sem_ready
+};
+
+
+Fid_t sys_Semaphore(unsigned int initial)
+{
+	Fid_t fid;
+	FCB* fcb;
+
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	sem_counter* sem = (sem_counter*) xmalloc(sizeof(sem_counter));
+	sem_counter_init(sem, initial, fcb);
+
+	fcb->streamobj = sem;
+	fcb->streamfunc = &sem_fops;
+
+	return fid;
+}
@@ -0,0 +1,99 @@
+#include "tinyos.h"
+#include "kernel_streams.h"
+#include "kernel_cc.h"
+
+/*
+	Shared memory streams.
+
+	A shared memory stream holds a region of memory, which lives as long
+	as its FCB: the region is freed when the last file id of the stream
+	(in any process) is closed. Since all processes share one address
+	space, mapping a region just returns its address.
+
+	The stream is also a doorbell: a counter, which Write increments and 
+	Read waits on and takes, as for semaphore streams (see sem_counter 
+	in kernel_streams.h).
+ */
+
+typedef struct shm_control_block {
+	void* base;				/* The region */
+	size_t size;			/* Its size in bytes */
+	sem_counter doorbell;	/* Rung by Write, taken by Read */
+} shm_cb;
+
+
+static int shm_read(void* shmcb_t, char *buf, unsigned int n)
+{
+	return sem_counter_take(& ((shm_cb*) shmcb_t)->doorbell, buf, n);
+}
+
+
+static int shm_write(void* shmcb_t, const char *buf, unsigned int n)
+{
+	return sem_counter_give(& ((shm_cb*) shmcb_t)->doorbell, buf, n);
+}
+
+
+static int shm_ready(void* shmcb_t)
+{
+	return sem_counter_ready(& ((shm_cb*) shmcb_t)->doorbell);
+}
+
+
+static int shm_close(void* shmcb_t)
+{
+	shm_cb* shm = (shm_cb*) shmcb_t;
+	free(shm->base);
+	free(shm);
+	return 0;
+}
+
+
+static file_ops shm_fops = {
+	.Open = NULL,
+	.Read = shm_read,
+	.Write = shm_write,
+	.Close = shm_close,
+	.Ready = shm_ready
+};
+
+
+Fid_t sys_ShmCreate(size_t size)
+{
+	Fid_t fid;
+	FCB* fcb;
+
+	if(size == 0 || size > SHM_MAX_SIZE)
+		return NOFILE;
+
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	/* Cache-line aligned, and rounded up to whole cache lines */
+	size_t alloc = (size + 63) & ~(size_t)63;
+	void* base = aligned_alloc(64, alloc);
+	if(base == NULL) {
+		FCB_unreserve(1, &fid, &fcb);
+		return NOFILE;
+	}
+	memset(base, 0, alloc);
+
+	shm_cb* shm = (shm_cb*) xmalloc(sizeof(shm_cb));
+	shm->base = base;
+	shm->size = size;
+	sem_counter_init(& shm->doorbell, 0, fcb);
+
+	fcb->streamobj = shm;
+	fcb->streamfunc = &shm_fops;
+
+	return fid;
+}
+
+
+void* sys_ShmMap(Fid_t fid)
+{
+	FCB* fcb = get_fcb(fid);
+	if(fcb == NULL || fcb->streamfunc != &shm_fops)
+		return NULL;
+	return ((shm_cb*) fcb->streamobj)->base;
+}
@@ -5,19 +5,242 @@
 socket_cb* PORT_MAP[MAX_PORT + 1] = {NULL};
 
 
+/*
+	Socket control blocks are recycled through a small cache, as their
+	pipes are (see pipe_create), so that connection setup and teardown 
+	does not go through the allocator. The cache is protected by the
+	kernel lock.
+ */
+#define SOCKET_CACHE_SIZE 64
+
+static socket_cb* socket_cache[SOCKET_CACHE_SIZE];
+static uint socket_cached = 0;
+
+static socket_cb* socket_alloc()
+{
+	if(socket_cached > 0)
+		return socket_cache[--socket_cached];
+	return (socket_cb*)xmalloc(sizeof(socket_cb));
+}
+
+static void socket_free(socket_cb* socket)
+{
+	if(socket_cached < SOCKET_CACHE_SIZE)
+		socket_cache[socket_cached++] = socket;
+	else
+		free(socket);
+}
+
+
+/*
+	Port allocation.
+
+	A port is held when PORT_MAP has an entry for it: a listener, a bound
+	datagram socket, or a socket bound with Bind. The bitmap mirrors 
+	PORT_MAP (bit set iff the entry is not NULL), so that Bind(sock, ANYPORT)
+	can find the first free ephemeral port a word at a time.
+	PORT_MAP must only be changed through port_map_set.
+ */
+#define PORT_WORD_BITS 64
+#define PORT_WORDS ((MAX_PORT + PORT_WORD_BITS) / PORT_WORD_BITS)
+
+static uint64_t port_bitmap[PORT_WORDS];
+static port_t ephemeral_first = EPHEMERAL_PORT_FIRST;
+static port_t ephemeral_last = EPHEMERAL_PORT_LAST;
+
+static void port_map_set(port_t port, socket_cb* socket)
+{
+	uint64_t bit = (uint64_t)1 << (port % PORT_WORD_BITS);
+
+	PORT_MAP[port] = socket;
+	if(socket != NULL)
+		port_bitmap[port / PORT_WORD_BITS] |= bit;
+	else
+		port_bitmap[port / PORT_WORD_BITS] &= ~bit;
+}
+
+/* Return the lowest free port in the ephemeral range, or NOPORT */
+static port_t port_find_free()
+{
+	uint first_word = ephemeral_first / PORT_WORD_BITS;
+	uint last_word = ephemeral_last / PORT_WORD_BITS;
+
+	for(uint w = first_word; w <= last_word; w++) {
+		uint64_t used = port_bitmap[w];
+
+		/* Mask out the ports outside the range */
+		if(w == first_word)
+			used |= ((uint64_t)1 << (ephemeral_first % PORT_WORD_BITS)) - 1;
+		if(w == last_word && ephemeral_last % PORT_WORD_BITS != PORT_WORD_BITS - 1)
+			used |= ~(uint64_t)0 << (ephemeral_last % PORT_WORD_BITS + 1);
+
+		if(~used != 0)
+			return w * PORT_WORD_BITS + __builtin_ctzll(~used);
+	}
+	return NOPORT;
+}
+
+/* Release the port of a socket which holds it through Bind */
+static void port_release(socket_cb* socket)
+{
+	if(socket->port != NOPORT && PORT_MAP[socket->port] == socket)
+		port_map_set(socket->port, NULL);
+}
+
+
 int socket_read(void* socketcb_t, char *buf, unsigned int n){
 
 	socket_cb* socket = (socket_cb*)socketcb_t;
 
+	/* Not connected, or shut down */
+	if(socket->type != SOCKET_PEER || socket->peer.read_pipe == NULL)
+		return -1;
+
 	return pipe_read(socket->peer.read_pipe, buf, n);
 }
 
 int socket_write(void* socketcb_t, const char *buf, unsigned int n){
 	socket_cb* socket = (socket_cb*)socketcb_t;
+
+	/* Not connected, or shut down */
+	if(socket->type != SOCKET_PEER || socket->peer.write_pipe == NULL)
+		return -1;
 	
 	return pipe_write(socket->peer.write_pipe, buf, n);
 }
 
+int socket_readv(void* socketcb_t, const iovec_t* iov, unsigned int iovcnt){
+	socket_cb* socket = (socket_cb*)socketcb_t;
+
+	if(socket->type != SOCKET_PEER || socket->peer.read_pipe == NULL)
+		return -1;
+
+	return pipe_readv(socket->peer.read_pipe, iov, iovcnt);
+}
+
+int socket_writev(void* socketcb_t, const iovec_t* iov, unsigned int iovcnt){
+	socket_cb* socket = (socket_cb*)socketcb_t;
+
+	if(socket->type != SOCKET_PEER || socket->peer.write_pipe == NULL)
+		return -1;
+
+	return pipe_writev(socket->peer.write_pipe, iov, iovcnt);
+}
+
+int socket_splice(void* socketcb_t, void* out, file_ops* outops, unsigned int n){
+	socket_cb* socket = (socket_cb*)socketcb_t;
+
+	if(socket->type != SOCKET_PEER || socket->peer.read_pipe == NULL)
+		return -1;
+
+	/* Splicing into our own peer would wait on the buffer we are holding */
+	if(outops->Write == socket_write 
+		&& ((socket_cb*)out)->peer.write_pipe == socket->peer.read_pipe)
+		return -1;
+
+	return pipe_splice(socket->peer.read_pipe, out, outops, n);
+}
+
+int socket_ready(void* socketcb_t){
+	socket_cb* socket = (socket_cb*)socketcb_t;
+
+	switch(socket->type){
+		case SOCKET_LISTENER:
+			return is_rlist_empty(&socket->listener.queue) ? 0 : STREAM_READABLE;
+		case SOCKET_PEER: {
+			/* A shut down direction fails at once */
+			int rmask = (socket->peer.read_pipe == NULL) ? STREAM_READABLE | STREAM_ERROR
+				: pipe_read_ready(socket->peer.read_pipe) & ~STREAM_ERROR;
+			int wmask = (socket->peer.write_pipe == NULL) ? STREAM_WRITABLE | STREAM_ERROR
+				: pipe_write_ready(socket->peer.write_pipe) & ~STREAM_HANGUP;
+			return rmask | wmask;
+		}
+		default:
+			return 0;
+	}
+}
+
+/*
+	Pick the listener of a port that gets the next connection request:
+	the one with the fewest pending requests, among those that are not full.
+	The scan starts at PORT_MAP[port], which then moves past the chosen 
+	listener, so that equals take turns. Return NULL if all are full.
+ */
+static socket_cb* select_listener(port_t port)
+{
+	rlnode* head = &PORT_MAP[port]->listener.shard_node;
+	socket_cb* best = NULL;
+
+	rlnode* n = head;
+	do {
+		socket_cb* l = n->obj;
+		if(l->listener.backlog < l->listener.max_backlog
+			&& (best == NULL || l->listener.backlog < best->listener.backlog))
+			best = l;
+		n = n->next;
+	} while(n != head);
+
+	if(best != NULL)
+		port_map_set(port, best->listener.shard_node.next->obj);
+	return best;
+}
+
+/*
+	The condition variable that the accepters of a listener wait on. On a 
+	bridged port it is that of the bridge, so that host clients wake them up 
+	as well; it is then shared by all the listeners of the port.
+ */
+static CondVar* listener_cv(socket_cb* l)
+{
+	int bridge = bridge_lookup(l->port);
+	return (bridge < 0) ? &l->listener.req_available : bridge_accept_cv(bridge);
+}
+
+static void listener_enqueue(socket_cb* l, request* req)
+{
+	req->listener = l;
+	rlist_push_back(&l->listener.queue, &req->queue_node);
+	l->listener.backlog++;
+
+	CondVar* cv = listener_cv(l);
+	if(cv == &l->listener.req_available)
+		kernel_signal(cv);
+	else
+		kernel_broadcast(cv);
+	FCB_notify(l->fcb);
+}
+
+/*
+	Remove a listener from its port. Its pending requests move to the 
+	other listeners of the port; if there is no room for them, they fail.
+ */
+static void listener_close(socket_cb* socket)
+{
+	port_t port = socket->port;
+	rlnode* node = &socket->listener.shard_node;
+
+	if(PORT_MAP[port] == socket)
+		port_map_set(port, (node->next != node) ? node->next->obj : NULL);
+	rlist_remove(node);
+
+	while(! is_rlist_empty(&socket->listener.queue)) {
+		request* req = rlist_pop_front(&socket->listener.queue)->obj;
+		socket_cb* l = (PORT_MAP[port] != NULL) ? select_listener(port) : NULL;
+		if(l != NULL)
+			listener_enqueue(l, req);
+		else {
+			req->listener = NULL;
+			kernel_signal(&req->connected_cv);
+			FCB_notify(req->peer_s->fcb);
+		}
+	}
+	socket->listener.backlog = 0;
+
+	socket->listener.closed = 1;
+	kernel_broadcast(listener_cv(socket));
+}
+
+
 int socket_close(void* socketcb_t) {
     if (socketcb_t == NULL) {
         return -1;  // Check for NULL pointer
@@ -27,24 +250,25 @@ int socket_close(void* socketcb_t) {
 
     switch (socket->type) {
         case SOCKET_UNBOUND:
+        		port_release(socket);
         		if(socket->refcount == 0){
-            		free(socket);
+            		socket_free(socket);
         	}
             break;
 
         case SOCKET_LISTENER:
-            	PORT_MAP[socket->port] = NULL;
-            	kernel_broadcast(& socket->listener.req_available);
+            	listener_close(socket);
             	if(socket->refcount == 0){
-            		free(socket);
+            		socket_free(socket);
         		}
             break;
 
         case SOCKET_PEER:
                 pipe_writer_close(socket->peer.write_pipe);
                 pipe_reader_close(socket->peer.read_pipe);
+                port_release(socket);
                 if(socket->refcount == 0 && socket != NULL){
-            		free(socket);
+            		socket_free(socket);
         		}
             break;
 
@@ -60,7 +284,11 @@ static file_ops socket_ops ={
 	.Open = NULL,
 	.Read = socket_read,
 	.Write = socket_write,
-	.Close = socket_close
+	.Close = socket_close,
+	.Splice = socket_splice,
+	.ReadV = socket_readv,
+	.WriteV = socket_writev,
+	.Ready = socket_ready
 };
 
 Fid_t sys_Socket(port_t port)
@@ -73,11 +301,14 @@ Fid_t sys_Socket(port_t port)
 	}	
 
 	if(FCB_reserve(1,&fid,&fcb) == 1){
-		socket_cb* socket = (socket_cb*)xmalloc(sizeof(socket_cb));
+		socket_cb* socket = socket_alloc();
 		socket->fid = fid;
 		socket->fcb = fcb;
 		socket->type = SOCKET_UNBOUND;
 		socket->port = port;
+		socket->reuseport = 0;
+		socket->sndbuf = socket->rcvbuf = socket->sndlowat = 0;
+		socket->rcvtimeo = socket->sndtimeo = 0;
 
 		socket->refcount = 0;
 
@@ -92,7 +323,7 @@ Fid_t sys_Socket(port_t port)
 	
 }
 
-int sys_Listen(Fid_t sock)
+int sys_ListenEx(Fid_t sock, unsigned int backlog)
 {
 	FCB* fcb = get_fcb(sock);
 
@@ -102,31 +333,53 @@ int sys_Listen(Fid_t sock)
 
 	socket_cb* socket = fcb->streamobj;
 
-	//Check if the socket is not bound to a port
-	if((socket->port == NOPORT) || (socket->port >= MAX_PORT)) {
+	if(backlog == 0 || backlog > MAX_BACKLOG){
 		return -1;
 	}
 
-	//Check if the port bound to the socket is occupied by another listener
-	if(PORT_MAP[socket->port] != NULL){
+	//Check if the socket is not bound to a port
+	if((socket->port == NOPORT) || (socket->port > MAX_PORT)) {
 		return -1;
 	}
 
+	//Check if the socket has already been initialized as a listener or a peer
+	if(socket->type != SOCKET_UNBOUND){
+		return -1;
+	}
 
-	//Check if the socket has already initialized as a listener
-	if(socket->type == SOCKET_LISTENER){
+	//Check if the port bound to the socket is occupied by another listener
+	//(unless they both allow sharing it), by a datagram socket, or by 
+	//another socket through Bind. A socket may listen on its own port.
+	socket_cb* head = PORT_MAP[socket->port];
+	if(head == socket){
+		head = NULL;
+	}
+	else if(head != NULL && !(head->type == SOCKET_LISTENER && socket->reuseport && head->reuseport)){
 		return -1;
 	}
 
-	PORT_MAP[socket->port] = socket;
 	socket->type = SOCKET_LISTENER;
 	socket->listener.req_available = COND_INIT;
 	rlnode_init(&socket->listener.queue,NULL);
+	socket->listener.backlog = 0;
+	socket->listener.max_backlog = backlog;
+	socket->listener.closed = 0;
+
+	rlnode_init(&socket->listener.shard_node, socket);
+	if(head == NULL)
+		port_map_set(socket->port, socket);
+	else
+		rlist_push_back(&head->listener.shard_node, &socket->listener.shard_node);
 
 
 	return 0;
 }
 
+int sys_Listen(Fid_t sock)
+{
+	return sys_ListenEx(sock, MAX_BACKLOG);
+}
+
 void decrease_refcount(socket_cb* socket){
 	socket->refcount --;
 	return;
@@ -137,54 +390,242 @@ void increase_refcount(socket_cb* socket){
 	return;
 }
 
-Fid_t sys_Accept(Fid_t lsock)
+/*
+	Host socket bridges.
+
+	A host client of a bridged port (see boot_vm) is accepted by a 
+	listener of the port as a socket of type SOCKET_BRIDGE, whose stream
+	operations transfer data directly to and from the bridge connection. 
+	They wait on the condition variable of the connection, which is 
+	signalled by the bridge interrupt handler.
+
+	The BIOS calls are made with preemption off, since the BIOS locks
+	its connection table.
+ */
+
+static int bridge_try_accept(int bridge)
 {
-	FCB* fcb = get_fcb(lsock);
-	
+	int pre = preempt_off;
+	int conn = bios_bridge_accept(bridge);
+	if(pre) preempt_on;
+	return conn;
+}
 
-	if(fcb == NULL || fcb->streamfunc != &socket_ops){
-		return NOFILE;
+static int bridge_read(void* socketcb_t, char *buf, unsigned int n)
+{
+	socket_cb* socket = (socket_cb*)socketcb_t;
+	int conn = socket->bridge.conn;
+
+	if(socket->bridge.shut & SHUTDOWN_READ)
+		return -1;
+
+	TimerDuration deadline = stream_deadline(socket->rcvtimeo);
+	while(1) {
+		int pre = preempt_off;
+		int rc = bios_bridge_read(conn, buf, n);
+		if(pre) preempt_on;
+
+		if(rc >= 0)
+			return rc;
+		if(is_nonblocking(socket->fcb))
+			return WOULDBLOCK;
+		if(stream_wait(bridge_conn_cv(conn), deadline) == TIMEDOUT)
+			return TIMEDOUT;
 	}
+}
 
-	socket_cb* socket_cb1 = fcb->streamobj;
+static int bridge_write(void* socketcb_t, const char *buf, unsigned int n)
+{
+	socket_cb* socket = (socket_cb*)socketcb_t;
+	int conn = socket->bridge.conn;
 
-	if(socket_cb1 == NULL || socket_cb1->type != SOCKET_LISTENER){
-		return NOFILE;
+	if(socket->bridge.shut & SHUTDOWN_WRITE)
+		return -1;
+
+	TimerDuration deadline = stream_deadline(socket->sndtimeo);
+	unsigned int count = 0;
+	int rc = 0;
+	while(count < n) {
+		int pre = preempt_off;
+		rc = bios_bridge_write(conn, buf + count, n - count);
+		if(pre) preempt_on;
+
+		if(rc > 0)
+			count += rc;
+		else if(rc < 0)
+			break;
+		else if(is_nonblocking(socket->fcb)){
+			rc = WOULDBLOCK;
+			break;
+		}
+		else if(stream_wait(bridge_conn_cv(conn), deadline) == TIMEDOUT){
+			rc = TIMEDOUT;
+			break;
+		}
 	}
 
-	increase_refcount(socket_cb1);
+	return (count > 0) ? (int)count : rc;
+}
+
+static int bridge_ready(void* socketcb_t)
+{
+	socket_cb* socket = (socket_cb*)socketcb_t;
+	int ready = bios_bridge_ready(socket->bridge.conn);
+
+	int rmask = (socket->bridge.shut & SHUTDOWN_READ) ? STREAM_READABLE | STREAM_ERROR
+		: ((ready & BRIDGE_READABLE) ? STREAM_READABLE : 0);
+	int wmask = (socket->bridge.shut & SHUTDOWN_WRITE) ? STREAM_WRITABLE | STREAM_ERROR
+		: ((ready & BRIDGE_WRITABLE) ? STREAM_WRITABLE : 0);
+	return rmask | wmask;
+}
+
+static int bridge_close(void* socketcb_t)
+{
+	socket_cb* socket = (socket_cb*)socketcb_t;
+
+	int pre = preempt_off;
+	bios_bridge_close(socket->bridge.conn);
+	if(pre) preempt_on;
 
-	while(is_rlist_empty(&socket_cb1->listener.queue) && PORT_MAP[socket_cb1->port]!=NULL){
-		kernel_wait(&socket_cb1->listener.req_available,SCHED_PIPE);
+	if(socket->refcount == 0){
+		socket_free(socket);
 	}
+	return 0;
+}
 
-	if(PORT_MAP[socket_cb1->port] == NULL){
+/* The bridge signals readiness in interrupt context, so it is Polled */
+static file_ops bridge_ops = {
+	.Open = NULL,
+	.Read = bridge_read,
+	.Write = bridge_write,
+	.Close = bridge_close,
+	.Ready = bridge_ready,
+	.Polled = 1
+};
+
+/*
+	Make a socket for a host client accepted by a listener. If the fids
+	are exhausted, the client is dropped and NOFILE is returned.
+ */
+static Fid_t bridge_socket(socket_cb* listener, int conn)
+{
+	Fid_t fid;
+	FCB* fcb;
+
+	if(FCB_reserve(1,&fid,&fcb) != 1){
+		int pre = preempt_off;
+		bios_bridge_close(conn);
+		if(pre) preempt_on;
 		return NOFILE;
 	}
 
+	socket_cb* socket = socket_alloc();
+	socket->fid = fid;
+	socket->fcb = fcb;
+	socket->type = SOCKET_BRIDGE;
+	socket->port = listener->port;
+	socket->reuseport = 0;
+	socket->sndbuf = socket->rcvbuf = socket->sndlowat = 0;
+	socket->rcvtimeo = listener->rcvtimeo;
+	socket->sndtimeo = listener->sndtimeo;
+	socket->refcount = 0;
+	socket->bridge.conn = conn;
+	socket->bridge.shut = 0;
+
+	fcb->streamfunc = &bridge_ops;
+	fcb->streamobj = socket;
+	return fid;
+}
+
 
-	request *first_connection_req = rlist_pop_front(&socket_cb1->listener.queue)->obj;
+/*
+	Wait until a listener has a pending request, or, on a bridged port,
+	accept a host client into *conn (otherwise it is set to -1). 
+	Return 0 if either happened, NOFILE if the listener was closed meanwhile, 
+	WOULDBLOCK, or TIMEDOUT.
+ */
+static int listener_wait(FCB* fcb, socket_cb* socket, int* conn)
+{
+	int bridge = bridge_lookup(socket->port);
+	*conn = -1;
 
-	/*if(first_connection_req == NULL){
+	if(is_rlist_empty(&socket->listener.queue) && bridge >= 0){
+		*conn = bridge_try_accept(bridge);
+	}
+	if(*conn >= 0){
+		return 0;
+	}
+
+	if(is_rlist_empty(&socket->listener.queue) && is_nonblocking(fcb)){
+		return WOULDBLOCK;
+	}
+
+	TimerDuration deadline = stream_deadline(socket->rcvtimeo);
+	int timedout = 0;
+
+	increase_refcount(socket);
+
+	while(is_rlist_empty(&socket->listener.queue) && !socket->listener.closed && !timedout){
+		timedout = (stream_wait(listener_cv(socket), deadline) == TIMEDOUT);
+
+		if(bridge >= 0 && is_rlist_empty(&socket->listener.queue) && !socket->listener.closed
+			&& (*conn = bridge_try_accept(bridge)) >= 0){
+			break;
+		}
+	}
+
+	decrease_refcount(socket);
+
+	//The listener was closed while we waited; the last one out frees it
+	if(socket->listener.closed){
+		if(socket->refcount == 0){
+			socket_free(socket);
+		}
 		return NOFILE;
-	}*/
+	}
+	return (timedout && *conn < 0) ? TIMEDOUT : 0;
+}
 
-	first_connection_req->admitted = 1;
 
-	socket_cb* socket_cb2 = first_connection_req->peer_s;
+/*
+	Create the pipe carrying the data from sender to receiver. Its window
+	is the larger of the two that the ends asked for, and it is fixed; 
+	if neither asked, it is a default pipe, which grows.
+ */
+static pipe_cb* window_create(socket_cb* sender, socket_cb* receiver)
+{
+	uint window = (sender->sndbuf > receiver->rcvbuf) ? sender->sndbuf : receiver->rcvbuf;
+
+	pipe_cb* pipe = (window > 0) ? pipe_create(window, window)
+		: pipe_create(PIPE_BUFFER_SIZE, PIPE_GROWTH_LIMIT);
+	pipe->low_watermark = sender->sndlowat;
+	pipe->write_timeout = sender->sndtimeo;
+	pipe->read_timeout = receiver->rcvtimeo;
+	return pipe;
+}
 
-	Fid_t file_id = sys_Socket(socket_cb1->port);
 
+/*
+	Admit the first pending request of a listener, returning the 
+	new socket, or NOFILE if the fids are exhausted.
+ */
+static Fid_t accept_one(socket_cb* socket_cb1)
+{
+	//Get the new socket first, so that the request is not lost if we fail
+	Fid_t file_id = sys_Socket(socket_cb1->port);
 
-	if (file_id < 0 || file_id > MAX_FILEID){
+	if (file_id == NOFILE){
 		return NOFILE;
 	}
 	
 	FCB* fcb3 = get_fcb(file_id);
 
-	if(fcb3 == NULL){
-		return NOFILE;
-	}
+	request *first_connection_req = rlist_pop_front(&socket_cb1->listener.queue)->obj;
+	socket_cb1->listener.backlog--;
+
+	first_connection_req->admitted = 1;
+
+	socket_cb* socket_cb2 = first_connection_req->peer_s;
 
 
 	socket_cb* socket_cb3 = fcb3->streamobj;
@@ -195,25 +636,21 @@ Fid_t sys_Accept(Fid_t lsock)
 	socket_cb2->type = SOCKET_PEER;
 	socket_cb3->type = SOCKET_PEER;
 
-	pipe_cb *pipe_cb1 = (pipe_cb*)xmalloc(sizeof(pipe_cb));
-	pipe_cb *pipe_cb2 = (pipe_cb*)xmalloc(sizeof(pipe_cb));
+	//The accepted socket inherits the window options of the listener
+	socket_cb3->sndbuf = socket_cb1->sndbuf;
+	socket_cb3->rcvbuf = socket_cb1->rcvbuf;
+	socket_cb3->sndlowat = socket_cb1->sndlowat;
+	socket_cb3->rcvtimeo = socket_cb1->rcvtimeo;
+	socket_cb3->sndtimeo = socket_cb1->sndtimeo;
 
+	pipe_cb *pipe_cb1 = window_create(socket_cb3, socket_cb2);
+	pipe_cb *pipe_cb2 = window_create(socket_cb2, socket_cb3);
 
 	pipe_cb1->reader = socket_cb2->fcb;
 	pipe_cb1->writer = fcb3;
-	pipe_cb1->has_data = COND_INIT;
-	pipe_cb1->has_space = COND_INIT;
-	pipe_cb1->w_position = 0;
-	pipe_cb1->r_position = 0;
-	pipe_cb1->data_size = 0;
 
 	pipe_cb2->reader = fcb3;
 	pipe_cb2->writer = socket_cb2->fcb;
-	pipe_cb2->has_data = COND_INIT;
-	pipe_cb2->has_space = COND_INIT;
-	pipe_cb2->w_position = 0;
-	pipe_cb2->r_position = 0;
-	pipe_cb2->data_size = 0;
 
 	socket_cb2->peer.read_pipe = pipe_cb1;
 	socket_cb2->peer.write_pipe = pipe_cb2;
@@ -222,17 +659,93 @@ Fid_t sys_Accept(Fid_t lsock)
 	socket_cb3->peer.write_pipe = pipe_cb1;
 
 	kernel_signal(&first_connection_req->connected_cv);
-
-	decrease_refcount(socket_cb1);
+	FCB_notify(socket_cb2->fcb);
 
 	return file_id;
 }
 
 
-int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
+static socket_cb* get_listener(FCB* fcb)
 {
-	FCB* fcb = get_fcb(sock);
+	if(fcb == NULL || fcb->streamfunc != &socket_ops){
+		return NULL;
+	}
 
+	socket_cb* socket = fcb->streamobj;
+
+	if(socket == NULL || socket->type != SOCKET_LISTENER){
+		return NULL;
+	}
+	return socket;
+}
+
+
+Fid_t sys_Accept(Fid_t lsock)
+{
+	FCB* fcb = get_fcb(lsock);
+	socket_cb* socket = get_listener(fcb);
+
+	if(socket == NULL){
+		return NOFILE;
+	}
+
+	int conn;
+	int rc = listener_wait(fcb, socket, &conn);
+	if(rc != 0){
+		return rc;
+	}
+
+	if(conn >= 0){
+		return bridge_socket(socket, conn);
+	}
+	return accept_one(socket);
+}
+
+
+int sys_AcceptMany(Fid_t lsock, Fid_t* fids, unsigned int max)
+{
+	FCB* fcb = get_fcb(lsock);
+	socket_cb* socket = get_listener(fcb);
+
+	if(socket == NULL || fids == NULL || max == 0){
+		return -1;
+	}
+
+	int conn;
+	int rc = listener_wait(fcb, socket, &conn);
+	if(rc != 0){
+		return rc;
+	}
+
+	//Take whatever is pending, while there are fids
+	unsigned int count = 0;
+	if(conn >= 0){
+		Fid_t fid = bridge_socket(socket, conn);
+		if(fid != NOFILE){
+			fids[count++] = fid;
+		}
+	}
+	while(count < max && !is_rlist_empty(&socket->listener.queue)){
+		Fid_t fid = accept_one(socket);
+		if(fid == NOFILE){
+			break;
+		}
+		fids[count++] = fid;
+	}
+
+	return (count > 0) ? (int)count : -1;
+}
+
+
+/*
+	Connecting is done in steps, so that rings (see kernel_ring.c) can 
+	connect without blocking: socket_connect_start queues a request,
+	socket_connect_settled tells if it has been admitted or refused, and
+	socket_connect_finish withdraws it if it has not, returning the result.
+	The FCB of the socket is notified when the request is settled.
+ */
+int socket_connect_start(FCB* fcb, port_t port, request* req)
+{
 	if(fcb == NULL || fcb->streamfunc != &socket_ops){
 		return -1;
 	}
@@ -240,7 +753,7 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	socket_cb* socket = fcb->streamobj;
 
 	//the given port is illegal
-	if(port <= 0 || port >= MAX_PORT || PORT_MAP[port] == NULL){
+	if(port <= 0 || port > MAX_PORT || PORT_MAP[port] == NULL){
 		return -1;
 	}
 
@@ -253,34 +766,63 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 		return -1;
 	}
 
+	//Fail at once if the listeners have no room
+	socket_cb* listener = select_listener(port);
+	if(listener == NULL){
+		return -1;
+	}
+
 	increase_refcount(socket);
 
-	request *req = (request*)xmalloc(sizeof(request));
 	req->peer_s = socket;
 	req->connected_cv = COND_INIT;
 	req->admitted = 0;
 
-	
 	rlnode_init(&req->queue_node,req);
-	rlist_push_back(&PORT_MAP[port]->listener.queue,&req->queue_node);
+	listener_enqueue(listener, req);
+	return 0;
+}
 
-	kernel_signal(&PORT_MAP[port]->listener.req_available);
 
-	while(req->admitted != 1){
-		int result = kernel_timedwait(&req->connected_cv,SCHED_PIPE,timeout*1000);
+int socket_connect_settled(request* req)
+{
+	//Admitted, or the last listener of the port was closed
+	return req->admitted == 1 || req->listener == NULL;
+}
 
-		if(result == 0){
-			break;
-		}
+
+int socket_connect_finish(request* req)
+{
+	//On timeout, withdraw the request
+	if(! socket_connect_settled(req)){
+		rlist_remove(&req->queue_node);
+		req->listener->listener.backlog--;
 	}
 
-	decrease_refcount(socket);
+	decrease_refcount(req->peer_s);
+
+	return (req->admitted == 1) ? 0 : -1;
+}
 
-	if(req->admitted != 1){
+
+int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
+{
+	//The request lives on our stack, since we wait until it is settled
+	request req;
+
+	if(socket_connect_start(get_fcb(sock), port, &req) != 0){
 		return -1;
 	}
 
-	return 0;
+	while(! socket_connect_settled(&req)){
+		int result = kernel_timedwait(&req.connected_cv,SCHED_PIPE,timeout*1000);
+
+		if(result == 0){
+			break;
+		}
+	}
+
+	return socket_connect_finish(&req);
 }
 
 
@@ -289,6 +831,17 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 
 	FCB* fcb = get_fcb(sock);
 
+	if(fcb != NULL && fcb->streamfunc == &bridge_ops){
+		socket_cb* socket = fcb->streamobj;
+		if(how >= SHUTDOWN_READ && how <= SHUTDOWN_BOTH){
+			socket->bridge.shut |= how;
+			int pre = preempt_off;
+			bios_bridge_shutdown(socket->bridge.conn, how);
+			if(pre) preempt_on;
+		}
+		return 0;
+	}
+
 	if(fcb == NULL || fcb->streamfunc != &socket_ops){
 		return -1;
 	}
@@ -299,19 +852,24 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 		return -1;
 	}
 
+	/* A closed end is forgotten, so that socket_close does not close it again */
 	switch(how)
 	{
 		case SHUTDOWN_READ:
 			pipe_reader_close(socket->peer.read_pipe);
+			socket->peer.read_pipe = NULL;
 			break;
 
 		case SHUTDOWN_WRITE:
 			pipe_writer_close(socket->peer.write_pipe);
+			socket->peer.write_pipe = NULL;
 			break;
 
 		case SHUTDOWN_BOTH:
 			pipe_writer_close(socket->peer.write_pipe);
 			pipe_reader_close(socket->peer.read_pipe);
+			socket->peer.write_pipe = NULL;
+			socket->peer.read_pipe = NULL;
 			break;
 
 		default:
@@ -321,3 +879,491 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 	return 0;
 }
 
+
+static file_ops dgram_ops;
+static file_ops topic_ops;
+
+int sys_SetSockOpt(Fid_t sock, int option, int value)
+{
+	FCB* fcb = get_fcb(sock);
+
+	if(fcb == NULL || (fcb->streamfunc != &socket_ops && fcb->streamfunc != &dgram_ops
+		&& fcb->streamfunc != &topic_ops)){
+		return -1;
+	}
+
+	//Datagram and topic sockets only have timeouts
+	if(fcb->streamfunc != &socket_ops && option != SOCKOPT_RCVTIMEO && option != SOCKOPT_SNDTIMEO){
+		return -1;
+	}
+
+	socket_cb* socket = fcb->streamobj;
+
+	switch(option)
+	{
+		case SOCKOPT_REUSEPORT:
+			//It only matters to Listen
+			if(socket->type != SOCKET_UNBOUND){
+				return -1;
+			}
+			socket->reuseport = (value != 0);
+			return 0;
+
+		case SOCKOPT_SNDBUF:
+		case SOCKOPT_RCVBUF:
+			if(value <= 0 || value > PIPE_MAX_BUFFER_SIZE){
+				return -1;
+			}
+			if(socket->type == SOCKET_PEER){
+				pipe_cb* pipe = (option == SOCKOPT_SNDBUF) ? socket->peer.write_pipe : socket->peer.read_pipe;
+				if(pipe == NULL || pipe_set_capacity(pipe, value) != 0){
+					return -1;
+				}
+			}
+			if(option == SOCKOPT_SNDBUF)
+				socket->sndbuf = value;
+			else
+				socket->rcvbuf = value;
+			return 0;
+
+		case SOCKOPT_SNDLOWAT:
+			if(value < 0 || value > PIPE_MAX_BUFFER_SIZE){
+				return -1;
+			}
+			if(socket->type == SOCKET_PEER && socket->peer.write_pipe != NULL){
+				pipe_cb* pipe = socket->peer.write_pipe;
+				pipe->low_watermark = value;
+				kernel_broadcast(&pipe->has_space);
+				FCB_notify(pipe->writer);
+			}
+			socket->sndlowat = value;
+			return 0;
+
+		case SOCKOPT_RCVTIMEO:
+			if(value < 0){
+				return -1;
+			}
+			if(socket->type == SOCKET_PEER && socket->peer.read_pipe != NULL){
+				socket->peer.read_pipe->read_timeout = value;
+			}
+			socket->rcvtimeo = value;
+			return 0;
+
+		case SOCKOPT_SNDTIMEO:
+			if(value < 0){
+				return -1;
+			}
+			if(socket->type == SOCKET_PEER && socket->peer.write_pipe != NULL){
+				socket->peer.write_pipe->write_timeout = value;
+			}
+			socket->sndtimeo = value;
+			return 0;
+
+		default:
+			return -1;
+	}
+}
+
+
+int sys_Bind(Fid_t sock, port_t port)
+{
+	FCB* fcb = get_fcb(sock);
+
+	if(fcb == NULL || (fcb->streamfunc != &socket_ops && fcb->streamfunc != &dgram_ops)){
+		return -1;
+	}
+
+	socket_cb* socket = fcb->streamobj;
+
+	if(socket->port != NOPORT || (socket->type != SOCKET_UNBOUND && socket->type != SOCKET_DGRAM)){
+		return -1;
+	}
+
+	if(port == ANYPORT){
+		port = port_find_free();
+		if(port == NOPORT){
+			return -1;
+		}
+	}
+	else if(port <= 0 || port > MAX_PORT || PORT_MAP[port] != NULL){
+		return -1;
+	}
+
+	socket->port = port;
+	port_map_set(port, socket);
+	return port;
+}
+
+
+int sys_SetEphemeralPorts(port_t first, port_t last)
+{
+	if(first <= 0 || last > MAX_PORT || first > last){
+		return -1;
+	}
+
+	ephemeral_first = first;
+	ephemeral_last = last;
+	return 0;
+}
+
+
+
+/*
+	Datagram sockets.
+
+	A bound datagram socket is entered in PORT_MAP, like a listener.
+	Each message is copied into a dgram_msg, which is queued at the 
+	receiving socket, or dropped if that socket's queue is full.
+ */
+
+typedef struct datagram_message {
+	port_t from;
+	uint len;
+	rlnode node;
+	char data[];
+} dgram_msg;
+
+
+/* Receive one message; from may be NULL */
+static int dgram_recv(socket_cb* socket, port_t* from, char* buf, unsigned int n)
+{
+	if(socket->port == NOPORT)
+		return -1;
+
+	TimerDuration deadline = stream_deadline(socket->rcvtimeo);
+	while(socket->dgram.count == 0) {
+		if(is_nonblocking(socket->fcb)) return WOULDBLOCK;
+		if(stream_wait(&socket->dgram.has_msg, deadline) == TIMEDOUT) return TIMEDOUT;
+	}
+
+	dgram_msg* msg = rlist_pop_front(&socket->dgram.queue)->obj;
+	socket->dgram.count--;
+
+	/* The part that does not fit is discarded */
+	unsigned int len = (msg->len < n) ? msg->len : n;
+	memcpy(buf, msg->data, len);
+	if(from) *from = msg->from;
+	free(msg);
+
+	return len;
+}
+
+static int dgram_read(void* socketcb_t, char *buf, unsigned int n)
+{
+	return dgram_recv((socket_cb*)socketcb_t, NULL, buf, n);
+}
+
+static int dgram_write(void* socketcb_t, const char *buf, unsigned int n)
+{
+	/* There is no destination */
+	return -1;
+}
+
+static int dgram_ready(void* socketcb_t)
+{
+	socket_cb* socket = (socket_cb*)socketcb_t;
+	return STREAM_WRITABLE | ((socket->dgram.count > 0) ? STREAM_READABLE : 0);
+}
+
+static int dgram_close(void* socketcb_t)
+{
+	socket_cb* socket = (socket_cb*)socketcb_t;
+
+	if(socket->port != NOPORT)
+		port_map_set(socket->port, NULL);
+
+	while(! is_rlist_empty(&socket->dgram.queue))
+		free(rlist_pop_front(&socket->dgram.queue)->obj);
+
+	socket_free(socket);
+	return 0;
+}
+
+static file_ops dgram_ops = {
+	.Open = NULL,
+	.Read = dgram_read,
+	.Write = dgram_write,
+	.Close = dgram_close,
+	.Ready = dgram_ready
+};
+
+
+Fid_t sys_SocketDgram(port_t port)
+{
+	Fid_t fid;
+	FCB* fcb;
+
+	if(port < 0 || port > MAX_PORT || (port != NOPORT && PORT_MAP[port] != NULL)){
+		return NOFILE;
+	}
+
+	if(! FCB_reserve(1, &fid, &fcb)){
+		return NOFILE;
+	}
+
+	socket_cb* socket = socket_alloc();
+	socket->fid = fid;
+	socket->fcb = fcb;
+	socket->type = SOCKET_DGRAM;
+	socket->port = port;
+	socket->reuseport = 0;
+	socket->sndbuf = socket->rcvbuf = socket->sndlowat = 0;
+	socket->rcvtimeo = socket->sndtimeo = 0;
+	socket->refcount = 0;
+
+	rlnode_init(&socket->dgram.queue, NULL);
+	socket->dgram.count = 0;
+	socket->dgram.dropped = 0;
+	socket->dgram.has_msg = COND_INIT;
+
+	if(port != NOPORT)
+		port_map_set(port, socket);
+
+	fcb->streamfunc = &dgram_ops;
+	fcb->streamobj = socket;
+	return fid;
+}
+
+
+static socket_cb* get_dgram_socket(Fid_t sock)
+{
+	FCB* fcb = get_fcb(sock);
+
+	if(fcb == NULL || fcb->streamfunc != &dgram_ops){
+		return NULL;
+	}
+	return fcb->streamobj;
+}
+
+
+int sys_SendTo(Fid_t sock, port_t port, const char* buf, unsigned int n)
+{
+	socket_cb* socket = get_dgram_socket(sock);
+
+	if(socket == NULL || n > MAX_DGRAM_SIZE){
+		return -1;
+	}
+
+	if(port <= 0 || port > MAX_PORT || PORT_MAP[port] == NULL || PORT_MAP[port]->type != SOCKET_DGRAM){
+		return -1;
+	}
+
+	socket_cb* dest = PORT_MAP[port];
+
+	/* The sender is never blocked */
+	if(dest->dgram.count >= DGRAM_QUEUE_LENGTH){
+		dest->dgram.dropped++;
+		return n;
+	}
+
+	dgram_msg* msg = (dgram_msg*)xmalloc(sizeof(dgram_msg) + n);
+	msg->from = socket->port;
+	msg->len = n;
+	memcpy(msg->data, buf, n);
+
+	rlnode_init(&msg->node, msg);
+	rlist_push_back(&dest->dgram.queue, &msg->node);
+	dest->dgram.count++;
+
+	kernel_signal(&dest->dgram.has_msg);
+	FCB_notify(dest->fcb);
+	return n;
+}
+
+
+int sys_RecvFrom(Fid_t sock, port_t* port, char* buf, unsigned int n)
+{
+	socket_cb* socket = get_dgram_socket(sock);
+
+	if(socket == NULL){
+		return -1;
+	}
+
+	/* make sure that the socket will not be closed while we wait */
+	FCB* fcb = socket->fcb;
+	FCB_incref(fcb);
+	int rc = dgram_recv(socket, port, buf, n);
+	FCB_decref(fcb);
+
+	return rc;
+}
+
+
+
+/*
+	Topics (publish/subscribe).
+
+	A topic keeps the last TOPIC_RING_LENGTH messages in a ring, indexed
+	by sequence number. Publishing copies a message into the slot of the 
+	next sequence number, overwriting the oldest one; each subscriber 
+	reads from the slot of its own cursor, and a cursor which has been 
+	overtaken skips ahead to the oldest message in the ring. Slot buffers 
+	are kept and reused, growing to the largest message they have held.
+
+	PORT_MAP[port] points to one of the members of the topic.
+ */
+
+typedef struct topic_slot {
+	uint len;
+	uint capacity;
+	char* data;
+} topic_slot;
+
+typedef struct topic_control_block {
+	uint64_t head;		/* the sequence number of the next message */
+	topic_slot ring[TOPIC_RING_LENGTH];
+	rlnode members;		/* publishers and subscribers */
+	CondVar published;
+} topic_cb;
+
+
+static int topic_read(void* socketcb_t, char *buf, unsigned int n)
+{
+	socket_cb* socket = (socket_cb*)socketcb_t;
+	topic_cb* topic = socket->topic.topic;
+
+	if(! socket->topic.subscriber)
+		return -1;
+
+	TimerDuration deadline = stream_deadline(socket->rcvtimeo);
+	while(socket->topic.cursor == topic->head) {
+		if(is_nonblocking(socket->fcb)) return WOULDBLOCK;
+		if(stream_wait(&topic->published, deadline) == TIMEDOUT) return TIMEDOUT;
+	}
+
+	/* Skip the messages that were overwritten */
+	if(topic->head - socket->topic.cursor > TOPIC_RING_LENGTH) {
+		socket->topic.dropped += topic->head - TOPIC_RING_LENGTH - socket->topic.cursor;
+		socket->topic.cursor = topic->head - TOPIC_RING_LENGTH;
+	}
+
+	/* The part that does not fit is discarded */
+	topic_slot* slot = &topic->ring[socket->topic.cursor % TOPIC_RING_LENGTH];
+	unsigned int len = (slot->len < n) ? slot->len : n;
+	memcpy(buf, slot->data, len);
+	socket->topic.cursor++;
+
+	return len;
+}
+
+static int topic_write(void* socketcb_t, const char *buf, unsigned int n)
+{
+	socket_cb* socket = (socket_cb*)socketcb_t;
+	topic_cb* topic = socket->topic.topic;
+
+	if(socket->topic.subscriber || n > MAX_DGRAM_SIZE)
+		return -1;
+	if(n == 0)
+		return 0;
+
+	topic_slot* slot = &topic->ring[topic->head % TOPIC_RING_LENGTH];
+	if(slot->capacity < n) {
+		free(slot->data);
+		slot->data = (char*)xmalloc(n);
+		slot->capacity = n;
+	}
+	memcpy(slot->data, buf, n);
+	slot->len = n;
+	topic->head++;
+
+	kernel_broadcast(&topic->published);
+	for(rlnode* m = topic->members.next; m != &topic->members; m = m->next) {
+		socket_cb* member = m->obj;
+		if(member->topic.subscriber)
+			FCB_notify(member->fcb);
+	}
+	return n;
+}
+
+static int topic_ready(void* socketcb_t)
+{
+	socket_cb* socket = (socket_cb*)socketcb_t;
+
+	if(! socket->topic.subscriber)
+		return STREAM_WRITABLE;
+	return (socket->topic.cursor != socket->topic.topic->head) ? STREAM_READABLE : 0;
+}
+
+static int topic_close(void* socketcb_t)
+{
+	socket_cb* socket = (socket_cb*)socketcb_t;
+	topic_cb* topic = socket->topic.topic;
+	rlnode* node = &socket->topic.member_node;
+
+	if(PORT_MAP[socket->port] == socket)
+		port_map_set(socket->port, (node->next != &topic->members) ? node->next->obj 
+			: (node->prev != &topic->members) ? node->prev->obj : NULL);
+	rlist_remove(node);
+
+	/* The last member out frees the topic */
+	if(is_rlist_empty(&topic->members)) {
+		for(uint i=0; i<TOPIC_RING_LENGTH; i++)
+			free(topic->ring[i].data);
+		free(topic);
+	}
+
+	socket_free(socket);
+	return 0;
+}
+
+static file_ops topic_ops = {
+	.Open = NULL,
+	.Read = topic_read,
+	.Write = topic_write,
+	.Close = topic_close,
+	.Ready = topic_ready
+};
+
+
+Fid_t sys_SocketTopic(port_t port, topic_role role)
+{
+	Fid_t fid;
+	FCB* fcb;
+
+	if(port <= 0 || port > MAX_PORT || (PORT_MAP[port] != NULL && PORT_MAP[port]->type != SOCKET_TOPIC)){
+		return NOFILE;
+	}
+	if(role != TOPIC_PUBLISH && role != TOPIC_SUBSCRIBE){
+		return NOFILE;
+	}
+
+	if(! FCB_reserve(1, &fid, &fcb)){
+		return NOFILE;
+	}
+
+	topic_cb* topic;
+	if(PORT_MAP[port] != NULL){
+		topic = PORT_MAP[port]->topic.topic;
+	}
+	else{
+		topic = (topic_cb*)xmalloc(sizeof(topic_cb));
+		topic->head = 0;
+		for(uint i=0; i<TOPIC_RING_LENGTH; i++)
+			topic->ring[i] = (topic_slot){ .len = 0, .capacity = 0, .data = NULL };
+		rlnode_init(&topic->members, NULL);
+		topic->published = COND_INIT;
+	}
+
+	socket_cb* socket = socket_alloc();
+	socket->fid = fid;
+	socket->fcb = fcb;
+	socket->type = SOCKET_TOPIC;
+	socket->port = port;
+	socket->reuseport = 0;
+	socket->sndbuf = socket->rcvbuf = socket->sndlowat = 0;
+	socket->rcvtimeo = socket->sndtimeo = 0;
+	socket->refcount = 0;
+
+	socket->topic.topic = topic;
+	socket->topic.subscriber = (role == TOPIC_SUBSCRIBE);
+	socket->topic.cursor = topic->head;
+	socket->topic.dropped = 0;
+	rlist_push_back(&topic->members, rlnode_init(&socket->topic.member_node, socket));
+
+	if(PORT_MAP[port] == NULL)
+		port_map_set(port, socket);
+
+	fcb->streamfunc = &topic_ops;
+	fcb->streamobj = socket;
+	return fid;
+}
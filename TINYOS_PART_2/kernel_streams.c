@@ -1,4 +1,5 @@
 
+#include <limits.h>
 #include "util.h"
 #include "tinyos.h"
 #include "kernel_cc.h"
@@ -6,29 +7,74 @@
 #include "kernel_sched.h"
 #include "kernel_proc.h"
 
+/*
+	FCBs are allocated on demand, FCB_SLAB_SIZE at a time, and they are 
+	never freed. A released FCB goes to the free list of the core that 
+	releases it, and a core takes FCBs from its own list first. A core 
+	whose list is empty moves a batch of free FCBs over from another core.
+	Only when every list is empty does it carve a new slab, as long as 
+	fewer than MAX_FILES FCBs exist. The free lists are protected by the 
+	kernel lock.
+ */
 #define MAX_FILES MAX_PROC
+#define FCB_SLAB_SIZE 64
 
-FCB FT[MAX_FILES];
-rlnode FCB_freelist;
+static rlnode FCB_free[MAX_CORES];
+static uint FCB_count = 0;
 
 
 void initialize_files()
 {
-  rlnode_init(&FCB_freelist,NULL);
-  for(int i=0;i<MAX_FILES;i++) {
+  for(int c=0;c<MAX_CORES;c++)
+    rlnode_new(& FCB_free[c]);
+}
+
 
-    FT[i].refcount = 0;
-    rlnode_init(& FT[i].freelist_node, &FT[i]);
-    rlist_push_back(&FCB_freelist, & FT[i].freelist_node);
+static void FCB_slab(rlnode* freelist)
+{
+  FCB* slab = (FCB*) xmalloc(FCB_SLAB_SIZE*sizeof(FCB));
+  for(int i=0;i<FCB_SLAB_SIZE;i++) {
+    slab[i].refcount = 0;
+    rlnode_init(& slab[i].freelist_node, & slab[i]);
+    rlist_push_back(freelist, & slab[i].freelist_node);
   }
+  FCB_count += FCB_SLAB_SIZE;
+}
+
+
+/*
+  Move up to FCB_SLAB_SIZE/2 free FCBs from another core's list to freelist.
+  Return 0 if all the other lists are empty.
+ */
+static int FCB_steal(rlnode* freelist)
+{
+  for(int c=0;c<MAX_CORES;c++) {
+    rlnode* victim = & FCB_free[c];
+    if(victim == freelist || is_rlist_empty(victim)) continue;
+
+    /* Take from the back, where the FCBs released least recently are */
+    for(int i=0; i<FCB_SLAB_SIZE/2 && !is_rlist_empty(victim); i++)
+      rlist_push_back(freelist, rlist_pop_back(victim));
+    return 1;
+  }
+  return 0;
 }
 
 
 FCB* acquire_FCB()
 {
-  if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+  rlnode* freelist = & FCB_free[cpu_core_id];
+
+  if(is_rlist_empty(freelist) && ! FCB_steal(freelist)
+      && FCB_count + FCB_SLAB_SIZE <= MAX_FILES)
+    FCB_slab(freelist);
+
+  if(! is_rlist_empty(freelist)) {
+    FCB* fcb = rlist_pop_front(freelist)->fcb;
     fcb->refcount = 0;
+    fcb->flags = 0;
+    rlnode_new(& fcb->watchers);
+    fcb->nwatchers = 0;
     return fcb;
   }
   else
@@ -37,7 +83,8 @@ FCB* acquire_FCB()
 
 void release_FCB(FCB* fcb)
 {
-  rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  /* LIFO, so that the next acquire on this core gets a cache-warm FCB */
+  rlist_push_front(& FCB_free[cpu_core_id], & fcb->freelist_node);
 }
 
 
@@ -53,6 +100,7 @@ int FCB_decref(FCB* fcb)
   fcb->refcount --;
   if(fcb->refcount==0) {
     int retval = fcb->streamfunc->Close(fcb->streamobj);
+    FCB_unwatch(fcb);
     release_FCB(fcb);
     return retval;
   }
@@ -62,53 +110,229 @@ int FCB_decref(FCB* fcb)
 
 
 
+/*
+ *
+ *   File id tables
+ *
+ */
+
+#define FIDT_WORD_BITS 64
+#define FIDT_WORDS(n) (((n) + FIDT_WORD_BITS - 1) / FIDT_WORD_BITS)
+
+
+fid_table* fidt_create(uint limit)
+{
+  fid_table* t = (fid_table*) xmalloc(sizeof(fid_table));
+  t->fcb = NULL;
+  t->used = NULL;
+  t->full = NULL;
+  t->size = 0;
+  t->limit = limit;
+  t->refcount = 1;
+  return t;
+}
+
+
+/* Grow the table to hold fid, zeroing the new entries */
+static void fidt_grow(fid_table* t, Fid_t fid)
+{
+  uint size = (t->size > 0) ? t->size : FIDT_WORD_BITS;
+  while(size <= (uint)fid) size *= 2;
+
+  t->fcb = (FCB**) realloc(t->fcb, size*sizeof(FCB*));
+  t->used = (uint64_t*) realloc(t->used, FIDT_WORDS(size)*sizeof(uint64_t));
+  t->full = (uint64_t*) realloc(t->full, FIDT_WORDS(FIDT_WORDS(size))*sizeof(uint64_t));
+  if(t->fcb == NULL || t->used == NULL || t->full == NULL)
+    FATAL("Out of memory for the file id table");
+
+  memset(t->fcb + t->size, 0, (size - t->size)*sizeof(FCB*));
+  memset(t->used + FIDT_WORDS(t->size), 0, 
+    (FIDT_WORDS(size) - FIDT_WORDS(t->size))*sizeof(uint64_t));
+  memset(t->full + FIDT_WORDS(FIDT_WORDS(t->size)), 0, 
+    (FIDT_WORDS(FIDT_WORDS(size)) - FIDT_WORDS(FIDT_WORDS(t->size)))*sizeof(uint64_t));
+  t->size = size;
+}
+
+
+FCB* fidt_get(fid_table* t, Fid_t fid)
+{
+  if(fid < 0 || (uint)fid >= t->size) return NULL;
+  return t->fcb[fid];
+}
+
+
+int fidt_set(fid_table* t, Fid_t fid, FCB* fcb)
+{
+  if(fid < 0 || (uint)fid >= t->limit) return -1;
+  if((uint)fid >= t->size) {
+    if(fcb == NULL) return 0;
+    fidt_grow(t, fid);
+  }
+
+  uint w = fid / FIDT_WORD_BITS;
+  uint64_t bit = 1ull << (fid % FIDT_WORD_BITS);
+  uint64_t wbit = 1ull << (w % FIDT_WORD_BITS);
+
+  t->fcb[fid] = fcb;
+  if(fcb != NULL) {
+    t->used[w] |= bit;
+    if(t->used[w] == ~0ull) t->full[w / FIDT_WORD_BITS] |= wbit;
+  } else {
+    t->used[w] &= ~bit;
+    t->full[w / FIDT_WORD_BITS] &= ~wbit;
+  }
+  return 0;
+}
+
+
+Fid_t fidt_alloc(fid_table* t, FCB* fcb)
+{
+  /* The first word that is not full holds the lowest free fid; 
+     past the end of the table, every fid is free. */
+  uint words = FIDT_WORDS(t->size);
+  uint f = t->size;
+  for(uint i=0; i<FIDT_WORDS(words); i++) {
+    if(t->full[i] != ~0ull) {
+      uint w = i*FIDT_WORD_BITS + __builtin_ctzll(~t->full[i]);
+      if(w < words)
+        f = w*FIDT_WORD_BITS + __builtin_ctzll(~t->used[w]);
+      break;
+    }
+  }
+
+  if(f >= t->limit) return NOFILE;
+  fidt_set(t, f, fcb);
+  return f;
+}
+
+
+Fid_t fidt_next(fid_table* t, Fid_t fid)
+{
+  if(fid < 0) fid = 0;
+  for(uint w = fid / FIDT_WORD_BITS; w < FIDT_WORDS(t->size); w++) {
+    uint64_t bits = t->used[w];
+    if(w == fid / FIDT_WORD_BITS)
+      bits &= ~0ull << (fid % FIDT_WORD_BITS);
+    if(bits)
+      return w*FIDT_WORD_BITS + __builtin_ctzll(bits);
+  }
+  return NOFILE;
+}
+
+
+fid_table* fidt_share(fid_table* t)
+{
+  t->refcount++;
+  return t;
+}
+
+
+void fidt_release(fid_table* t)
+{
+  if(--t->refcount > 0) return;
+
+  for(Fid_t f = fidt_next(t, 0); f != NOFILE; f = fidt_next(t, f+1)) {
+    FCB* fcb = t->fcb[f];
+    fidt_set(t, f, NULL);
+    FCB_decref(fcb);
+  }
+
+  free(t->fcb);
+  free(t->used);
+  free(t->full);
+  free(t);
+}
+
+
+fid_table* fidt_own(fid_table** pt)
+{
+  fid_table* src = *pt;
+  if(src->refcount == 1) return src;
+
+  fid_table* dst = fidt_create(src->limit);
+  if(src->size > 0) {
+    fidt_grow(dst, src->size - 1);
+    memcpy(dst->fcb, src->fcb, src->size*sizeof(FCB*));
+    memcpy(dst->used, src->used, FIDT_WORDS(src->size)*sizeof(uint64_t));
+    memcpy(dst->full, src->full, FIDT_WORDS(FIDT_WORDS(src->size))*sizeof(uint64_t));
+
+    for(Fid_t f = fidt_next(src, 0); f != NOFILE; f = fidt_next(src, f+1))
+      FCB_incref(src->fcb[f]);
+  }
+
+  /* src is still held by some other process */
+  src->refcount--;
+  *pt = dst;
+  return dst;
+}
+
+
+
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 {
-    PCB* cur = CURPROC;
-    size_t f=0;
+    fid_table* fidt = fidt_own(& CURPROC->FIDT);
     uint i;
 
-    /* Find distinct fids */
-    for(i=0; i<num; i++) {
-	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
-	    f++;
-	if(f==MAX_FILEID) break;
-	fid[i] = f; f++;
-    }
-    if(i<num) return 0;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
 	    break;
-    if(i<num) {
-	/* Roll back */
-	while(i>0) {
-	    release_FCB(fcb[i-1]);
-	    i--;
+    /* Allocate the lowest distinct fids */
+    if(i==num) {
+	for(i=0;i<num;i++)
+	    if((fid[i] = fidt_alloc(fidt, fcb[i])) == NOFILE)
+		break;
+	if(i<num) {
+	    /* Roll back the fids */
+	    while(i>0) {
+		fidt_set(fidt, fid[i-1], NULL);
+		i--;
+	    }
+	    i = num;
+	}
+	else {
+	    /* Found all */
+	    for(i=0;i<num;i++)
+		FCB_incref(fcb[i]);
+	    return 1;
 	}
-	return 0;
     }
-    /* Found all */
-    for(i=0;i<num;i++) {
-	cur->FIDT[fid[i]]=fcb[i];
-	FCB_incref(fcb[i]);
+    /* Roll back the FCBs */
+    while(i>0) {
+	release_FCB(fcb[i-1]);
+	i--;
     }
-    return 1;
+    return 0;
 }
 
 
 
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
-    PCB* cur = CURPROC;
+    fid_table* fidt = CURPROC->FIDT;   /* FCB_reserve made it private */
     for(size_t i=0; i<num ; i++) {
-	assert(cur->FIDT[fid[i]]==fcb[i]);
-	cur->FIDT[fid[i]] = NULL;
+	assert(fidt_get(fidt, fid[i])==fcb[i]);
+	fidt_set(fidt, fid[i], NULL);
 	release_FCB(fcb[i]);
     }
 }
 
 
+int sys_SetFileLimit(unsigned int limit)
+{
+  fid_table* fidt = CURPROC->FIDT;
+
+  if(limit < 1 || limit > MAX_FILEID_LIMIT)
+    return -1;
+  if(fidt_next(fidt, limit) != NOFILE)
+    return -1;
+
+  if(limit != fidt->limit)
+    fidt_own(& CURPROC->FIDT)->limit = limit;
+  return 0;
+}
+
+
 
 
 
@@ -122,9 +346,98 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 
 FCB* get_fcb(Fid_t fid)
 {
-  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+  return fidt_get(CURPROC->FIDT, fid);
+}
+
+
+/*
+ *
+ *   The file id cache (see kernel_streams.h)
+ *
+ */
+
+void fid_cache_set(int slot, Fid_t fid, FCB* fcb)
+{
+  TCB* tcb = cur_thread();
+  FCB* old = tcb->fcb_cache[slot];
+  if(old == fcb && tcb->fid_cache[slot] == fid) return;
+
+  FCB_incref(fcb);
+  __atomic_store_n(& tcb->fcb_cache[slot], fcb, __ATOMIC_RELAXED);
+  __atomic_store_n(& tcb->fid_cache[slot], fid, __ATOMIC_SEQ_CST);
+  if(old) FCB_decref(old);
+}
+
+
+/* Drop the entries of a thread that were dropped while it was busy */
+static void fid_cache_tidy(TCB* tcb)
+{
+  for(int s=0; s<2; s++) {
+    FCB* fcb = tcb->fcb_cache[s];
+    if(tcb->fid_cache[s] == NOFILE && fcb != NULL) {
+      __atomic_store_n(& tcb->fcb_cache[s], NULL, __ATOMIC_RELAXED);
+      FCB_decref(fcb);
+    }
+  }
+}
+
+
+void fid_cache_drop(Fid_t fid)
+{
+  rlnode* list = & CURPROC->ptcb_list;
+  for(rlnode* p = list->next; p != list; p = p->next) {
+    if(p->ptcb->exited) continue;
+    TCB* tcb = p->ptcb->tcb;
+    for(int s=0; s<2; s++) {
+      if(tcb->fid_cache[s] != fid) continue;
+
+      /* 
+        Either the thread sees this store when it enters, or we see 
+        that it is busy, and it drops the reference when it leaves.
+       */
+      __atomic_store_n(& tcb->fid_cache[s], NOFILE, __ATOMIC_SEQ_CST);
+      if(! __atomic_load_n(& tcb->fid_cache_busy, __ATOMIC_SEQ_CST))
+        fid_cache_tidy(tcb);
+    }
+  }
+}
 
-  return CURPROC->FIDT[fid];
+
+void fid_cache_clear()
+{
+  TCB* tcb = cur_thread();
+  tcb->fid_cache[FID_CACHE_READ] = tcb->fid_cache[FID_CACHE_WRITE] = NOFILE;
+  fid_cache_tidy(tcb);
+}
+
+
+FCB* fid_cache_enter(int slot, Fid_t fid)
+{
+  TCB* tcb = cur_thread();
+  if(fid == NOFILE) return NULL;
+
+  __atomic_store_n(& tcb->fid_cache_busy, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(& tcb->fid_cache[slot], __ATOMIC_SEQ_CST) == fid)
+    return tcb->fcb_cache[slot];
+
+  fid_cache_leave();
+  return NULL;
+}
+
+
+void fid_cache_leave()
+{
+  TCB* tcb = cur_thread();
+  __atomic_store_n(& tcb->fid_cache_busy, 0, __ATOMIC_SEQ_CST);
+
+  for(int s=0; s<2; s++)
+    if(__atomic_load_n(& tcb->fid_cache[s], __ATOMIC_SEQ_CST) == NOFILE
+        && __atomic_load_n(& tcb->fcb_cache[s], __ATOMIC_RELAXED) != NULL) {
+      kernel_lock();
+      fid_cache_tidy(tcb);
+      kernel_unlock();
+      break;
+    }
 }
 
 
@@ -142,6 +455,10 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
     sobj = fcb->streamobj;
     devread = fcb->streamfunc->Read;
 
+    /* the next calls may take the lock-free path */
+    if(fcb->streamfunc->Unlocked)
+      fid_cache_set(FID_CACHE_READ, fd, fcb);
+
     /* make sure that the stream will not be closed (by another thread) 
        while we are using it! */
     FCB_incref(fcb);
@@ -175,6 +492,10 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
     sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
+    /* the next calls may take the lock-free path */
+    if(fcb->streamfunc->Unlocked)
+      fid_cache_set(FID_CACHE_WRITE, fd, fcb);
+
     /* make sure that the stream will not be closed (by another thread) 
        while we are using it! */
     FCB_incref(fcb);
@@ -193,14 +514,205 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 }
 
 
+/* 
+  Return the total length of an I/O vector, or -1 if the vector is not legal.
+ */
+static int iov_length(const iovec_t* iov, unsigned int iovcnt)
+{
+  if(iovcnt > MAX_IOV || (iov == NULL && iovcnt > 0))
+    return -1;
+
+  size_t total = 0;
+  for(unsigned int i=0; i<iovcnt; i++) {
+    if(iov[i].len > INT_MAX - total)
+      return -1;
+    total += iov[i].len;
+  }
+  return total;
+}
+
+
+/* The largest kernel buffer used by ReadV for streams without a ReadV operation */
+#define READV_BUFFER_SIZE 65536
+
+int sys_ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  FCB* fcb = get_fcb(fd);
+  int total = iov_length(iov, iovcnt);
+
+  if(fcb == NULL || total < 0 || fcb->streamfunc->Read == NULL)
+    return -1;
+
+  /* make sure that the stream will not be closed while we are using it */
+  FCB_incref(fcb);
+
+  int retcode;
+  if(fcb->streamfunc->ReadV) {
+    retcode = fcb->streamfunc->ReadV(fcb->streamobj, iov, iovcnt);
+  }
+  else {
+    /* 
+      A single Read, so that we do not block once some data has arrived.
+      The data is then scattered into the segments.
+     */
+    unsigned int size = (total < READV_BUFFER_SIZE) ? total : READV_BUFFER_SIZE;
+    char* buffer = (char*) xmalloc(size > 0 ? size : 1);
+
+    retcode = fcb->streamfunc->Read(fcb->streamobj, buffer, size);
+    unsigned int done = 0;
+    for(unsigned int i=0; i<iovcnt && retcode > 0 && done < (unsigned int)retcode; i++) {
+      unsigned int seg = iov[i].len;
+      if(seg > retcode - done) seg = retcode - done;
+      memcpy(iov[i].base, buffer + done, seg);
+      done += seg;
+    }
+    free(buffer);
+  }
+
+  FCB_decref(fcb);
+  return retcode;
+}
+
+
+int sys_WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  FCB* fcb = get_fcb(fd);
+  int total = iov_length(iov, iovcnt);
+
+  if(fcb == NULL || total < 0 || fcb->streamfunc->Write == NULL)
+    return -1;
+
+  /* make sure that the stream will not be closed while we are using it */
+  FCB_incref(fcb);
+
+  int retcode;
+  if(fcb->streamfunc->WriteV) {
+    retcode = fcb->streamfunc->WriteV(fcb->streamobj, iov, iovcnt);
+  }
+  else {
+    /* One Write per segment, stopping at the first short write */
+    int count = 0;
+    retcode = 0;
+    for(unsigned int i=0; i<iovcnt; i++) {
+      if(iov[i].len == 0) continue;
+      retcode = fcb->streamfunc->Write(fcb->streamobj, iov[i].base, iov[i].len);
+      if(retcode <= 0) break;
+      count += retcode;
+      if((size_t)retcode < iov[i].len) break;
+    }
+    if(count > 0) retcode = count;
+  }
+
+  FCB_decref(fcb);
+  return retcode;
+}
+
+
+/* The size of the kernel buffer used by Splice for streams without a Splice operation */
+#define SPLICE_BUFFER_SIZE 1024
+
+int sys_Splice(Fid_t in, Fid_t out, size_t n)
+{
+  int retcode = -1;
+
+  FCB* infcb = get_fcb(in);
+  FCB* outfcb = get_fcb(out);
+
+  if(infcb==NULL || outfcb==NULL || infcb->streamobj==outfcb->streamobj)
+    return -1;
+  if(infcb->streamfunc->Read==NULL || outfcb->streamfunc->Write==NULL)
+    return -1;
+  if(n == 0)
+    return 0;
+  if(n > INT_MAX) n = INT_MAX;
+
+  /* make sure that neither stream will be closed while we are using it */
+  FCB_incref(infcb);
+  FCB_incref(outfcb);
+
+  void* sobj = infcb->streamobj;
+  void* dobj = outfcb->streamobj;
+  file_ops* dops = outfcb->streamfunc;
+
+  if(infcb->streamfunc->Splice) {
+    retcode = infcb->streamfunc->Splice(sobj, dobj, dops, n);
+  }
+  else {
+    /* Copy through a kernel buffer */
+    char buffer[SPLICE_BUFFER_SIZE];
+    int count = infcb->streamfunc->Read(sobj, buffer, 
+      (n < SPLICE_BUFFER_SIZE) ? n : SPLICE_BUFFER_SIZE);
+
+    retcode = count;
+    if(count > 0) {
+      int written = 0;
+      while(written < count) {
+        int rc = dops->Write(dobj, buffer+written, count-written);
+        if(rc <= 0) break;
+        written += rc;
+      }
+      retcode = (written > 0) ? written : -1;
+    }
+  }
+
+  FCB_decref(outfcb);
+  FCB_decref(infcb);
+
+  return retcode;
+}
+
+
+TimerDuration stream_deadline(timeout_t timeout)
+{
+  return (timeout == 0) ? NO_TIMEOUT : bios_clock() + 1000*(TimerDuration)timeout;
+}
+
+
+int stream_wait(CondVar* cv, TimerDuration deadline)
+{
+  if(deadline == NO_TIMEOUT) {
+    kernel_wait(cv, SCHED_PIPE);
+    return 0;
+  }
+
+  TimerDuration now = bios_clock();
+  if(now >= deadline)
+    return TIMEDOUT;
+  kernel_timedwait(cv, SCHED_PIPE, deadline - now);
+  return 0;
+}
+
+
+int sys_Fcntl(Fid_t fd, int cmd, int arg)
+{
+  FCB* fcb = get_fcb(fd);
+
+  if(fcb == NULL)
+    return -1;
+
+  switch(cmd) {
+    case FCNTL_GETFL:
+      return fcb->flags;
+    case FCNTL_SETFL:
+      if(arg & ~STREAM_NONBLOCK)
+        return -1;
+      fcb->flags = arg;
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+
 int sys_Close(int fd)
 {
-  int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+  int retcode = (fd>=0 && fd<CURPROC->FIDT->limit) ? 0 : -1;  /* Closing a closed fd is legal! */
 
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+    fid_cache_drop(fd);
+    fidt_set(fidt_own(& CURPROC->FIDT), fd, NULL);
     retcode = FCB_decref(fcb);    
   }
 
@@ -218,7 +730,8 @@ int sys_Close(int fd)
 int sys_Dup2(int oldfd, int newfd)
 {
   int retcode=0;
-  if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
+  uint limit = CURPROC->FIDT->limit;
+  if(oldfd<0 || newfd<0 || oldfd>=limit || newfd>=limit)
     return -1;
 
   FCB* old = get_fcb(oldfd);
@@ -228,10 +741,14 @@ int sys_Dup2(int oldfd, int newfd)
     retcode = -1;
   }
   else if(old!=new) {
-    if(new)
+    /* The references to change must be those of a private table */
+    fid_table* fidt = fidt_own(& CURPROC->FIDT);
+    if(new) {
+      fid_cache_drop(newfd);
       FCB_decref(new);
+    }
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    fidt_set(fidt, newfd, old);
   }
 
   return retcode;
@@ -257,7 +774,7 @@ Fid_t open_stream(Device_type major, unsigned int minor)
   if(! FCB_reserve(1, &fid, &fcb))
       goto finerr;
   
-  if(device_open(major, minor, & fcb->streamobj, &fcb->streamfunc)) {
+  if(device_open(major, minor, fcb, & fcb->streamobj, &fcb->streamfunc)) {
       FCB_unreserve(1, &fid, &fcb);
       goto finerr;
   }
@@ -43,11 +43,124 @@ typedef struct file_control_block
   uint refcount;  			/**< @brief Reference counter. */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
+  int flags;				/**< @brief Stream flags, set by @c Fcntl (e.g., @c STREAM_NONBLOCK) */
+  rlnode watchers;			/**< @brief Poll watches on this stream */
+  uint nwatchers;			/**< @brief The length of @c watchers, for lock-free readers */
   rlnode freelist_node;		/**< @brief Intrusive list node */
 } FCB;
 
 
 
+/** @brief The file id table of a process.
+
+	The table maps file ids to FCBs. It starts empty, and it grows (doubling)
+	as higher file ids are used, up to its limit. 
+
+	A bitmap of the used file ids, together with a bitmap of its full 
+	words, finds the lowest free file id by scanning a few words, 
+	even for tens of thousands of open files.
+
+	Growing moves the arrays of the table, so the table is only accessed 
+	with the kernel lock held; lock-free code uses the file id cache of 
+	its thread instead (see @c fid_cache_enter).
+
+	A table may be shared by several processes (a child shares the table 
+	of its parent after @c Exec), and it holds one reference to each of its 
+	FCBs, however many processes share it. A process that changes its table
+	first makes a private copy of it, with @c fidt_own.
+ */
+typedef struct fid_table
+{
+  FCB** fcb;				/**< @brief The entries, @c size of them */
+  uint64_t* used;			/**< @brief Bit f is set if @c fcb[f] is not NULL */
+  uint64_t* full;			/**< @brief Bit w is set if word w of @c used is full */
+  uint size;				/**< @brief The number of entries, a multiple of 64 */
+  uint limit;				/**< @brief File ids must be less than this (see @c SetFileLimit) */
+  uint refcount;			/**< @brief The number of processes sharing the table */
+} fid_table;
+
+
+/** @brief Return a new, empty table with the given limit, held by one process. */
+fid_table* fidt_create(uint limit);
+
+/** @brief Add a process to the holders of a table, and return it. */
+fid_table* fidt_share(fid_table* t);
+
+/** @brief Remove a process from the holders of a table.
+
+	The last holder closes all the file ids of the table, and frees it.
+ */
+void fidt_release(fid_table* t);
+
+/** @brief Make the table of a process private to it, before changing it.
+
+	If the table @c *pt is shared, it is released and replaced by a copy, 
+	whose FCBs get an extra reference. Return the (possibly new) @c *pt.
+	The old table is freed when its last other holder releases it; this is 
+	safe because only the kernel lock makes a table reachable (see 
+	@c fid_cache_enter).
+ */
+fid_table* fidt_own(fid_table** pt);
+
+/** @brief Return the FCB of a file id, or NULL if it is not open. */
+FCB* fidt_get(fid_table* t, Fid_t fid);
+
+/** @brief Set (or, if @c fcb is NULL, clear) a file id.
+
+	Return 0 on success, or -1 if the file id is not below the limit. 
+ */
+int fidt_set(fid_table* t, Fid_t fid, FCB* fcb);
+
+/** @brief Set the lowest free file id to @c fcb, returning it, or NOFILE if none is free. */
+Fid_t fidt_alloc(fid_table* t, FCB* fcb);
+
+/** @brief Return the lowest open file id at or above @c fid, or NOFILE. */
+Fid_t fidt_next(fid_table* t, Fid_t fid);
+
+
+/** @brief Lock-free access to file ids.
+
+	The file id table of a process is protected by the kernel lock. It may 
+	grow (moving its arrays) or be replaced by a private copy (see @c fidt_own) 
+	at any time, and a table or FCB is freed as soon as nothing refers to it.
+	Therefore, code that runs without the kernel lock must never call 
+	@c get_fcb, or look at a table.
+
+	Instead, each thread caches one file id for Read and one for Write, if 
+	their stream sets @c Unlocked in its @c file_ops. A cached FCB holds a 
+	reference, so it stays valid whatever happens to the table. The lifetime
+	rules are:
+	- @c sys_Read and @c sys_Write fill the cache of the calling thread, 
+	  with the kernel lock held (@c fid_cache_set).
+	- Before a file id is closed or replaced, its entries are dropped from 
+	  the caches of all the threads of the process (@c fid_cache_drop).
+	- A thread exiting drops its own entries (@c fid_cache_clear).
+	- Without the lock, a thread looks at its own cache only, between 
+	  @c fid_cache_enter and @c fid_cache_leave. An entry dropped meanwhile 
+	  keeps its reference until the thread leaves.
+ */
+enum { FID_CACHE_READ, FID_CACHE_WRITE };
+
+/** @brief Cache the FCB of a file id in the current thread, dropping the previous entry. */
+void fid_cache_set(int slot, Fid_t fid, FCB* fcb);
+
+/** @brief Drop the entries of a file id from all the threads of the current process. */
+void fid_cache_drop(Fid_t fid);
+
+/** @brief Drop all the entries of the current thread. */
+void fid_cache_clear();
+
+/** @brief Return the cached FCB of a file id, without the kernel lock.
+
+	If this returns an FCB, the caller must call @c fid_cache_leave when it 
+	is done with it. It returns NULL if the file id is not cached.
+ */
+FCB* fid_cache_enter(int slot, Fid_t fid);
+
+/** @brief Stop using the cache, after @c fid_cache_enter. */
+void fid_cache_leave();
+
+
 /** 
   @brief Initialization for files and streams.
 
@@ -128,6 +241,136 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Check if operations on a stream must not block.
+
+	Stream implementations call this on the FCB they serve, and
+	return @c WOULDBLOCK instead of waiting when it returns true.
+
+	@param fcb the FCB, or NULL (in which case the result is 0)
+	@returns non-zero if @c STREAM_NONBLOCK is set for @c fcb
+*/
+static inline int is_nonblocking(FCB* fcb)
+{
+	return fcb != NULL && (fcb->flags & STREAM_NONBLOCK);
+}
+
+
+/** @brief The deadline of a blocking stream operation starting now.
+
+	@param timeout the timeout of the operation in msec, or 0 for none
+	@returns the deadline, or @c NO_TIMEOUT
+*/
+TimerDuration stream_deadline(timeout_t timeout);
+
+
+/** @brief Wait on a condition variable, but not past a deadline.
+
+	Stream implementations loop on this, as they would on @c kernel_wait(),
+	and return @c TIMEDOUT when it does.
+
+	@param cv the condition variable
+	@param deadline a deadline from @c stream_deadline()
+	@returns 0 after waiting, or @c TIMEDOUT if the deadline has passed
+*/
+int stream_wait(CondVar* cv, TimerDuration deadline);
+
+
+/** @brief Return the readiness mask of a stream.
+
+	This calls the @c Ready operation of the stream, if any.
+	@see file_ops
+*/
+int FCB_ready(FCB* fcb);
+
+
+/** @brief Report a possible change in the readiness of a stream.
+
+	Stream implementations call this (with the kernel lock held) when 
+	data, space, connections or hang-ups appear, so that threads waiting 
+	in @c Poll or @c EpollWait on the stream are woken up.
+	It is legal to pass NULL, in which case nothing happens.
+*/
+void FCB_notify(FCB* fcb);
+
+
+/** @brief Remove all poll watches from an FCB.
+
+	This is called when the FCB is released.
+*/
+void FCB_unwatch(FCB* fcb);
+
+
+/** @brief A counter of units, as in a semaphore (see kernel_semaphore.c).
+
+	The counter is protected by the kernel lock. Read and Write transfer 
+	a single unsigned int, as for a Linux eventfd, so that a stream can 
+	serve them with @c sem_counter_take and @c sem_counter_give. Semaphore 
+	streams, and the doorbells of shared memory streams, are such counters.
+ */
+typedef struct semaphore_counter {
+  unsigned int count;		/**< @brief The counter */
+  CondVar positive;		/**< @brief Signalled when count becomes positive */
+  FCB* fcb;				/**< @brief The stream, for its flags and notifications */
+} sem_counter;
+
+/** @brief Initialize a counter for the stream of @c fcb. */
+void sem_counter_init(sem_counter* sem, unsigned int initial, FCB* fcb);
+
+/** @brief Take units from the counter, waiting while there are none.
+
+	@c buf holds an unsigned int: on entry the most units to take (0 for 
+	all of them), and on return the units taken. Return @c sizeof(unsigned int),
+	-1 if @c n is not that, or @c WOULDBLOCK for a non-blocking stream.
+ */
+int sem_counter_take(sem_counter* sem, char* buf, unsigned int n);
+
+/** @brief Add the units in @c buf, an unsigned int.
+
+	Return @c sizeof(unsigned int), or -1 if @c n is not that or the 
+	counter would overflow.
+ */
+int sem_counter_give(sem_counter* sem, const char* buf, unsigned int n);
+
+/** @brief The readiness of a counter: always writable, and readable if positive. */
+int sem_counter_ready(sem_counter* sem);
+
+
+/** @brief An interest set (see kernel_poll.c). */
+typedef struct poll_set poll_set;
+
+/** @brief A stream in an interest set. */
+typedef struct poll_watch poll_watch;
+
+/** @brief Return a new, empty interest set. */
+poll_set* poll_set_create();
+
+/** @brief Remove all the watches of a set, and free it. */
+void poll_set_destroy(poll_set* set);
+
+/** @brief Watch a stream for some events. 
+
+	The watch is reported (by @c poll_set_take) with the given @c fd, 
+	once at first, and then whenever the stream calls @c FCB_notify.
+ */
+poll_watch* poll_watch_add(poll_set* set, FCB* fcb, Fid_t fd, int events);
+
+/** @brief Remove a watch from its set. */
+void poll_watch_remove(poll_watch* w);
+
+/** @brief Return the @c fd of the next reported watch of a set, or NOFILE if there is none. 
+
+	Unlike @c Poll, this does not check that the stream is ready.
+ */
+Fid_t poll_set_take(poll_set* set);
+
+/** @brief Wait until a watch of the set is reported, or until @c deadline.
+
+	If the set watches Polled streams, this waits for a short interval at 
+	most, and then reports all of them.
+ */
+void poll_set_sleep(poll_set* set, TimerDuration deadline);
+
+
 /** @} */
 
 #endif
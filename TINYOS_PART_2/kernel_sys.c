@@ -32,6 +32,19 @@ RET NAME SIG \
 	return __ret;\
 }\
 
+/* with return, trying the lock-free fast path first */
+#define SYSCALL_FAST(NAME, RET, SIG, ARGS)\
+RET NAME SIG \
+{\
+	RET __ret;\
+	if(fast_##NAME(&__ret, SYSCALL_UNPACK ARGS))\
+		return __ret;\
+	PRE_CALL\
+	__ret = sys_##NAME ARGS;\
+	POST_CALL\
+	return __ret;\
+}\
+
 /* without return */
 #define SYSCALLV(NAME, SIG, ARGS)\
 void NAME SIG \
@@ -6,6 +6,7 @@
 
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(ExecEx, int, (Task task, int argl, void* args, int flags, const Fid_t* fids, unsigned int nfids), (task, argl, args, flags, fids, nfids))\
 SYSCALLV(Exit, (int exitval), (exitval))\
 SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
@@ -18,17 +19,44 @@ SYSCALLV(ThreadExit, (int exitval), (exitval))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
-SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
-SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL_FAST(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL_FAST(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL(ReadV, int, (Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd, iov, iovcnt))\
+SYSCALL(WriteV, int, (Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd, iov, iovcnt))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
+SYSCALL(SetFileLimit, int, (unsigned int limit), (limit))\
+SYSCALL(Fcntl, int, (Fid_t fd, int cmd, int arg), (fd, cmd, arg))\
+SYSCALL(Splice, int, (Fid_t in, Fid_t out, size_t n), (in, out, n))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(PipeEx, int, (pipe_t* pipe, size_t capacity), (pipe, capacity))\
+SYSCALL(SetPipeSize, int, (Fid_t fid, size_t capacity), (fid, capacity))\
+SYSCALL(PipeSPSC, int, (pipe_t* pipe, size_t capacity), (pipe, capacity))\
+SYSCALL(PipePacket, int, (pipe_t* pipe, size_t capacity), (pipe, capacity))\
+SYSCALL(Semaphore, Fid_t, (unsigned int initial), (initial))\
+SYSCALL(ShmCreate, Fid_t, (size_t size), (size))\
+SYSCALL(ShmMap, void*, (Fid_t fid), (fid))\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
+SYSCALL(ListenEx, int, (Fid_t sock, unsigned int backlog), (sock, backlog))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
+SYSCALL(AcceptMany, int, (Fid_t lsock, Fid_t* fids, unsigned int max), (lsock, fids, max))\
+SYSCALL(Bind, int, (Fid_t sock, port_t port), (sock, port))\
+SYSCALL(SetEphemeralPorts, int, (port_t first, port_t last), (first, last))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
+SYSCALL(SetSockOpt, int, (Fid_t sock, int option, int value), (sock, option, value))\
+SYSCALL(SocketDgram, Fid_t, (port_t port), (port))\
+SYSCALL(SendTo, int, (Fid_t sock, port_t port, const char* buf, unsigned int n), (sock, port, buf, n))\
+SYSCALL(RecvFrom, int, (Fid_t sock, port_t* port, char* buf, unsigned int n), (sock, port, buf, n))\
+SYSCALL(SocketTopic, Fid_t, (port_t port, topic_role role), (port, role))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(Poll, int, (poll_fd* fds, unsigned int n, timeout_t timeout), (fds, n, timeout))\
+SYSCALL(EpollCreate, Fid_t, (), ())\
+SYSCALL(EpollCtl, int, (Fid_t epfd, int op, Fid_t fd, int events), (epfd, op, fd, events))\
+SYSCALL(EpollWait, int, (Fid_t epfd, poll_fd* events, unsigned int maxevents, timeout_t timeout), (epfd, events, maxevents, timeout))\
+SYSCALL(RingCreate, Fid_t, (unsigned int entries, io_ring** ring), (entries, ring))\
+SYSCALL(RingEnter, int, (Fid_t ring, unsigned int to_submit, unsigned int min_complete, timeout_t timeout), (ring, to_submit, min_complete, timeout))\
 
 
 
@@ -39,9 +67,21 @@ RET sys_ ## NAME SIG;
 #define SYSCALLV(NAME, SIG, ARGS)\
 void sys_ ## NAME SIG;
 
+#define SYSCALL_UNPACK(...) __VA_ARGS__
+
+/* 
+	with return, and a fast path that runs without the kernel lock.
+	fast_NAME returns 1 and stores the result in *ret if it 
+	completed the call, and 0 if sys_NAME must be called instead.
+ */
+#define SYSCALL_FAST(NAME, RET, SIG, ARGS)\
+RET sys_ ## NAME SIG;\
+int fast_ ## NAME (RET* ret, SYSCALL_UNPACK SIG);
+
 SYSCALLS
 
 #undef SYSCALL
 #undef SYSCALLV
+#undef SYSCALL_FAST
 
 #endif
\ No newline at end of file
@@ -124,6 +124,9 @@ void sys_ThreadExit(int exitval)
     PCB *curproc = CURPROC;
     PTCB* ptcb = cur_thread()->ptcb;
 
+    /* Our cached FCBs are unreachable from now on */
+    fid_cache_clear();
+
     ptcb->exitval = exitval;
     ptcb->exited = 1;
 
@@ -169,12 +172,8 @@ void sys_ThreadExit(int exitval)
   }
 
   /*Clean up FIDT */
-  for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
-  } 
+  fidt_release(curproc->FIDT);
+  curproc->FIDT = NULL;
 
   while(!is_rlist_empty(&CURPROC->ptcb_list)){
     PTCB* check = rlist_pop_front(&CURPROC->ptcb_list)->ptcb;
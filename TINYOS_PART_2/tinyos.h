@@ -37,6 +37,9 @@ typedef int Pid_t;		/* The PID type  */
 */
 typedef unsigned long timeout_t;
 
+/** @brief A timeout value meaning "wait without limit". */
+#define TIMEOUT_INFINITE ((timeout_t)-1)
+
 
 /** @brief The invalid PID */
 #define NOPROC (-1)
@@ -47,13 +50,27 @@ typedef unsigned long timeout_t;
 /** @brief The type of a file ID. */
 typedef int Fid_t;  
 
-/** @brief The maximum number of open files per process. 
-   Only values 0 to MAX_FILEID-1 are legal for file descriptors. */
+/** @brief The default limit of open files per process. 
+   Only values 0 to MAX_FILEID-1 are legal for file descriptors,
+   unless the limit is changed by @c SetFileLimit. */
 #define MAX_FILEID 16
 
+/** @brief The largest limit of open files per process (see @c SetFileLimit). */
+#define MAX_FILEID_LIMIT 65536
+
 /** @brief The invalid file id. */
 #define NOFILE  (-1)
 
+/** @brief The value returned by an operation on a non-blocking stream,
+   when it would otherwise block.
+   @see Fcntl */
+#define WOULDBLOCK  (-2)
+
+/** @brief The value returned by a blocking operation which gave up 
+   because its timeout expired.
+   @see SOCKOPT_RCVTIMEO */
+#define TIMEDOUT  (-3)
+
 
 /**
   @brief The type of a thread ID.
@@ -74,11 +91,18 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    Besides the lock word, a mutex records the thread that holds it. This
+    information is only a hint, used by @c Mutex_Lock to decide whether
+    spinning is worthwhile.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef struct {
+  char lock;            /**< The lock word, manipulated atomically */
+  TCB* owner;           /**< The owner of the lock, or NULL */
+} Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -88,13 +112,14 @@ typedef char Mutex;
    Mutex my_mutex = MUTEX_INIT;
   @endcode
  */
-#define MUTEX_INIT 0
+#define MUTEX_INIT ((Mutex){ 0, NULL })
 
 
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  in kernel-space (preemptive domain), the locking will spin only while the 
+  owner of the mutex is running on another core, and yield otherwise.
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
   @see Mutex
@@ -135,7 +160,7 @@ typedef struct {
   CondVar my_cv = COND_INIT;
   @endcode
  */
-#define COND_INIT ((CondVar){ NULL, MUTEX_INIT })
+#define COND_INIT ((CondVar){ NULL, { 0, NULL } })
 
 
 /** @brief Wait on a condition variable. 
@@ -243,6 +268,41 @@ typedef int (*Task)(int, void*);
 Pid_t Exec(Task task, int argl, void* args);
 
 
+/** @brief Flags for @c ExecEx. */
+enum exec_flags {
+  EXEC_SELECT_FIDS = 1   /**< The child inherits only the listed file ids. */
+};
+
+/** @brief Create a new process, choosing the file ids it inherits.
+
+  This call is like @c Exec, but if @c flags contains @c EXEC_SELECT_FIDS, 
+  the new process inherits only the @c nfids file ids in array @c fids 
+  (at the same file ids), and no others. The new process inherits the limit
+  of open files (see @c SetFileLimit) in any case.
+
+  An inherited file id table is shared by the two processes, and it is
+  copied when one of them first changes it (e.g., by @c Close, @c Dup2 or 
+  by opening a file). So, @c Exec does not depend on the number of open files.
+  With @c EXEC_SELECT_FIDS, the new process gets a new table, holding just
+  the listed file ids, which is cheap when a process with many open files
+  spawns a child that needs only a few of them.
+
+  @param task the main function  of the new process
+  @param argl the length of byte array @c args
+  @param args the byte array copied as argument to `task`
+  @param flags zero, or @c EXEC_SELECT_FIDS
+  @param fids the file ids to inherit, if @c EXEC_SELECT_FIDS is given
+  @param nfids the length of array @c fids
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned.
+     Possible errors:
+   -  The maximum number of processes has been reached.
+   -  @c flags is not valid.
+   -  Some file id in @c fids is not open.
+  */
+Pid_t ExecEx(Task task, int argl, void* args, int flags, const Fid_t* fids, unsigned int nfids);
+
+
 /** @brief Exit the current process.
 
   When this function is called by a process thread, the process terminates
@@ -430,6 +490,7 @@ Fid_t OpenNull();
   @param buf pointer to a byte buffer to receive the read data
   @param size maximum size of @c buf
   @return the number of bytes copied, 0 if we have reached EOF, or -1, indicating some error.
+        If the stream is non-blocking and no data is available, @c WOULDBLOCK is returned.
         Possible errors are:
          - The file descriptor is invalid.
          - There was a I/O runtime problem.
@@ -453,6 +514,8 @@ int Read(Fid_t fd, char *buf, unsigned int size);
   @param size maximum size of @c buf
   @return As its function result, the @c Write function should return the 
    number of bytes copied from @c buf, or -1 on error. 
+   If the stream is non-blocking, the call copies what fits without waiting,
+   and returns @c WOULDBLOCK if nothing fits.
    Possible errors are:
    - The file id is invalid.
    - There was a I/O runtime problem.
@@ -491,6 +554,121 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/** @brief Set the limit of open files of the current process.
+
+  After this call, only values 0 to @c limit-1 are legal for the file ids 
+  of the process. The limit starts at @c MAX_FILEID, and it is inherited 
+  by child processes. The file id table of a process grows as it uses 
+  higher file ids, so a high limit costs nothing until it is used.
+
+  @param limit the new limit, from 1 to @c MAX_FILEID_LIMIT
+  @return This call returns 0 on success and -1 on failure.
+  Possible reasons for failure:
+  - The limit is out of range.
+  - A file id at or above the limit is open.
+ */
+int SetFileLimit(unsigned int limit);
+
+
+/** @brief Commands for @c Fcntl. */
+enum fcntl_cmd {
+  FCNTL_GETFL,    /**< Return the flags of the stream. */
+  FCNTL_SETFL     /**< Set the flags of the stream to the argument. */
+};
+
+/** @brief Stream flag: operations that would block return @c WOULDBLOCK instead. */
+#define STREAM_NONBLOCK 1
+
+/** @brief Get or set the flags of a stream.
+
+  The flags belong to the stream, and are therefore shared by all
+  file ids that refer to it (e.g., after @c Dup2 or @c Exec).
+
+  When @c STREAM_NONBLOCK is set, @c Read, @c Write and @c Splice on pipes,
+  sockets, semaphores and terminals, and @c Accept on listening sockets,
+  return @c WOULDBLOCK instead of waiting. @c Connect is not affected.
+
+  @param fd the file id
+  @param cmd @c FCNTL_GETFL or @c FCNTL_SETFL
+  @param arg for @c FCNTL_SETFL, the new flags
+  @return for @c FCNTL_GETFL the flags, for @c FCNTL_SETFL 0, or -1 on error.
+  Possible reasons for error:
+  - The file id is invalid.
+  - The command is not legal, or the flags contain unknown bits.
+ */
+int Fcntl(Fid_t fd, int cmd, int arg);
+
+
+/** @brief Move data from one stream to another.
+
+  Move up to @c n bytes from stream @c in to stream @c out, as if by a 
+  @c Read() from @c in followed by a @c Write() of the same data to @c out,
+  but without copying the data through user space. When @c in is a pipe
+  or a socket, the data is written to @c out directly from the kernel 
+  buffer. 
+
+  The call blocks as @c Read() would on @c in, and as @c Write() would on 
+  @c out.
+
+  @param in the file id to read from
+  @param out the file id to write to
+  @param n the maximum number of bytes to move
+  @return the number of bytes moved, 0 if @c in has reached end of data,
+  or -1 on error. Possible reasons for error are:
+  - Either @c in or @c out is not a valid file id.
+  - @c in and @c out refer to the same stream.
+  - @c in cannot be read or @c out cannot be written.
+  - There was a I/O runtime problem.
+ */
+int Splice(Fid_t in, Fid_t out, size_t n);
+
+
+/** @brief A buffer segment, for @c ReadV and @c WriteV. */
+typedef struct iovec_s {
+	void* base;			/**< The start of the segment */
+	size_t len;			/**< The length of the segment in bytes */
+} iovec_t;
+
+/** @brief The maximum number of segments passed to @c ReadV and @c WriteV. */
+#define MAX_IOV 1024
+
+/** @brief Read from a stream into several buffers.
+
+  This call behaves like a @c Read() into a single buffer made by
+  concatenating the @c iovcnt segments of @c iov, in order. 
+
+  @param fd the file id to read from
+  @param iov the array of segments
+  @param iovcnt the number of segments, at most @c MAX_IOV
+  @return the number of bytes read, 0 for "end of data", @c WOULDBLOCK
+  (see @c Fcntl), or -1 on error. Possible reasons for error are:
+  - The file id is invalid, or the stream cannot be read.
+  - @c iovcnt is larger than @c MAX_IOV, or the total length does not fit into an int.
+  - There was a I/O runtime problem.
+ */
+int ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+/** @brief Write several buffers to a stream.
+
+  This call behaves like a @c Write() of the concatenation of the @c iovcnt 
+  segments of @c iov, in order. On a pipe or a socket, if the total
+  length does not exceed the largest capacity the pipe may grow to, 
+  the data is written atomically: it is not interleaved with 
+  data of other writers. A non-blocking atomic write writes either
+  everything or nothing.
+
+  @param fd the file id to write to
+  @param iov the array of segments
+  @param iovcnt the number of segments, at most @c MAX_IOV
+  @return the number of bytes written, @c WOULDBLOCK (see @c Fcntl), 
+  or -1 on error. Possible reasons for error are:
+  - The file id is invalid, or the stream cannot be written.
+  - @c iovcnt is larger than @c MAX_IOV, or the total length does not fit into an int.
+  - There was a I/O runtime problem.
+ */
+int WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
 /*******************************************
  *
  * Pipes
@@ -517,9 +695,9 @@ typedef struct pipe_s {
 	@brief Construct and return a pipe.
 
 	A pipe is a one-directional buffer accessed via two file ids,
-	one for each end of the buffer. The size of the buffer is 
-	implementation-specific, but can be assumed to be between 4 and 16 
-	kbytes. 
+	one for each end of the buffer. The buffer initially holds
+	@c PIPE_BUFFER_SIZE bytes. When writers find it full repeatedly
+	(a sustained backlog), it grows, up to @c PIPE_GROWTH_LIMIT bytes.
 
 	Once a pipe is constructed, it remains operational as long as both
 	ends are open. If the read end is closed, the write end becomes 
@@ -530,13 +708,108 @@ typedef struct pipe_s {
 	@param pipe a pointer to a pipe_t structure for storing the file ids.
 	@returns 0 on success, or -1 on error. Possible reasons for error:
 		- the available file ids for the process are exhausted.
+	@see PipeEx
 */
 int Pipe(pipe_t* pipe);
 
+
+/**
+	@brief Construct a pipe with a given initial capacity.
+
+	This call is like @c Pipe, but the pipe buffer initially holds
+	@c capacity bytes. As with @c Pipe, the buffer may grow under a 
+	sustained backlog, up to the larger of @c capacity and @c PIPE_GROWTH_LIMIT.
+
+	@param pipe a pointer to a pipe_t structure for storing the file ids.
+	@param capacity the initial size of the pipe buffer, in bytes
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the capacity is 0 or larger than @c PIPE_MAX_BUFFER_SIZE.
+		- the available file ids for the process are exhausted.
+	@see SetPipeSize
+*/
+int PipeEx(pipe_t* pipe, size_t capacity);
+
+
+/**
+	@brief Set the capacity of a pipe.
+
+	Resize the buffer of the pipe to exactly @c capacity bytes. Data already 
+	in the buffer is preserved. After this call, the pipe will not grow 
+	automatically beyond @c capacity.
+
+	@param fid a file id for either end of a pipe
+	@param capacity the new size of the pipe buffer, in bytes
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the file id is not legal, or is not a pipe end.
+		- the capacity is 0 or larger than @c PIPE_MAX_BUFFER_SIZE.
+		- the capacity is smaller than the data currently in the pipe.
+		- a @c Splice() is currently moving data out of the pipe.
+*/
+int SetPipeSize(Fid_t fid, size_t capacity);
+
+
+/**
+	@brief Construct a single-producer/single-consumer pipe.
+
+	This call is like @c PipeEx(), but the pipe is optimized for the case
+	where exactly one thread writes to it and exactly one thread reads from it.
+	After the first call of a thread on an end, @c Read() and @c Write() by 
+	that thread do not enter the kernel as long as the buffer is neither 
+	empty (for the reader) nor full (for the writer); threads only block and 
+	wake up on these transitions.
+
+	The capacity is rounded up to a power of 2, and the buffer does not grow.
+
+	The caller must ensure that at most one thread uses each end at any time, 
+	and that an end is not closed while another thread is using it.
+	Sharing either end between threads (e.g., by passing it to a child process 
+	that also uses it) has undefined results.
+
+	@param pipe a pointer to a pipe_t structure for storing the file ids.
+	@param capacity the size of the pipe buffer, in bytes
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the capacity is 0 or larger than @c PIPE_MAX_BUFFER_SIZE.
+		- the available file ids for the process are exhausted.
+*/
+int PipeSPSC(pipe_t* pipe, size_t capacity);
+
+
+/**
+	@brief Construct a pipe that preserves message boundaries.
+
+	This call is like @c PipeEx(), but the pipe carries messages instead of
+	a byte stream. Each @c Write() (or @c WriteV()) sends its data as one 
+	message, atomically: it blocks until the whole message fits in the buffer, 
+	and fails if the message is larger than the buffer can ever become 
+	(the buffer also holds a small header for each message). 
+	Writing 0 bytes sends nothing.
+
+	Each @c Read() (or @c ReadV()) returns exactly one message. If the 
+	message is longer than the read buffer, the rest of it is discarded.
+	@c Splice() moves one message at a time.
+
+	@param pipe a pointer to a pipe_t structure for storing the file ids.
+	@param capacity the initial size of the pipe buffer, in bytes
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the capacity cannot hold a message, or is larger than @c PIPE_MAX_BUFFER_SIZE.
+		- the available file ids for the process are exhausted.
+	@see PipeEx
+*/
+int PipePacket(pipe_t* pipe, size_t capacity);
+
+
 typedef struct file_control_block FCB;
+struct file_operations;
 
+/** @brief The default initial capacity of a pipe buffer */
 #define PIPE_BUFFER_SIZE 1000
 
+/** @brief The size up to which a pipe buffer grows automatically */
+#define PIPE_GROWTH_LIMIT (64*1024)
+
+/** @brief The maximum capacity of a pipe buffer */
+#define PIPE_MAX_BUFFER_SIZE (1024*1024)
+
 typedef struct pipe_control_block{
   FCB *reader,*writer;
   CondVar has_space;  /*For blcoking writer if no space is available*/
@@ -546,18 +819,121 @@ typedef struct pipe_control_block{
 
   uint data_size; /* count the data that buffer has*/
 
-  char BUFFER[PIPE_BUFFER_SIZE];
+  uint capacity;      /* the size of BUFFER */
+  uint max_capacity;  /* the limit for automatic growth */
+  uint backlog;       /* times a writer found the buffer full since it was last empty */
+  int splicing;       /* set while Splice() is passing BUFFER to another stream */
+  uint low_watermark; /* the free space blocked writers wait for (see SOCKOPT_SNDLOWAT) */
+
+  /* A reader blocked on an empty pipe, whose buffer writers fill directly */
+  char* handoff_buf;
+  uint handoff_size, handoff_done;
+
+  /* Timeouts in msec of blocked readers and writers, 0 for none (see SOCKOPT_RCVTIMEO) */
+  timeout_t read_timeout, write_timeout;
+
+  char* BUFFER;
 } pipe_cb;
 
 
+pipe_cb* pipe_create(uint capacity, uint max_capacity);
+void pipe_destroy(pipe_cb* pipe);
+int pipe_set_capacity(pipe_cb* pipe, uint capacity);
 int pipe_read(void* pipecb_t, char *buf,unsigned int n);
 int pipe_write(void* pipecb_t, const char *buf, unsigned int n);
+int pipe_readv(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt);
+int pipe_writev(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt);
+int pipe_splice(void* pipecb_t, void* out, struct file_operations* outops, unsigned int n);
+int pipe_read_ready(void* pipecb_t);
+int pipe_write_ready(void* pipecb_t);
 int pipe_writer_close(void* pipecb_t);
 int pipe_reader_close(void* pipecb_t);
 int read_error(void* pipecb_t, char *buf,unsigned int n);
 int write_error(void* pipecb_t, const char *buf, unsigned int n);
-int is_empty(int data_size);
-int is_full(int data_size);
+int is_empty(pipe_cb* pipe);
+int is_full(pipe_cb* pipe);
+
+
+/*******************************************
+ *
+ * Semaphores
+ *
+ *******************************************/
+
+
+/**
+	@brief Construct a semaphore stream.
+
+	A semaphore stream is a counting semaphore accessed through a file id,
+	similar to a Linux @c eventfd. Since it is a stream, 
+	it is inherited by child processes and can be used to synchronize threads 
+	of different processes.
+
+	As for an @c eventfd, each call transfers a single @c unsigned @c int, 
+	so @c n must be @c sizeof(unsigned int):
+	- `Write(sem, &v, sizeof v)` performs the V operation @c v times, adding @c v
+	  units to the counter. It returns @c sizeof(v), or -1 if the counter 
+	  would overflow.
+	- `Read(sem, &v, sizeof v)` performs the P operation. It blocks while the counter
+	  is zero, and then removes as many units as are available, but at most @c v
+	  (or all of them, if @c v is 0). It stores the number of units removed in 
+	  @c v, and returns @c sizeof(v).
+	Both return -1 if @c n is not @c sizeof(unsigned int).
+
+	Thus, with `v = 1`, `Read(sem, &v, sizeof v)` and `Write(sem, &v, sizeof v)` 
+	are the classic P and V operations.
+
+	@param initial the initial value of the semaphore counter
+	@returns a file id on success, or NOFILE on error. Possible reasons for error:
+		- the available file ids for the process are exhausted.
+*/
+Fid_t Semaphore(unsigned int initial);
+
+
+/*******************************************
+ *
+ * Shared memory
+ *
+ *******************************************/
+
+/** @brief The maximum size of a shared memory region. */
+#define SHM_MAX_SIZE ((size_t)1 << 30)
+
+/**
+	@brief Create a shared memory region.
+
+	This call returns a stream holding a new region of @c size bytes, 
+	initially zero. The region is shared by all processes that hold a file 
+	id of the stream (e.g., children that inherit it through @c Exec), so 
+	they can exchange large buffers without copying them through pipes
+	or sockets. The region is freed when the last such file id is closed.
+
+	The stream is also a doorbell, to notify the processes sharing the 
+	region: @c Write(shm, &v, sizeof v) adds the unsigned int @c v to a counter, 
+	and @c Read(shm, &v, sizeof v) waits for the counter to become positive, 
+	and takes up to @c v units from it, exactly as for a @c Semaphore. The stream is readable (see @c Poll) 
+	when the counter is positive.
+
+	@param size the size of the region, from 1 to @c SHM_MAX_SIZE bytes
+	@returns a file id on success, or NOFILE on error. Possible reasons for error:
+		- the size is illegal, or there is not enough memory.
+		- the available file ids for the process are exhausted.
+	@see ShmMap
+*/
+Fid_t ShmCreate(size_t size);
+
+/**
+	@brief Return the address of a shared memory region.
+
+	The address is the same in all processes, and it is aligned to 64 bytes.
+	It remains valid while the process holds a file id of the region. 
+
+	@param fid a file id of the region
+	@returns the address of the region, or NULL if @c fid is not a shared
+		memory stream.
+	@see ShmCreate
+*/
+void* ShmMap(Fid_t fid);
 
 
 /*******************************************
@@ -571,7 +947,10 @@ typedef struct socket_control_block socket_cb;
 typedef enum {
   SOCKET_LISTENER,
   SOCKET_UNBOUND,
-  SOCKET_PEER
+  SOCKET_PEER,
+  SOCKET_DGRAM,
+  SOCKET_BRIDGE,
+  SOCKET_TOPIC
 }socket_type;
 
 /**
@@ -579,44 +958,84 @@ typedef enum {
 
 	A socket port is an integer between 1 and @c MAX_PORT.
 */
-typedef int16_t port_t;
+typedef int32_t port_t;
 
 /**
 	@brief the maximum legal port 
 */
-#define MAX_PORT 1023
+#define MAX_PORT 65535
 
 /**
 	@brief a null value for a port
 */
 #define NOPORT ((port_t)0)
 
+/**
+	@brief a value for @c Bind, asking for any free ephemeral port
+*/
+#define ANYPORT ((port_t)-1)
+
+/** @brief The default range of ephemeral ports (see @c SetEphemeralPorts) */
+#define EPHEMERAL_PORT_FIRST 49152
+#define EPHEMERAL_PORT_LAST MAX_PORT
+
 typedef struct listener_socket{
   rlnode queue;
   CondVar req_available;
+  uint backlog;         /* the number of requests in queue */
+  uint max_backlog;     /* the limit for backlog (see ListenEx) */
+  int closed;           /* set when the listener is closed, to release its accepters */
+  rlnode shard_node;    /* ring of the listeners sharing the port (see SOCKOPT_REUSEPORT) */
 }listener_s;
 
 typedef struct unbound_socket{
   rlnode unbound_socket;
 }unbound_s;
 
+typedef struct datagram_socket{
+  rlnode queue;         /* received messages */
+  uint count;           /* the number of messages in queue */
+  uint dropped;         /* the number of messages dropped because queue was full */
+  CondVar has_msg;
+}dgram_s;
+
 typedef struct peer_socket{
   socket_cb* peer;
   pipe_cb* write_pipe;
   pipe_cb* read_pipe;
 }peer_s;
 
+typedef struct topic_socket{
+  struct topic_control_block* topic;
+  int subscriber;       /* set for subscribers, clear for publishers */
+  uint64_t cursor;      /* the sequence number of the next message to read */
+  uint dropped;         /* the number of messages overwritten before they were read */
+  rlnode member_node;   /* in the members of the topic */
+}topic_s;
+
+typedef struct bridge_socket{
+  int conn;             /* the bridge connection (see bios_bridge_accept) */
+  int shut;             /* the directions shut down (a shutdown_mode mask) */
+}bridge_s;
+
 typedef struct socket_control_block{
   uint refcount;
   Fid_t fid;
   FCB* fcb;
   socket_type type;
   port_t port;
+  int reuseport;       /* SOCKOPT_REUSEPORT */
+  uint sndbuf, rcvbuf; /* SOCKOPT_SNDBUF, SOCKOPT_RCVBUF (0 for the default) */
+  uint sndlowat;       /* SOCKOPT_SNDLOWAT */
+  timeout_t rcvtimeo, sndtimeo; /* SOCKOPT_RCVTIMEO, SOCKOPT_SNDTIMEO */
 
   union{
     listener_s listener;
     unbound_s unbound;
     peer_s peer;
+    dgram_s dgram;
+    bridge_s bridge;
+    topic_s topic;
   };
 
 }socket_cb;
@@ -624,10 +1043,15 @@ typedef struct socket_control_block{
 typedef struct connection_request{
   int admitted;
   socket_cb* peer_s;
+  socket_cb* listener;  /* the listener whose queue holds the request */
   CondVar connected_cv;
   rlnode queue_node;
 }request;
 
+int socket_connect_start(FCB* fcb, port_t port, request* req);
+int socket_connect_settled(request* req);
+int socket_connect_finish(request* req);
+
 
 /**
 	@brief Return a new socket bound on a port.
@@ -645,6 +1069,44 @@ typedef struct connection_request{
 */
 Fid_t Socket(port_t port);
 
+/**
+	@brief Bind a socket to a port of its own.
+
+	The socket must not be bound yet (it was created with @c NOPORT), and 
+	it must be an unconnected stream socket or a datagram socket.
+	A port bound by this call is held exclusively by the socket until it 
+	is closed: other sockets may not @c Listen() on it, or be bound to it.
+	The socket itself may then @c Listen() on it, or @c Connect() from it.
+
+	If @c port is @c ANYPORT, the lowest free port of the ephemeral range
+	is chosen. A port is free if it is not held by any socket, either
+	through @c Bind(), or as a listening or datagram port.
+
+	@param sock the socket to bind
+	@param port the port to bind to, or @c ANYPORT
+	@returns the port bound on success, or -1 on error. Possible reasons 
+		for error:
+		- the file id @c sock is not a socket, or it is already bound
+		  or initialized.
+		- the port is illegal, or it is not free.
+		- for @c ANYPORT, the ephemeral ports are exhausted.
+	@see SetEphemeralPorts
+*/
+int Bind(Fid_t sock, port_t port);
+
+/**
+	@brief Set the range of ports from which @c Bind(sock, ANYPORT) chooses.
+
+	The range is shared by all processes. It is initially
+	@c EPHEMERAL_PORT_FIRST to @c EPHEMERAL_PORT_LAST. Ports outside the 
+	range which are already bound are not affected.
+
+	@param first the lowest ephemeral port
+	@param last the highest ephemeral port
+	@returns 0 on success, or -1 if the range is empty or illegal.
+*/
+int SetEphemeralPorts(port_t first, port_t last);
+
 /**
 	@brief Initialize a socket as a listening socket.
 
@@ -657,17 +1119,39 @@ Fid_t Socket(port_t port);
 	On each port there must be a unique listening socket (although any number
 	of non-listening sockets are allowed).
 
+	At most @c MAX_BACKLOG connection requests may be pending on the socket.
+
 	@param sock the socket to initialize as a listening socket
 	@returns 0 on success, -1 on error. Possible reasons for error:
 		- the file id is not legal
 		- the socket is not bound to a port
-		- the port bound to the socket is occupied by another listener
+		- the port bound to the socket is occupied by another listener,
+		  or held by another socket through @c Bind
 		- the socket has already been initialized
 	@see Socket
+	@see ListenEx
  */
 int Listen(Fid_t sock);
 
 
+/** @brief The largest number of pending connection requests of a listener. */
+#define MAX_BACKLOG 1024
+
+/**
+	@brief Initialize a socket as a listening socket with a bounded backlog.
+
+	This call is like @c Listen(), but at most @c backlog connection requests
+	may be pending (not yet accepted) on the socket. When the backlog is 
+	full, @c Connect() to the port fails at once, instead of waiting.
+
+	@param sock the socket to initialize as a listening socket
+	@param backlog the maximum number of pending requests, from 1 to @c MAX_BACKLOG
+	@returns 0 on success, -1 on error. Possible reasons for error are those 
+		of @c Listen(), and a backlog out of range.
+ */
+int ListenEx(Fid_t sock, unsigned int backlog);
+
+
 /**
 	@brief Wait for a connection.
 
@@ -687,6 +1171,15 @@ int Listen(Fid_t sock);
 		- the file id is not initialized by @c Listen()
 		- the available file ids for the process are exhausted
 		- while waiting, the listening socket @c lsock was closed
+		If the listening socket is non-blocking and there is no pending
+		connection, @c WOULDBLOCK is returned. If its @c SOCKOPT_RCVTIMEO
+		expires first, @c TIMEDOUT is returned.
+
+	If the port of the listening socket has a socket bridge (see @c boot_vm),
+	host clients connecting to the bridge are accepted as well. Their sockets
+	support @c Read(), @c Write(), @c ShutDown() and @c Close(), and inherit 
+	the timeouts of the listener. Note that @c Poll() does not report 
+	host clients pending on a listener.
 
 	@see Connect
 	@see Listen
@@ -694,6 +1187,25 @@ int Listen(Fid_t sock);
 Fid_t Accept(Fid_t lsock);
 
 
+/**
+	@brief Accept several connections at once.
+
+	This call blocks like @c Accept() until there is a pending connection
+	request, and then accepts as many of the pending requests as possible,
+	up to @c max, storing the file ids of the new sockets in @c fids.
+
+	@param lsock the listening socket
+	@param fids an array of at least @c max file ids
+	@param max the maximum number of connections to accept
+	@returns the number of connections accepted (at least 1), or -1 for the
+		reasons that @c Accept() returns @c NOFILE, or if @c max is 0. If the 
+		listening socket is non-blocking and there is no pending connection, 
+		@c WOULDBLOCK is returned, and @c TIMEDOUT as for @c Accept().
+	@see Accept
+ */
+int AcceptMany(Fid_t lsock, Fid_t* fids, unsigned int max);
+
+
 
 /**
 	@brief Create a connection to a listener at a specific port.
@@ -719,6 +1231,7 @@ Fid_t Accept(Fid_t lsock);
 	   - the given port is illegal.
 	   - the port does not have a listening socket bound to it by @c Listen.
 	   - the timeout has expired without a successful connection.
+	   - the listeners of the port have no room for more pending requests.
 */
 int Connect(Fid_t sock, port_t port, timeout_t timeout);
 
@@ -768,6 +1281,393 @@ typedef enum {
 int ShutDown(Fid_t sock, shutdown_mode how);
 
 
+/** @brief Options for @c SetSockOpt. */
+enum socket_option {
+  /** 
+    If set (to a non-zero value) on several sockets bound to the same port,
+    they may all @c Listen() on it. Each such listener has its own queue 
+    of connection requests, and @c Connect() gives each new request to 
+    the listener with the fewest pending requests (taking turns among equals).
+    When one of them is closed, its pending requests move to the others.
+
+    It must be set before @c Listen(), on every listener of the port.
+   */
+  SOCKOPT_REUSEPORT,
+
+  /**
+    The size in bytes of the send (receive) window of the socket: the buffer
+    holding the data written to (by) the peer and not yet read. By default, 
+    a window starts at @c PIPE_BUFFER_SIZE bytes and grows under a sustained 
+    backlog; once set, it is fixed. Each direction of a connection gets the 
+    larger of the sender's send window and the receiver's receive window.
+
+    It may be set before the socket is connected (and on a listener, whose 
+    accepted sockets inherit it), or on a connected socket, as long as the 
+    data buffered in the window fits. The value is from 1 to 
+    @c PIPE_MAX_BUFFER_SIZE.
+   */
+  SOCKOPT_SNDBUF,
+  SOCKOPT_RCVBUF,
+
+  /**
+    The free space, in bytes, that must open up in the send window before a
+    writer blocked on a full window is woken up (or @c Poll() reports the
+    socket writable). A larger value lets the writer sleep until it can
+    send a large batch at once. The default, 0, wakes it on any free space.
+    It is set and inherited as @c SOCKOPT_SNDBUF.
+   */
+  SOCKOPT_SNDLOWAT,
+
+  /**
+    A timeout in msec for blocking receives (send) on the socket: 
+    @c Read(), @c ReadV(), @c Splice(), @c Accept(), @c AcceptMany() and 
+    @c RecvFrom() (@c Write() and @c WriteV()). An operation which 
+    blocks for longer returns @c TIMEDOUT, or, for a send, the number 
+    of bytes written so far, if any. The default, 0, means no timeout.
+    It is set and inherited as @c SOCKOPT_SNDBUF, and it may also be 
+    set on datagram and topic sockets.
+   */
+  SOCKOPT_RCVTIMEO,
+  SOCKOPT_SNDTIMEO
+};
+
+/**
+  @brief Set an option of a socket.
+
+  @param sock the file ID of the socket
+  @param option the option to set
+  @param value the new value of the option
+  @returns 0 on success and -1 on error. Possible reasons for error:
+    - the file id @c sock is not a socket.
+    - the option is not legal, or cannot be changed on this socket.
+  @see socket_option
+*/
+int SetSockOpt(Fid_t sock, int option, int value);
+
+
+/** @brief The largest message that can be sent with @c SendTo. */
+#define MAX_DGRAM_SIZE 4096
+
+/** @brief The number of messages a datagram socket holds until they are received. */
+#define DGRAM_QUEUE_LENGTH 64
+
+/**
+	@brief Return a new datagram socket.
+
+	A datagram socket exchanges messages (datagrams) with other datagram 
+	sockets, without a connection. Each message is sent by @c SendTo to 
+	a port, and received whole by @c RecvFrom (or @c Read) at the datagram
+	socket bound to that port. 
+
+	Sending never blocks: a socket queues up to @c DGRAM_QUEUE_LENGTH
+	received messages, and messages that arrive while its queue is full are
+	dropped.
+
+	If @c port is not @c NOPORT, the socket is bound to it, and the port
+	cannot be used by another datagram socket or by a listener until the
+	socket is closed. A socket bound to @c NOPORT can only send.
+
+	@param port the port the new socket will be bound to, or @c NOPORT
+	@returns a file id for the new socket, or NOFILE on error. Possible
+		reasons for error:
+		- the port is illegal, or already in use
+		- the available file ids for the process are exhausted
+*/
+Fid_t SocketDgram(port_t port);
+
+/**
+	@brief Send a message to a port.
+
+	@param sock a datagram socket
+	@param port the port of the datagram socket to send to
+	@param buf the message
+	@param n the length of the message, at most @c MAX_DGRAM_SIZE
+	@returns @c n on success (even if the message is dropped because the 
+		receiver's queue is full), or -1 on error. Possible reasons for error:
+		- @c sock is not a datagram socket
+		- there is no datagram socket bound to @c port
+		- @c n is larger than @c MAX_DGRAM_SIZE
+*/
+int SendTo(Fid_t sock, port_t port, const char* buf, unsigned int n);
+
+/**
+	@brief Receive a message.
+
+	Block until a message is available, and copy it into @c buf. 
+	If the message is longer than @c n bytes, the rest of it is discarded.
+
+	@param sock a datagram socket bound to a port
+	@param port if not NULL, the port of the sender is stored here 
+		(@c NOPORT if the sender is not bound)
+	@param buf the buffer to store the message
+	@param n the size of @c buf
+	@returns the number of bytes stored, @c WOULDBLOCK (see @c Fcntl),
+		@c TIMEDOUT (see @c SOCKOPT_RCVTIMEO), or -1 on error. Possible 
+		reasons for error:
+		- @c sock is not a datagram socket bound to a port
+*/
+int RecvFrom(Fid_t sock, port_t* port, char* buf, unsigned int n);
+
+
+/** @brief The roles of a topic socket (see @c SocketTopic). */
+typedef enum {
+  TOPIC_PUBLISH,      /**< The socket publishes messages */
+  TOPIC_SUBSCRIBE     /**< The socket receives every message published */
+} topic_role;
+
+/** @brief The number of messages a topic retains: the most a subscriber may lag. */
+#define TOPIC_RING_LENGTH 64
+
+/**
+	@brief Return a new publish/subscribe (topic) socket.
+
+	All topic sockets on a port form a topic. Each message written by a 
+	publisher (with @c Write, up to @c MAX_DGRAM_SIZE bytes) is copied once
+	into the ring of the topic, and it is then received whole by @c Read 
+	at every subscriber, in order. A subscriber receives the messages 
+	published after it was created.
+
+	Publishing never blocks: the ring holds the last @c TOPIC_RING_LENGTH
+	messages, and a subscriber which lags further behind loses the oldest
+	messages it has not read.
+
+	The port is held by the topic until all its sockets are closed; it
+	cannot be used by a listener, a datagram socket, or @c Bind meanwhile.
+
+	@param port the port of the topic
+	@param role whether the socket publishes or subscribes
+	@returns a file id for the new socket, or NOFILE on error. Possible
+		reasons for error:
+		- the port is illegal, or in use but not by a topic
+		- the role is illegal
+		- the available file ids for the process are exhausted
+*/
+Fid_t SocketTopic(port_t port, topic_role role);
+
+
+
+/*******************************************
+ *
+ * Readiness multiplexing
+ *
+ *******************************************/
+
+/** @brief Readiness events for @c Poll and @c EpollWait. */
+#define STREAM_READABLE 1   /**< @brief A @c Read (or @c Accept) would not block */
+#define STREAM_WRITABLE 2   /**< @brief A @c Write would not block */
+#define STREAM_HANGUP   4   /**< @brief The other end has closed (always reported) */
+#define STREAM_ERROR    8   /**< @brief Operations will fail (always reported) */
+
+/**
+	@brief A file id and the events of interest.
+
+	This is passed to @c Poll, and is returned by @c EpollWait.
+*/
+typedef struct poll_fd {
+	Fid_t fd;			/**< @brief The file id. If negative, the entry is ignored. */
+	int events;			/**< @brief The events of interest */
+	int revents;		/**< @brief The events that occurred (returned) */
+} poll_fd;
+
+
+/**
+	@brief Wait until some of a set of streams is ready.
+
+	For each of the @c n entries of @c fds, set @c revents to the events
+	from @c events (plus @c STREAM_HANGUP and @c STREAM_ERROR) that currently
+	hold for the stream. If none holds, block until one does, or until 
+	@c timeout milliseconds have passed. A timeout of 0 does not block, and
+	a timeout of @c TIMEOUT_INFINITE blocks without limit.
+
+	Each call examines all @c n streams. To wait on many streams repeatedly,
+	use @c EpollCreate instead.
+
+	@param fds an array of @c n entries
+	@param n the number of entries
+	@param timeout the timeout, in milliseconds
+	@returns the number of entries with non-zero @c revents (0 on timeout), 
+	  or -1 on error. Possible reasons for error:
+	  - some non-negative file id is not valid.
+*/
+int Poll(poll_fd* fds, unsigned int n, timeout_t timeout);
+
+
+/** @brief Commands for @c EpollCtl. */
+enum epoll_op {
+	EPOLL_ADD,		/**< @brief Add a file id to the interest set */
+	EPOLL_MOD,		/**< @brief Change the events of interest for a file id */
+	EPOLL_DEL		/**< @brief Remove a file id from the interest set */
+};
+
+
+/**
+	@brief Create an interest set.
+
+	An interest set is a stream that holds a set of streams and events of 
+	interest, managed by @c EpollCtl. Streams are woken up into a ready list 
+	when their state changes, so @c EpollWait costs time proportional to the 
+	number of ready streams, not the size of the set.
+
+	A stream is removed from all interest sets when it is closed.
+
+	@returns a file id for the interest set, or NOFILE on error. Possible
+	  reasons for error:
+	  - the available file ids for the process are exhausted.
+*/
+Fid_t EpollCreate();
+
+
+/**
+	@brief Change an interest set.
+
+	@param epfd the interest set
+	@param op @c EPOLL_ADD, @c EPOLL_MOD or @c EPOLL_DEL
+	@param fd the file id to add, modify or remove. @c EpollWait will report
+	  this file id.
+	@param events the events of interest
+	@returns 0 on success, -1 on error. Possible reasons for error:
+	  - either file id is invalid, or @c epfd is not an interest set.
+	  - @c fd is already in the set (for @c EPOLL_ADD), or it is not in the set
+	    (for @c EPOLL_MOD and @c EPOLL_DEL).
+*/
+int EpollCtl(Fid_t epfd, int op, Fid_t fd, int events);
+
+
+/**
+	@brief Wait for streams of an interest set to become ready.
+
+	Store up to @c maxevents ready streams into @c events (setting @c fd, 
+	@c events and @c revents), blocking for up to @c timeout milliseconds 
+	if none is ready. Readiness is level-triggered: a stream that remains 
+	ready is reported again by the next call.
+
+	@param epfd the interest set
+	@param events an array of at least @c maxevents entries
+	@param maxevents the maximum number of entries to return
+	@param timeout the timeout, as in @c Poll
+	@returns the number of entries stored (0 on timeout), or -1 on error. 
+	  Possible reasons for error:
+	  - @c epfd is not an interest set.
+*/
+int EpollWait(Fid_t epfd, poll_fd* events, unsigned int maxevents, timeout_t timeout);
+
+
+
+/*******************************************
+ *
+ * Asynchronous I/O rings
+ *
+ *******************************************/
+
+/** @brief The operations of a ring submission. */
+typedef enum ring_opcode {
+	RING_READ,		/**< @brief @c Read(fd, buf, len) */
+	RING_WRITE,		/**< @brief @c Write(fd, buf, len) */
+	RING_ACCEPT,	/**< @brief @c Accept(fd) */
+	RING_CONNECT,	/**< @brief @c Connect(fd, port, timeout) */
+	RING_POLL		/**< @brief Wait until @c fd is ready for @c events, as @c Poll */
+} ring_opcode;
+
+/** @brief A submission queue entry. */
+typedef struct ring_sqe {
+	int opcode;				/**< @brief A @c ring_opcode */
+	Fid_t fd;				/**< @brief The file id */
+	void* buf;				/**< @brief The buffer of a read or write */
+	unsigned int len;		/**< @brief The size of a read or write */
+	int events;				/**< @brief The events of a poll */
+	port_t port;			/**< @brief The port of a connect */
+	timeout_t timeout;		/**< @brief The timeout of a connect, as for @c Connect */
+	uintptr_t user_data;	/**< @brief Returned with the completion */
+} ring_sqe;
+
+/** @brief A completion queue entry. */
+typedef struct ring_cqe {
+	uintptr_t user_data;	/**< @brief The @c user_data of the submission */
+	int res;				/**< @brief The result of the operation */
+} ring_cqe;
+
+/**
+	@brief The queues of a ring.
+
+	The process adds submissions at @c sq[sq_tail & sq_mask], and then 
+	advances @c sq_tail; the kernel consumes them advancing @c sq_head. 
+	The kernel adds completions at @c cq[cq_tail & cq_mask], advancing 
+	@c cq_tail; the process consumes them advancing @c cq_head. 
+	The indices only grow, wrapping around at overflow.
+*/
+typedef struct io_ring {
+	ring_sqe* sq;				/**< @brief The submission queue */
+	unsigned int sq_mask;		/**< @brief Its size minus 1 */
+	unsigned int sq_head;		/**< @brief Advanced by the kernel */
+	unsigned int sq_tail;		/**< @brief Advanced by the process */
+
+	ring_cqe* cq;				/**< @brief The completion queue */
+	unsigned int cq_mask;		/**< @brief Its size minus 1 */
+	unsigned int cq_head;		/**< @brief Advanced by the process */
+	unsigned int cq_tail;		/**< @brief Advanced by the kernel */
+} io_ring;
+
+
+/** @brief The maximum size of a submission queue. */
+#define MAX_RING_ENTRIES 4096
+
+/**
+	@brief Create a ring for asynchronous I/O.
+
+	A ring lets a thread keep many I/O operations in flight, and submit 
+	and reap them in batches, one @c RingEnter call for many of them. 
+	The queues of the ring are shared with the kernel, and they are 
+	stored into @c *ring. The submission queue has @c entries entries 
+	(rounded up to a power of 2), and the completion queue twice as many.
+
+	The queues are freed when the ring is closed, and operations still in
+	flight are cancelled. The ring is readable (see @c Poll) when its 
+	completion queue is not empty.
+
+	@param entries the size of the submission queue, from 1 to @c MAX_RING_ENTRIES
+	@param ring the location to store the queues
+	@returns a file id for the ring, or NOFILE on error. Possible reasons 
+	  for error:
+	  - the size is illegal, or @c ring is NULL.
+	  - the available file ids for the process are exhausted.
+*/
+Fid_t RingCreate(unsigned int entries, io_ring** ring);
+
+/**
+	@brief Submit operations to a ring, and wait for completions.
+
+	This call takes up to @c to_submit entries from the submission queue, 
+	and starts them. Then it waits until there are at least @c min_complete 
+	entries in the completion queue, for up to @c timeout milliseconds
+	(as for @c Poll), or until no operation is in flight.
+
+	An operation is like the corresponding system call on a non-blocking
+	stream: it completes when the call would not return @c WOULDBLOCK, 
+	and its result (e.g., the bytes read, the new socket of an accept, 
+	-1 on error, or the revents of a poll) is placed in the completion queue. 
+	Stream timeouts (see @c SetSockOpt) do not apply, and @c RING_ACCEPT
+	is not woken up by clients of socket bridges.
+
+	Operations make progress, and completions are added, only while some 
+	thread is in @c RingEnter for the ring (possibly with @c to_submit and
+	@c min_complete equal to 0). The buffers of operations in flight must
+	remain valid until they complete.
+
+	Entries are only taken while there is room for their completions, that
+	is, while the operations in flight, plus the entries in the completion 
+	queue, are fewer than its size.
+
+	@param ring the ring
+	@param to_submit the maximum number of entries to submit
+	@param min_complete the number of completions to wait for
+	@param timeout the timeout, as for @c Poll
+	@returns the number of entries submitted, or -1 on error. Possible 
+	  reasons for error:
+	  - @c ring is not a ring, or another thread is in @c RingEnter for it.
+*/
+int RingEnter(Fid_t ring, unsigned int to_submit, unsigned int min_complete, timeout_t timeout);
+
+
 
 /*******************************************
  *
@@ -862,6 +1762,16 @@ Fid_t OpenInfo();
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
 
+/** @brief Boot tinyos3 on a configured VM.
+
+   This is like @c boot(), but the simulated computer is given by @c vmc, 
+   whose @c bootfunc is ignored. This way, the computer may have socket
+   bridges (see @c vm_config_bridge), so that host clients can connect to 
+   TinyOS listeners.
+   */
+void boot_vm(vm_config* vmc, Task boot_task, int argl, void* args);
+
+
 /** @} */
 
 #endif
@@ -720,21 +720,6 @@ finish:
    the client program
 ************************/
 
-/* helper for RemoteClient */
-static void send_message(Fid_t sock, void* buf, size_t len)
-{
-	size_t count = 0;
-	while(count<len) {
-		int rc = Write(sock, buf+count, len-count);
-		if(rc<1) break;  /* Error or End of stream */
-		count += rc;
-	}
-	if(count!=len) {
-		printf("In client: I/O error writing %zu bytes (%zu written)\n", len, count);
-		Exit(1);
-	}
-}
-
 /* the remote client program */
 int RemoteClient(size_t argc, const char** argv)
 {
@@ -754,9 +739,15 @@ int RemoteClient(size_t argc, const char** argv)
 	char args[argl];
 	argvpack(args, argc-1, argv+1);
 
-	/* Send message */
-	send_message(sock, &argl, sizeof(argl));
-	send_message(sock, args, argl);
+	/* Send the length and the message in one call */
+	iovec_t msg[2] = {
+		{ .base = &argl, .len = sizeof(argl) },
+		{ .base = args, .len = argl }
+	};
+	if(WriteV(sock, msg, 2) != (int)(sizeof(argl)+argl)) {
+		printf("In client: I/O error writing %zu bytes\n", sizeof(argl)+argl);
+		Exit(1);
+	}
 	ShutDown(sock, SHUTDOWN_WRITE);
 
 	/* Read the server data and display */
@@ -995,10 +986,13 @@ int boot_shell(int argl, void* args)
 
 void usage(const char* pname)
 {
-  printf("usage:\n  %s <ncores> <nterm> <philosophers> <bites>\n\n  \
+  printf("usage:\n  %s <ncores> <nterm> [<port>:<path> ...]\n\n  \
     where:\n\
     <ncores> is the number of cpu cores to use,\n\
-    <nterm> is the number of terminals to use,\n",
+    <nterm> is the number of terminals to use,\n\
+    <port>:<path> bridges a port to a host Unix-domain socket path\n\
+      (e.g., 20:/tmp/rserver, and then run 'rserver' and connect to\n\
+      it from the host with 'socat - UNIX-CONNECT:/tmp/rserver').\n",
 	 pname);
   exit(1);
 }
@@ -1008,13 +1002,23 @@ int main(int argc, const char** argv)
 {
   unsigned int ncores, nterm;
 
-  if(argc!=3) usage(argv[0]); 
+  if(argc<3) usage(argv[0]); 
   ncores = atoi(argv[1]);
   nterm = atoi(argv[2]);
 
+  vm_config vmc;
+  vm_configure(&vmc, NULL, ncores, nterm);
+
+  for(int i=3; i<argc; i++) {
+    char* path = strchr(argv[i], ':');
+    if(path==NULL || vm_config_bridge(&vmc, atoi(argv[i]), path+1)!=0)
+      usage(argv[0]);
+    printf("*** Bridging port %d to %s\n", atoi(argv[i]), path+1);
+  }
+
   /* boot TinyOS */
   printf("*** Booting TinyOS with %d cores and %d terminals\n", ncores, nterm);
-  boot(ncores, nterm, boot_shell, 0, NULL);
+  boot_vm(&vmc, boot_shell, 0, NULL);
   printf("*** TinyOS halted. Bye!\n");
 
   return 0;
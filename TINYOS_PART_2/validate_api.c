@@ -4,7 +4,12 @@
 #include <sys/time.h>
 #include <time.h>
 #include <math.h>
+#include <limits.h>
 #include <setjmp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "util.h"
 #include "symposium.h"
@@ -628,6 +633,84 @@ BOOT_TEST(test_read_kbd,
 }
 
 
+BOOT_TEST(test_read_kbd_nonblocking,
+	"Test that a non-blocking read from the keyboard returns WOULDBLOCK until data arrives.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+	ASSERT(Fcntl(fterm, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+
+	char buffer[5];
+	ASSERT(Read(fterm, buffer, sizeof(buffer))==WOULDBLOCK);
+
+	sendme(0, "Hello");
+	unsigned int count = 0;
+	while(count < sizeof(buffer)) {
+		int rc = Read(fterm, buffer+count, sizeof(buffer)-count);
+		ASSERT(rc>0 || rc==WOULDBLOCK);
+		if(rc>0) count += rc;
+	}
+	ASSERT(memcmp(buffer, "Hello", 5)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_poll_kbd,
+	"Test that Poll notices keyboard input, which is re-checked periodically.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	poll_fd pfd = { .fd = fterm, .events = STREAM_READABLE };
+	ASSERT(Poll(&pfd, 1, 0)==0);
+
+	sendme(0, "Hello");
+	ASSERT(Poll(&pfd, 1, TIMEOUT_INFINITE)==1);
+	ASSERT(pfd.revents==STREAM_READABLE);
+
+	/* The byte examined by Poll is not lost */
+	char buffer[5];
+	unsigned int count = 0;
+	while(count < sizeof(buffer)) {
+		int rc = Read(fterm, buffer+count, sizeof(buffer)-count);
+		ASSERT(rc>0);
+		count += rc;
+	}
+	ASSERT(memcmp(buffer, "Hello", 5)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_poll_kbd_shared,
+	"Test that keyboard input examined by Poll through one file id can be read through another.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fpoll = OpenTerminal(0);
+	Fid_t fread = OpenTerminal(0);
+	ASSERT(fpoll!=NOFILE && fread!=NOFILE);
+
+	poll_fd pfd = { .fd = fpoll, .events = STREAM_READABLE };
+	sendme(0, "Hello");
+	ASSERT(Poll(&pfd, 1, TIMEOUT_INFINITE)==1);
+	ASSERT(Close(fpoll)==0);
+
+	char buffer[5];
+	unsigned int count = 0;
+	while(count < sizeof(buffer)) {
+		int rc = Read(fread, buffer+count, sizeof(buffer)-count);
+		ASSERT(rc>0);
+		count += rc;
+	}
+	ASSERT(memcmp(buffer, "Hello", 5)==0);
+	return 0;
+}
+
+
 BOOT_TEST(test_read_kbd_big,
 	"Test that we can read massively from the keyboard on terminal 0.",
 	.minimum_terminals = 1, .timeout = 20
@@ -759,6 +842,225 @@ BOOT_TEST(test_child_inherits_files,
 
 
 
+/* Checks the files inherited from test_file_limit: n sockets, fid 77 free */
+static int file_limit_child(int argl, void* args)
+{
+	unsigned int n = *(unsigned int*)args;
+	ASSERT(Fcntl(n-1, FCNTL_GETFL, 0)==0);
+	ASSERT(OpenNull()==77);
+	ASSERT(Close(n)==0);
+	ASSERT(OpenNull()==n);
+	ASSERT(OpenNull()==NOFILE);
+	return 0;
+}
+
+BOOT_TEST(test_file_limit,
+	"Test raising the limit of open files: many fids, lowest-free allocation,\n"
+	"and inheritance by child processes."
+	)
+{
+	unsigned int N = 10000;
+
+	/* The default limit */
+	Fid_t f = OpenNull();
+	ASSERT(f!=NOFILE);
+	ASSERT(Dup2(f, MAX_FILEID)==-1);
+	ASSERT(SetFileLimit(0)==-1);
+	ASSERT(SetFileLimit(MAX_FILEID_LIMIT+1)==-1);
+
+	ASSERT(SetFileLimit(N+1)==0);
+	ASSERT(Dup2(f, N)==0);
+	ASSERT(Close(f)==0);
+
+	/* Fids are allocated lowest first, past the old limit */
+	for(Fid_t i=0; i<N; i++) {
+		Fid_t s = Socket(NOPORT);
+		ASSERT(s==i);
+		if(s!=i) break;
+	}
+	ASSERT(OpenNull()==NOFILE);
+
+	/* A closed fid is the next one allocated */
+	ASSERT(Close(N/2)==0);
+	ASSERT(Close(77)==0);
+	ASSERT(OpenNull()==77);
+	ASSERT(OpenNull()==N/2);
+	ASSERT(Close(77)==0);
+
+	/* The limit cannot drop below an open fid */
+	ASSERT(SetFileLimit(N)==-1);
+
+	/* A child inherits the files and the limit */
+	Pid_t pid = Exec(file_limit_child, sizeof(N), &N);
+	ASSERT(pid!=NOPROC);
+	ASSERT(WaitChild(pid, NULL)==pid);
+
+	for(Fid_t i=0; i<=N; i++)
+		if(i!=77) ASSERT(Close(i)==0);
+	ASSERT(SetFileLimit(MAX_FILEID)==0);
+	ASSERT(OpenNull()==0);
+	return 0;
+}
+
+
+/* Writes and reads a pipe, until fid_race_stop is set */
+static volatile int fid_race_stop;
+
+static int fid_race_io(int argl, void* args)
+{
+	pipe_t* pipe = args;
+	char buf[4];
+	int n = 0;
+	while(! fid_race_stop) {
+		if(Write(pipe->write, "abc", 3)!=3) return -1;
+		if(Read(pipe->read, buf, sizeof(buf))!=3 || memcmp(buf, "abc", 3)!=0) return -1;
+		n++;
+	}
+	return n;
+}
+
+/* Starts a thread on a new pipe, and one on a new single-producer/single-consumer pipe */
+static void fid_race_start(pipe_t* pipes, Tid_t* tids)
+{
+	fid_race_stop = 0;
+	ASSERT(PipeEx(&pipes[0], 64)==0);
+	ASSERT(PipeSPSC(&pipes[1], 64)==0);
+	for(int i=0; i<2; i++) {
+		tids[i] = CreateThread(fid_race_io, 0, &pipes[i]);
+		ASSERT(tids[i]!=NOTHREAD);
+	}
+}
+
+static void fid_race_finish(pipe_t* pipes, Tid_t* tids)
+{
+	fid_race_stop = 1;
+	for(int i=0; i<2; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(tids[i], &exitval)==0);
+		ASSERT(exitval>=0);
+		ASSERT(Close(pipes[i].read)==0);
+		ASSERT(Close(pipes[i].write)==0);
+	}
+}
+
+/* Grows its own copy of the file id table, while its threads do I/O */
+static int fid_grow_child(int argl, void* args)
+{
+	pipe_t pipes[2];
+	Tid_t tids[2];
+	fid_race_start(pipes, tids);
+	ASSERT(SetFileLimit(4096)==0);
+	for(int i=0; i<4000; i++)
+		ASSERT(OpenNull()!=NOFILE);
+	fid_race_finish(pipes, tids);
+	return 0;
+}
+
+BOOT_TEST(test_fid_table_grows_under_io,
+	"Test that the file id table can grow while other threads of the process do I/O."
+	)
+{
+	for(int i=0; i<200; i++) {
+		Pid_t pid = Exec(fid_grow_child, 0, NULL);
+		ASSERT(pid!=NOPROC);
+		ASSERT(WaitChild(pid, NULL)==pid);
+	}
+	return 0;
+}
+
+
+/* Writes to the pipe it inherits, then changes its own copy of the table */
+static int shared_fids_child(int argl, void* args)
+{
+	pipe_t p = *(pipe_t*)args;
+	ASSERT(Write(p.write, "child", 5)==5);
+	ASSERT(Close(p.read)==0);
+	ASSERT(Close(p.write)==0);
+	ASSERT(OpenNull()==p.read);
+	return 0;
+}
+
+/* Checks that only the selected fids are inherited */
+static int selected_fids_child(int argl, void* args)
+{
+	pipe_t p = *(pipe_t*)args;
+	ASSERT(Fcntl(p.read, FCNTL_GETFL, 0)==-1);
+	ASSERT(Write(p.write, "sel", 3)==3);
+	ASSERT(OpenNull()==0);
+	return 0;
+}
+
+BOOT_TEST(test_exec_shares_fids,
+	"Test that the file ids inherited by Exec are shared until changed,\n"
+	"and that ExecEx can pass just some of them."
+	)
+{
+	pipe_t p;
+	char buf[8];
+	ASSERT(Pipe(&p)==0);
+
+	/* The child changes its table: ours is not affected */
+	Pid_t pid = Exec(shared_fids_child, sizeof(p), &p);
+	ASSERT(pid!=NOPROC);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	ASSERT(Read(p.read, buf, 8)==5);
+	ASSERT(memcmp(buf, "child", 5)==0);
+
+	/* We change our table while the child holds the old one: 
+	   the pipe stays open until the child exits */
+	pid = Exec(shared_fids_child, sizeof(p), &p);
+	ASSERT(pid!=NOPROC);
+	ASSERT(Close(p.write)==0);
+	ASSERT(Read(p.read, buf, 8)==5);
+	ASSERT(Read(p.read, buf, 8)==0);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	ASSERT(Close(p.read)==0);
+
+	/* Only the selected fids */
+	ASSERT(Pipe(&p)==0);
+	ASSERT(ExecEx(selected_fids_child, sizeof(p), &p, EXEC_SELECT_FIDS, &p.write, 1)!=NOPROC);
+	ASSERT(Close(p.write)==0);
+	ASSERT(Read(p.read, buf, 8)==3);
+	ASSERT(Read(p.read, buf, 8)==0);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	Fid_t bad = MAX_FILEID-1;
+	ASSERT(ExecEx(selected_fids_child, sizeof(p), &p, EXEC_SELECT_FIDS, &bad, 1)==NOPROC);
+	ASSERT(ExecEx(selected_fids_child, sizeof(p), &p, 2, NULL, 0)==NOPROC);
+	ASSERT(Close(p.read)==0);
+	return 0;
+}
+
+
+static int fid_race_child(int argl, void* args)
+{
+	return 0;
+}
+
+BOOT_TEST(test_exec_shares_fids_under_io,
+	"Test that the file id table can be shared with a child and copied,\n"
+	"while other threads of the process do I/O.",
+	.minimum_cores = 2
+	)
+{
+	pipe_t pipes[2];
+	Tid_t tids[2];
+	fid_race_start(pipes, tids);
+
+	/* Each child shares our table; we copy it, and it releases the old one */
+	for(int i=0; i<500; i++) {
+		Pid_t pid = Exec(fid_race_child, 0, NULL);
+		ASSERT(pid!=NOPROC);
+		Fid_t f = OpenNull();
+		ASSERT(f!=NOFILE);
+		ASSERT(Close(f)==0);
+		ASSERT(WaitChild(pid, NULL)==pid);
+	}
+
+	fid_race_finish(pipes, tids);
+	return 0;
+}
+
 
 BOOT_TEST(test_null_device,
 	"Test the null device."
@@ -930,6 +1232,9 @@ TEST_SUITE(basic_tests,
 	&test_close_success_on_valid_nonfile_fid,
 	&test_close_terminals,
 	&test_read_kbd,
+	&test_read_kbd_nonblocking,
+	&test_poll_kbd,
+	&test_poll_kbd_shared,
 	&test_read_kbd_big,
 	&test_read_error_on_bad_fid,
 	&test_read_from_many_terminals,
@@ -938,6 +1243,10 @@ TEST_SUITE(basic_tests,
 	&test_write_error_on_bad_fid,
 	&test_write_to_many_terminals,
 	&test_child_inherits_files,
+	&test_file_limit,
+	&test_fid_table_grows_under_io,
+	&test_exec_shares_fids,
+	&test_exec_shares_fids_under_io,
 	NULL
 };
 
@@ -1398,6 +1707,63 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
+static Mutex contention_mx = MUTEX_INIT;
+static unsigned long contention_counter;
+
+static int mutex_contention_thread(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		Mutex_Lock(&contention_mx);
+		unsigned long c = contention_counter;
+		if(i % 64 == 0) fibo(10);
+		contention_counter = c+1;
+		Mutex_Unlock(&contention_mx);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_mutex_contention,
+	"Test that a mutex contended by many threads provides mutual exclusion."
+	)
+{
+	const int nthreads = 8, N = 20000;
+	Tid_t tids[nthreads];
+	contention_counter = 0;
+	for(int i=0; i<nthreads; i++) {
+		tids[i] = CreateThread(mutex_contention_thread, N, NULL);
+		ASSERT(tids[i]!=NOTHREAD);
+	}
+	for(int i=0; i<nthreads; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	ASSERT(contention_counter == nthreads*N);
+	return 0;
+}
+
+
+
+static int mutex_idle_owner_thread(int argl, void* args)
+{
+	Mutex_Lock(&contention_mx);
+	Mutex_Unlock(&contention_mx);
+	return 0;
+}
+
+BOOT_TEST(test_mutex_yields_to_idle_owner,
+	"Test that a thread waiting on a mutex gets it, when the owner sleeps while holding it."
+	)
+{
+	/* We hold the mutex while sleeping, so the waiter finds us not running */
+	Mutex_Lock(&contention_mx);
+	Tid_t t = CreateThread(mutex_idle_owner_thread, 0, NULL);
+	ASSERT(t!=NOTHREAD);
+	Poll(NULL, 0, 50);
+	Mutex_Unlock(&contention_mx);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	return 0;
+}
+
+
+
 TEST_SUITE(thread_tests, 
 	"A suite of tests for threads."
 	)
@@ -1416,6 +1782,8 @@ TEST_SUITE(thread_tests,
 	&test_main_exit_cleanup,
 	&test_noexit_cleanup,
 	&test_cyclic_joins,
+	&test_mutex_contention,
+	&test_mutex_yields_to_idle_owner,
 	NULL
 };
 
@@ -1557,13 +1925,9 @@ int data_consumer(int argl, void* args)
 }
 
 
-BOOT_TEST(test_pipe_single_producer,
-	"Test blocking in the pipe by a single producer single consumer sending 10Mbytes of data."
-	)
+/* Move 10Mbytes from a producer process to a consumer process, through the given pipe */
+static int pipe_single_producer(pipe_t pipe)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-
 	/* First, make pipe.read be zero. We cannot just Dup, because we may close pipe.write */
 	if(pipe.read != 0) {
 		if(pipe.write==0) {
@@ -1593,6 +1957,33 @@ BOOT_TEST(test_pipe_single_producer,
 	return 0;
 }
 
+BOOT_TEST(test_pipe_single_producer,
+	"Test blocking in the pipe by a single producer single consumer sending 10Mbytes of data."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	return pipe_single_producer(pipe);
+}
+
+BOOT_TEST(test_pipe_spsc_single_producer,
+	"Test blocking in a single-producer/single-consumer pipe, sending 10Mbytes of data."
+	)
+{
+	pipe_t pipe;
+	ASSERT(PipeSPSC(&pipe, 0)==-1);
+	ASSERT(PipeSPSC(&pipe, PIPE_MAX_BUFFER_SIZE+1)==-1);
+	ASSERT(PipeSPSC(&pipe, PIPE_BUFFER_SIZE)==0);
+
+	/* Not a regular pipe */
+	ASSERT(SetPipeSize(pipe.read, 4096)==-1);
+	ASSERT(Write(pipe.read, "x", 1)==-1);
+	char c;
+	ASSERT(Read(pipe.write, &c, 1)==-1);
+
+	return pipe_single_producer(pipe);
+}
+
 BOOT_TEST(test_pipe_multi_producer,
 	"Test blocking in the pipe by 10 producers and single consumer sending 10Mbytes of data."
 	)
@@ -1633,99 +2024,880 @@ BOOT_TEST(test_pipe_multi_producer,
 }
 
 
-TEST_SUITE(pipe_tests,
-	"A suite of tests for pipes. We are focusing on correctness, not performance."
-	)
-{
-	&test_pipe_open,
-	&test_pipe_fails_on_exhausted_fid,
-	&test_pipe_close_reader,
-	&test_pipe_close_writer,
-	&test_pipe_single_producer,
-	&test_pipe_multi_producer,
-	NULL
-};
-
+#define PATTERN_WRITES 50
+#define PATTERN_MAXWRITE 7000
+#define PATTERN_SIZE(i) (1 + ((i)*1237) % PATTERN_MAXWRITE)
 
+static int pattern_writer(int argl, void* args)
+{
+	Fid_t wfid = *(Fid_t*)args;
+	char buffer[PATTERN_MAXWRITE];
+	unsigned int pos = 0;
+	for(int i=0; i<PATTERN_WRITES; i++) {
+		/* Writes larger than the pipe buffer, at odd sizes, to force wrap-around */
+		unsigned int n = PATTERN_SIZE(i);
+		for(unsigned int j=0; j<n; j++) buffer[j] = (char)(pos+j);
+		ASSERT(Write(wfid, buffer, n)==n);
+		pos += n;
+	}
+	return 0;
+}
 
+static int check_pattern_stream(pipe_t pipe)
+{
+	unsigned int total = 0;
+	for(int i=0; i<PATTERN_WRITES; i++) total += PATTERN_SIZE(i);
 
-/*********************************************
- *
- *
- *
- *  Socket tests
- *
- *
- *
- *********************************************/
+	Tid_t t = CreateThread(pattern_writer, 0, &pipe.write);
+	ASSERT(t!=NOTHREAD);
 
-struct connect_sockets
-{
-	Fid_t sock1, lsock, *sock2;
-	port_t port;
-};
+	char buffer[333];
+	unsigned int pos = 0;
+	for(int i=0; pos < total; i++) {
+		int rc = Read(pipe.read, buffer, 1+ (i*71) % sizeof(buffer));
+		ASSERT(rc > 0);
+		for(int j=0; j<rc; j++) ASSERT(buffer[j] == (char)(pos+j));
+		pos += rc;
+	}
+	ASSERT(pos == total);
+	ASSERT(ThreadJoin(t, NULL)==0);
 
-static int connect_sockets_connect_process(int argl, void* args) {
-	struct connect_sockets* A = args;
-	ASSERT(Connect(A->sock1, A->port, 1000)==0);
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(Read(pipe.read, buffer, sizeof(buffer))==0);
 	return 0;
 }
 
-void connect_sockets(Fid_t sock1, Fid_t lsock, Fid_t* sock2, port_t port)
+BOOT_TEST(test_pipe_bulk_integrity,
+	"Test that large writes and reads of odd sizes preserve the byte stream across buffer wrap-around."
+	)
 {
-	struct connect_sockets A = { 
-		.sock1=sock1, .lsock=lsock, .sock2=sock2, .port=port
-	};
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	return check_pattern_stream(pipe);
+}
 
-	/* Spawn a child to connect sock1 to port (where lsock must be listening) */
-	Pid_t pid = Exec(connect_sockets_connect_process, sizeof(A), &A);
-	ASSERT(pid != NOPROC);
+BOOT_TEST(test_pipe_spsc_integrity,
+	"Test that a single-producer/single-consumer pipe preserves the byte stream across buffer wrap-around."
+	)
+{
+	pipe_t pipe;
+	ASSERT(PipeSPSC(&pipe, 1000)==0);
+	return check_pattern_stream(pipe);
+}
 
-	/* accept the child's connection here */
-	*sock2 = Accept(lsock);
-	ASSERT(*sock2 != NOFILE);
 
-	/* Clean up child */
-	ASSERT(WaitChild(pid, NULL)==pid);
+/* Add n units to a semaphore stream; return n, or the error of Write */
+static int sem_give(Fid_t sem, unsigned int n)
+{
+	int rc = Write(sem, (const char*)&n, sizeof(n));
+	return (rc == sizeof(n)) ? (int)n : rc;
 }
 
-
-void check_transfer(Fid_t from, Fid_t to)
+/* Take up to max units (all, if 0) from a semaphore stream; return the units taken, or the error of Read */
+static int sem_take(Fid_t sem, unsigned int max)
 {
-	char buffer[12] = {[0]=0};
-	int rc;
-	ASSERT((rc=Write(from,"Hello world", 12))==12);
-	ASSERT((rc=Read(to, buffer, 12))==12);
-	ASSERT((rc=strcmp("Hello world", buffer))==0);
+	unsigned int v = max;
+	int rc = Read(sem, (char*)&v, sizeof(v));
+	return (rc == sizeof(v)) ? (int)v : rc;
 }
 
+static int spsc_cache_thread(int argl, void* args)
+{
+	Fid_t* fids = args;		/* the read end, and the semaphores done and go */
+	char c;
+	if(Read(fids[0], &c, 1)!=1 || c!='c') return 0;
+	sem_give(fids[1], 1);
+	sem_take(fids[2], 1);
+	return Read(fids[0], &c, 1);
+}
 
-BOOT_TEST(test_socket_constructor_many_per_port,
-	"Test that Socket succeeds opening many sockets on the same port"
+BOOT_TEST(test_pipe_spsc_cached_fids,
+	"Test that closing or replacing a file id of a single-producer/single-consumer pipe takes effect, although threads cache it for lock-free access."
 	)
 {
-	for(Fid_t f=0; f<MAX_FILEID; f++) {
-		ASSERT(Socket(100)!=NOFILE);
-	}
+	pipe_t pipe, other;
+	char c;
+	int exitval;
+
+	ASSERT(PipeSPSC(&pipe, 128)==0);
+	Fid_t fids[3] = { pipe.read, Semaphore(0), Semaphore(0) };
+
+	/* Both threads cache the read end, and we cache the write end */
+	ASSERT(Write(pipe.write, "ab", 2)==2);
+	ASSERT(Write(pipe.write, "cd", 2)==2);
+	ASSERT(Read(pipe.read, &c, 1)==1 && c=='a');
+	ASSERT(Read(pipe.read, &c, 1)==1 && c=='b');
+	Tid_t t = CreateThread(spsc_cache_thread, 0, fids);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(sem_take(fids[1], 1)==1);
+
+	/* The read end is released, so the pipe has no reader */
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(Write(pipe.write, "e", 1)==-1);
+
+	/* The other thread finds the file id closed */
+	ASSERT(sem_give(fids[2], 1)==1);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval==-1);
+	ASSERT(Close(pipe.write)==0);
+
+	/* Replace a cached read end */
+	ASSERT(PipeSPSC(&pipe, 128)==0);
+	ASSERT(Write(pipe.write, "y", 1)==1);
+	ASSERT(Write(pipe.write, "y", 1)==1);
+	ASSERT(Read(pipe.read, &c, 1)==1 && c=='y');
+	ASSERT(Pipe(&other)==0);
+	ASSERT(Write(other.write, "x", 1)==1);
+	ASSERT(Dup2(other.read, pipe.read)==0);
+	ASSERT(Read(pipe.read, &c, 1)==1 && c=='x');
+	ASSERT(Write(pipe.write, "y", 1)==-1);
 	return 0;
 }
 
-BOOT_TEST(test_socket_constructor_out_of_fids,
-	"Test that the socket constructor fails on running out of Fids"
+
+#undef PATTERN_WRITES
+#undef PATTERN_MAXWRITE
+#undef PATTERN_SIZE
+
+
+BOOT_TEST(test_pipe_capacity,
+	"Test PipeEx and SetPipeSize: bounds, non-pipe fids, and a write that fits the requested capacity."
 	)
 {
-	for(int i=0;i<MAX_FILEID;i++)
-		ASSERT(Socket(100)!=NOFILE);
-	for(int i=0;i<MAX_FILEID;i++)
-		ASSERT(Socket(100)==NOFILE);	
+	pipe_t pipe;
+	ASSERT(PipeEx(&pipe, 0)==-1);
+	ASSERT(PipeEx(&pipe, PIPE_MAX_BUFFER_SIZE+1)==-1);
+
+	Fid_t null = OpenNull();
+	ASSERT(SetPipeSize(null, 4096)==-1);
+	ASSERT(SetPipeSize(NOFILE, 4096)==-1);
+	ASSERT(Close(null)==0);
+
+	static char buffer[65536];
+	for(unsigned int i=0; i<sizeof(buffer); i++) buffer[i] = (char) i;
+
+	/* A single write of the full capacity must not block */
+	ASSERT(PipeEx(&pipe, sizeof(buffer))==0);
+	ASSERT(Write(pipe.write, buffer, sizeof(buffer))==sizeof(buffer));
+
+	/* Cannot shrink below the buffered data */
+	ASSERT(SetPipeSize(pipe.read, 1000)==-1);
+
+	/* Growing keeps the stream intact */
+	ASSERT(SetPipeSize(pipe.write, 2*sizeof(buffer))==0);
+	ASSERT(Write(pipe.write, buffer, 100)==100);
+
+	static char rbuf[65536];
+	ASSERT(Read(pipe.read, rbuf, sizeof(rbuf))==sizeof(rbuf));
+	ASSERT(memcmp(rbuf, buffer, sizeof(buffer))==0);
+	ASSERT(Read(pipe.read, rbuf, 100)==100);
+	ASSERT(memcmp(rbuf, buffer, 100)==0);
+
+	/* Now it is empty and may shrink */
+	ASSERT(SetPipeSize(pipe.read, 10)==0);
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(Close(pipe.write)==0);
 	return 0;
 }
 
-BOOT_TEST(test_socket_constructor_illegal_port,
-	"Test that the socket constructor fails on illegal port"
+
+BOOT_TEST(test_splice,
+	"Test that Splice moves data between pipes and devices, and fails on bad arguments."
 	)
 {
-	ASSERT(Socket(NOPORT)!=NOFILE);
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+
+	ASSERT(Splice(p1.read, p1.read, 10)==-1);
+	ASSERT(Splice(p1.read, NOFILE, 10)==-1);
+	ASSERT(Splice(p1.write, p2.write, 10)==-1);
+
+	/* pipe to pipe, across the wrap-around of p1 */
+	char buf[800];
+	for(unsigned int i=0; i<sizeof(buf); i++) buf[i] = (char) i;
+	ASSERT(Write(p1.write, buf, 600)==600);
+	ASSERT(Read(p1.read, buf, 600)==600);
+	ASSERT(Write(p1.write, buf, sizeof(buf))==sizeof(buf));
+	ASSERT(Splice(p1.read, p2.read, 10)==-1);
+	ASSERT(Splice(p1.read, p2.write, 500)==500);
+	ASSERT(Splice(p1.read, p2.write, 1000)==300);
+
+	char rbuf[800];
+	ASSERT(Read(p2.read, rbuf, sizeof(rbuf))==sizeof(rbuf));
+	ASSERT(memcmp(buf, rbuf, sizeof(buf))==0);
+
+	/* device to pipe, through the kernel buffer */
+	Fid_t null = OpenNull();
+	ASSERT(Splice(null, p2.write, 100)==100);
+	ASSERT(Read(p2.read, rbuf, sizeof(rbuf))==100);
+	for(int i=0; i<100; i++) ASSERT(rbuf[i]==0);
+
+	/* end of data */
+	ASSERT(Close(p1.write)==0);
+	ASSERT(Splice(p1.read, p2.write, 10)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_nonblocking,
+	"Test Fcntl, and that non-blocking pipe and semaphore operations return WOULDBLOCK instead of waiting."
+	)
+{
+	pipe_t pipe;
+	ASSERT(PipeEx(&pipe, 100)==0);
+	ASSERT(SetPipeSize(pipe.write, 100)==0);
+
+	ASSERT(Fcntl(NOFILE, FCNTL_GETFL, 0)==-1);
+	ASSERT(Fcntl(pipe.read, FCNTL_SETFL, 1024)==-1);
+	ASSERT(Fcntl(pipe.read, 42, 0)==-1);
+	ASSERT(Fcntl(pipe.read, FCNTL_GETFL, 0)==0);
+
+	ASSERT(Fcntl(pipe.read, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	ASSERT(Fcntl(pipe.write, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	ASSERT(Fcntl(pipe.read, FCNTL_GETFL, 0)==STREAM_NONBLOCK);
+
+	char buf[150];
+	memset(buf, 'x', sizeof(buf));
+	ASSERT(Read(pipe.read, buf, 10)==WOULDBLOCK);
+
+	/* Only what fits is written */
+	ASSERT(Write(pipe.write, buf, 150)==100);
+	ASSERT(Write(pipe.write, buf, 1)==WOULDBLOCK);
+
+	ASSERT(Read(pipe.read, buf, 150)==100);
+	ASSERT(Read(pipe.read, buf, 150)==WOULDBLOCK);
+
+	/* End of data is still reported */
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(Read(pipe.read, buf, 150)==0);
+	ASSERT(Close(pipe.read)==0);
+
+	/* The same for single-producer/single-consumer pipes */
+	ASSERT(PipeSPSC(&pipe, 128)==0);
+	ASSERT(Fcntl(pipe.read, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	ASSERT(Fcntl(pipe.write, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	ASSERT(Read(pipe.read, buf, 10)==WOULDBLOCK);
+	ASSERT(Write(pipe.write, buf, 150)==128);
+	ASSERT(Write(pipe.write, buf, 1)==WOULDBLOCK);
+	ASSERT(Read(pipe.read, buf, 150)==128);
+	ASSERT(Read(pipe.read, buf, 150)==WOULDBLOCK);
+
+	/* Semaphores */
+	Fid_t sem = Semaphore(1);
+	ASSERT(Fcntl(sem, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	ASSERT(sem_take(sem, 1)==1);
+	ASSERT(sem_take(sem, 1)==WOULDBLOCK);
+	return 0;
+}
+
+
+BOOT_TEST(test_poll,
+	"Test that Poll reports the readiness of pipe ends, and honors its timeout."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	poll_fd fds[3] = {
+		{ .fd = pipe.read, .events = STREAM_READABLE },
+		{ .fd = pipe.write, .events = STREAM_WRITABLE },
+		{ .fd = -1, .events = STREAM_READABLE }		/* ignored */
+	};
+
+	/* Only the writer is ready */
+	ASSERT(Poll(fds, 3, 0)==1);
+	ASSERT(fds[0].revents==0);
+	ASSERT(fds[1].revents==STREAM_WRITABLE);
+	ASSERT(fds[2].revents==0);
+
+	/* A timeout expires */
+	ASSERT(Poll(fds, 1, 50)==0);
+
+	char buf[10];
+	ASSERT(Write(pipe.write, "hello", 5)==5);
+	ASSERT(Poll(fds, 2, TIMEOUT_INFINITE)==2);
+	ASSERT(fds[0].revents==STREAM_READABLE);
+	ASSERT(Read(pipe.read, buf, 10)==5);
+	ASSERT(Poll(fds, 1, 0)==0);
+
+	/* Hangup is reported even if not asked for */
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(Poll(fds, 1, 0)==1);
+	ASSERT(fds[0].revents & STREAM_HANGUP);
+
+	/* Bad fids */
+	fds[1].fd = pipe.write;
+	ASSERT(Poll(fds, 2, 0)==-1);
+	ASSERT(Close(pipe.read)==0);
+	return 0;
+}
+
+
+struct poll_writer_args {
+	Fid_t fid;
+	int delay;
+};
+
+static int poll_writer(int argl, void* args)
+{
+	struct poll_writer_args* A = args;
+	/* Give the reader a chance to block (an empty Poll just sleeps) */
+	ASSERT(Poll(NULL, 0, A->delay)==0);
+	ASSERT(Write(A->fid, "x", 1)==1);
+	return 0;
+}
+
+static int poll_sem_giver(int argl, void* args)
+{
+	struct poll_writer_args* A = args;
+	ASSERT(Poll(NULL, 0, A->delay)==0);
+	ASSERT(sem_give(A->fid, 1)==1);
+	return 0;
+}
+
+
+BOOT_TEST(test_epoll,
+	"Test interest sets: EpollCtl errors, level-triggered reports, and waking a blocked EpollWait."
+	)
+{
+	enum { N = 4 };
+	pipe_t pipes[N];
+	Fid_t ep = EpollCreate();
+	ASSERT(ep!=NOFILE);
+
+	for(int i=0; i<N; i++) {
+		ASSERT(Pipe(&pipes[i])==0);
+		ASSERT(EpollCtl(ep, EPOLL_ADD, pipes[i].read, STREAM_READABLE)==0);
+	}
+
+	/* Errors */
+	ASSERT(EpollCtl(ep, EPOLL_ADD, pipes[0].read, STREAM_READABLE)==-1);
+	ASSERT(EpollCtl(ep, EPOLL_DEL, pipes[0].write, 0)==-1);
+	ASSERT(EpollCtl(ep, 42, pipes[0].read, STREAM_READABLE)==-1);
+	ASSERT(EpollCtl(ep, EPOLL_ADD, ep, STREAM_READABLE)==-1);
+	ASSERT(EpollCtl(pipes[0].read, EPOLL_ADD, pipes[1].read, STREAM_READABLE)==-1);
+	ASSERT(EpollCtl(ep, EPOLL_ADD, NOFILE, STREAM_READABLE)==-1);
+
+	poll_fd ev[N];
+	ASSERT(EpollWait(ep, ev, 0, 0)==-1);
+	ASSERT(EpollWait(pipes[0].read, ev, N, 0)==-1);
+	ASSERT(EpollWait(ep, ev, N, 0)==0);
+
+	/* A blocked wait is woken up by a write */
+	struct poll_writer_args A = { .fid = pipes[2].write, .delay = 20 };
+	Tid_t t = CreateThread(poll_writer, 0, &A);
+	ASSERT(EpollWait(ep, ev, N, TIMEOUT_INFINITE)==1);
+	ASSERT(ev[0].fd==pipes[2].read && ev[0].revents==STREAM_READABLE);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* Level-triggered: reported until consumed */
+	ASSERT(EpollWait(ep, ev, N, 0)==1);
+	char c;
+	ASSERT(Read(pipes[2].read, &c, 1)==1);
+	ASSERT(EpollWait(ep, ev, N, 0)==0);
+
+	/* Modify interest to the write end */
+	ASSERT(EpollCtl(ep, EPOLL_ADD, pipes[1].write, 0)==0);
+	ASSERT(EpollWait(ep, ev, N, 0)==0);
+	ASSERT(EpollCtl(ep, EPOLL_MOD, pipes[1].write, STREAM_WRITABLE)==0);
+	ASSERT(EpollWait(ep, ev, N, 0)==1);
+	ASSERT(ev[0].fd==pipes[1].write);
+	ASSERT(EpollCtl(ep, EPOLL_DEL, pipes[1].write, 0)==0);
+	ASSERT(EpollWait(ep, ev, N, 0)==0);
+
+	/* Closing a stream removes it from the set */
+	ASSERT(Write(pipes[3].write, "y", 1)==1);
+	ASSERT(Close(pipes[3].read)==0);
+	ASSERT(EpollWait(ep, ev, N, 0)==0);
+
+	/* An interest set is itself pollable */
+	ASSERT(Write(pipes[0].write, "z", 1)==1);
+	poll_fd pfd = { .fd = ep, .events = STREAM_READABLE };
+	ASSERT(Poll(&pfd, 1, 0)==1);
+
+	/* Single-producer/single-consumer pipes and semaphores */
+	pipe_t sp;
+	ASSERT(PipeSPSC(&sp, 128)==0);
+	ASSERT(EpollCtl(ep, EPOLL_DEL, pipes[0].read, 0)==0);
+	ASSERT(EpollCtl(ep, EPOLL_ADD, sp.read, STREAM_READABLE)==0);
+	ASSERT(EpollWait(ep, ev, N, 0)==0);
+	A.fid = sp.write;
+	t = CreateThread(poll_writer, 0, &A);
+	ASSERT(EpollWait(ep, ev, N, TIMEOUT_INFINITE)==1);
+	ASSERT(ev[0].fd==sp.read);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(Read(sp.read, &c, 1)==1);
+
+	Fid_t sem = Semaphore(0);
+	ASSERT(EpollCtl(ep, EPOLL_ADD, sem, STREAM_READABLE)==0);
+	ASSERT(EpollWait(ep, ev, N, 0)==0);
+	A.fid = sem;
+	t = CreateThread(poll_sem_giver, 0, &A);
+	ASSERT(EpollWait(ep, ev, N, TIMEOUT_INFINITE)==1);
+	ASSERT(ev[0].fd==sem);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	ASSERT(Close(ep)==0);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_readv_writev,
+	"Test that ReadV and WriteV scatter and gather data, on pipes and on streams without vectored operations."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	char a[] = "Hello", b[] = ", ", c[] = "world";
+	iovec_t out[4] = { {a, 5}, {b, 2}, {NULL, 0}, {c, 6} };
+	ASSERT(WriteV(pipe.write, out, 4)==13);
+
+	char x[3], y[20];
+	iovec_t in[2] = { {x, 3}, {y, 20} };
+	ASSERT(ReadV(pipe.read, in, 2)==13);
+	ASSERT(memcmp(x, "Hel", 3)==0);
+	ASSERT(strcmp(y, "lo, world")==0);
+
+	/* Errors */
+	ASSERT(WriteV(pipe.read, out, 4)==-1);
+	ASSERT(ReadV(pipe.write, in, 2)==-1);
+	ASSERT(WriteV(NOFILE, out, 4)==-1);
+	ASSERT(WriteV(pipe.write, NULL, 1)==-1);
+	ASSERT(WriteV(pipe.write, out, MAX_IOV+1)==-1);
+	ASSERT(WriteV(pipe.write, out, 0)==0);
+
+	/* Non-blocking */
+	ASSERT(Fcntl(pipe.read, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	ASSERT(ReadV(pipe.read, in, 2)==WOULDBLOCK);
+
+	/* End of data */
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(ReadV(pipe.read, in, 2)==0);
+	ASSERT(Close(pipe.read)==0);
+
+	/* A stream without vectored operations */
+	Fid_t fn = OpenNull();
+	ASSERT(WriteV(fn, out, 4)==13);
+	ASSERT(ReadV(fn, in, 2)==23);
+	ASSERT(x[0]==0 && y[19]==0);
+	ASSERT(Close(fn)==0);
+	return 0;
+}
+
+
+#define WRITEV_RECORDS 2000
+
+static int writev_record_producer(int argl, void* args)
+{
+	Fid_t fid = *(Fid_t*)args;
+
+	/* Each record is a header, followed by argl repeated as payload */
+	char header = 'H';
+	char payload[60];
+	memset(payload, argl, sizeof(payload));
+	iovec_t rec[2] = { {&header, 1}, {payload, sizeof(payload)} };
+
+	for(int i=0; i<WRITEV_RECORDS; i++)
+		ASSERT(WriteV(fid, rec, 2)==61);
+	return 0;
+}
+
+BOOT_TEST(test_writev_atomic,
+	"Test that records written by WriteV to a pipe are not interleaved with those of other writers."
+	)
+{
+	pipe_t pipe;
+	ASSERT(PipeEx(&pipe, 100)==0);
+
+	/* A record larger than the buffer makes it grow */
+	char big[300];
+	memset(big, 'b', sizeof(big));
+	iovec_t v = { big, sizeof(big) };
+	ASSERT(WriteV(pipe.write, &v, 1)==300);
+	ASSERT(Read(pipe.read, big, sizeof(big))==300);
+
+	/* With a fixed capacity, a non-blocking atomic write is all or nothing */
+	ASSERT(SetPipeSize(pipe.write, 100)==0);
+	ASSERT(Fcntl(pipe.write, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	v.len = 60;
+	ASSERT(WriteV(pipe.write, &v, 1)==60);
+	ASSERT(WriteV(pipe.write, &v, 1)==WOULDBLOCK);
+	ASSERT(Read(pipe.read, big, sizeof(big))==60);
+	ASSERT(Fcntl(pipe.write, FCNTL_SETFL, 0)==0);
+
+	/* Concurrent writers */
+	Tid_t t[3];
+	for(int i=0; i<3; i++)
+		t[i] = CreateThread(writev_record_producer, 'x'+i, &pipe.write);
+
+	char rec[61];
+	for(int r=0; r<3*WRITEV_RECORDS; r++) {
+		unsigned int count = 0;
+		while(count < sizeof(rec)) {
+			int rc = Read(pipe.read, rec+count, sizeof(rec)-count);
+			ASSERT(rc>0);
+			count += rc;
+		}
+		ASSERT(rec[0]=='H');
+		for(unsigned int i=2; i<sizeof(rec); i++)
+			ASSERT(rec[i]==rec[1]);
+	}
+
+	for(int i=0; i<3; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_pipe_packet,
+	"Test that a packet pipe returns one whole message per Read."
+	)
+{
+	pipe_t pipe;
+	ASSERT(PipePacket(&pipe, 4)==-1);
+	ASSERT(PipePacket(&pipe, 64)==0);
+	ASSERT(SetPipeSize(pipe.write, 2)==-1);
+
+	/* Messages keep their boundaries */
+	ASSERT(Write(pipe.write, "one", 4)==4);
+	ASSERT(Write(pipe.write, "", 0)==0);
+	ASSERT(Write(pipe.write, "three", 6)==6);
+	iovec_t v[2] = { {"tw", 2}, {"o", 2} };
+	ASSERT(WriteV(pipe.write, v, 2)==4);
+
+	char buf[100];
+	ASSERT(Read(pipe.read, buf, 100)==4 && strcmp(buf, "one")==0);
+	ASSERT(Read(pipe.read, buf, 100)==6 && strcmp(buf, "three")==0);
+	ASSERT(Read(pipe.read, buf, 100)==4 && strcmp(buf, "two")==0);
+
+	/* A read of nothing leaves the next message in place */
+	ASSERT(Write(pipe.write, "four", 5)==5);
+	ASSERT(Read(pipe.read, buf, 0)==0);
+	ASSERT(ReadV(pipe.read, v, 0)==0);
+	iovec_t empty[2] = { {buf, 0}, {buf, 0} };
+	ASSERT(ReadV(pipe.read, empty, 2)==0);
+	ASSERT(Read(pipe.read, buf, 100)==5 && strcmp(buf, "four")==0);
+
+	/* A short read truncates */
+	ASSERT(Write(pipe.write, "hello", 6)==6);
+	ASSERT(Write(pipe.write, "world", 6)==6);
+	ASSERT(Read(pipe.read, buf, 2)==2 && memcmp(buf, "he", 2)==0);
+	ASSERT(Read(pipe.read, buf, 100)==6 && strcmp(buf, "world")==0);
+
+	/* Too large for the buffer, even grown */
+	ASSERT(SetPipeSize(pipe.write, 64)==0);
+	ASSERT(Write(pipe.write, buf, 100)==-1);
+
+	/* Non-blocking writes are all or nothing */
+	ASSERT(Fcntl(pipe.write, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	ASSERT(Fcntl(pipe.read, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	ASSERT(Read(pipe.read, buf, 100)==WOULDBLOCK);
+	ASSERT(Write(pipe.write, buf, 40)==40);
+	ASSERT(Write(pipe.write, buf, 40)==WOULDBLOCK);
+	ASSERT(Read(pipe.read, buf, 100)==40);
+
+	/* Splice moves one message */
+	pipe_t p2;
+	ASSERT(Pipe(&p2)==0);
+	ASSERT(Write(pipe.write, "abc", 3)==3);
+	ASSERT(Write(pipe.write, "def", 3)==3);
+	ASSERT(Splice(pipe.read, p2.write, 100)==3);
+	ASSERT(Read(p2.read, buf, 100)==3 && memcmp(buf, "abc", 3)==0);
+
+	/* End of data */
+	ASSERT(Close(pipe.write)==0);
+	ASSERT(Read(pipe.read, buf, 100)==3 && memcmp(buf, "def", 3)==0);
+	ASSERT(Read(pipe.read, buf, 100)==0);
+	ASSERT(Close(pipe.read)==0);
+
+	/* Messages of concurrent writers are never interleaved */
+	ASSERT(PipePacket(&pipe, 100)==0);
+	Tid_t t[3];
+	for(int i=0; i<3; i++)
+		t[i] = CreateThread(writev_record_producer, 'x'+i, &pipe.write);
+	for(int r=0; r<3*WRITEV_RECORDS; r++) {
+		ASSERT(Read(pipe.read, buf, 100)==61);
+		ASSERT(buf[0]=='H');
+		for(unsigned int i=2; i<61; i++)
+			ASSERT(buf[i]==buf[1]);
+	}
+	for(int i=0; i<3; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	return 0;
+}
+
+
+
+TEST_SUITE(pipe_tests,
+	"A suite of tests for pipes. We are focusing on correctness, not performance."
+	)
+{
+	&test_pipe_open,
+	&test_pipe_fails_on_exhausted_fid,
+	&test_pipe_close_reader,
+	&test_pipe_close_writer,
+	&test_pipe_single_producer,
+	&test_pipe_spsc_single_producer,
+	&test_pipe_multi_producer,
+	&test_pipe_bulk_integrity,
+	&test_pipe_spsc_integrity,
+	&test_pipe_spsc_cached_fids,
+	&test_pipe_capacity,
+	&test_splice,
+	&test_pipe_nonblocking,
+	&test_poll,
+	&test_epoll,
+	&test_readv_writev,
+	&test_writev_atomic,
+	&test_pipe_packet,
+	NULL
+};
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Semaphore tests
+ *
+ *
+ *
+ *********************************************/
+
+
+BOOT_TEST(test_semaphore_counts,
+	"Test that a semaphore stream counts units correctly, for single and batched operations."
+	)
+{
+	char buf[16];
+	Fid_t sem = Semaphore(3);
+	ASSERT(sem!=NOFILE);
+
+	ASSERT(sem_take(sem, 1)==1);
+	ASSERT(sem_take(sem, 16)==2);
+
+	ASSERT(sem_give(sem, 5)==5);
+	ASSERT(sem_take(sem, 2)==2);
+	ASSERT(sem_take(sem, 2)==2);
+	ASSERT(sem_take(sem, 2)==1);
+
+	/* Take everything, and keep an empty counter */
+	ASSERT(sem_give(sem, 7)==7);
+	ASSERT(sem_give(sem, 0)==0);
+	ASSERT(sem_take(sem, 0)==7);
+	ASSERT(Fcntl(sem, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	ASSERT(sem_take(sem, 0)==WOULDBLOCK);
+
+	/* Each call transfers exactly one unsigned int */
+	ASSERT(Write(sem, buf, 1)==-1);
+	ASSERT(Read(sem, buf, 16)==-1);
+	ASSERT(sem_give(sem, 1)==1);
+	ASSERT(sem_give(sem, UINT_MAX)==-1);
+
+	ASSERT(Close(sem)==0);
+	return 0;
+}
+
+
+static int semaphore_signaller(int argl, void* args)
+{
+	Fid_t sem = *(Fid_t*)args;
+	for(int i=0; i<100; i++)
+		ASSERT(sem_give(sem, 1)==1);
+	return 0;
+}
+
+BOOT_TEST(test_semaphore_across_processes,
+	"Test that a semaphore stream blocks readers until units are released by another process."
+	)
+{
+	Fid_t sem = Semaphore(0);
+	ASSERT(sem!=NOFILE);
+
+	Pid_t pid = Exec(semaphore_signaller, sizeof(sem), &sem);
+	ASSERT(pid!=NOPROC);
+
+	int total = 0;
+	while(total < 100) {
+		int rc = sem_take(sem, 8);
+		ASSERT(rc>0 && rc<=8);
+		total += rc;
+	}
+	ASSERT(total == 100);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	return 0;
+}
+
+
+TEST_SUITE(semaphore_tests,
+	"A suite of tests for semaphore streams."
+	)
+{
+	&test_semaphore_counts,
+	&test_semaphore_across_processes,
+	NULL
+};
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Shared memory tests
+ *
+ *
+ *
+ *********************************************/
+
+
+/* Doubles the numbers in a shared region when told to, ringing its doorbell when done */
+static int shm_doubler(int argl, void* args)
+{
+	Fid_t* fids = (Fid_t*)args;
+	Fid_t shm = fids[0], go = fids[1];
+	int* v = ShmMap(shm);
+	ASSERT(v!=NULL);
+	for(int round=0; round<10; round++) {
+		ASSERT(sem_take(go, 1)==1);
+		for(int i=0; i<1024; i++) v[i] *= 2;
+		ASSERT(sem_give(shm, 1)==1);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_shm,
+	"Test that shared memory regions are shared by processes, and that their\n"
+	"doorbell synchronizes them."
+	)
+{
+	ASSERT(ShmCreate(0)==NOFILE);
+	ASSERT(ShmCreate(SHM_MAX_SIZE+1)==NOFILE);
+	ASSERT(ShmMap(0)==NULL);
+
+	Fid_t shm = ShmCreate(1024*sizeof(int));
+	ASSERT(shm!=NOFILE);
+	int* v = ShmMap(shm);
+	ASSERT(v!=NULL && ((uintptr_t)v % 64)==0);
+	for(int i=0; i<1024; i++) ASSERT(v[i]==0);
+	for(int i=0; i<1024; i++) v[i] = i;
+
+	Fid_t fids[2] = { shm, Semaphore(0) };
+	Pid_t pid = Exec(shm_doubler, sizeof(fids), fids);
+	ASSERT(pid!=NOPROC);
+
+	for(int round=1; round<=10; round++) {
+		ASSERT(sem_give(fids[1], 1)==1);
+		ASSERT(sem_take(shm, 1)==1);
+		ASSERT(v[1]==(1<<round) && v[1023]==(1023<<round));
+	}
+	ASSERT(WaitChild(pid, NULL)==pid);
+	ASSERT(Close(fids[1])==0);
+
+	/* The region survives the fid it was created with */
+	Fid_t dup = OpenNull();
+	ASSERT(Dup2(shm, dup)==0);
+	ASSERT(Close(shm)==0);
+	ASSERT(ShmMap(shm)==NULL);
+	ASSERT(ShmMap(dup)==v);
+	ASSERT(Close(dup)==0);
+	return 0;
+}
+
+
+TEST_SUITE(shm_tests,
+	"A suite of tests for shared memory streams."
+	)
+{
+	&test_shm,
+	NULL
+};
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Socket tests
+ *
+ *
+ *
+ *********************************************/
+
+struct connect_sockets
+{
+	Fid_t sock1, lsock, *sock2;
+	port_t port;
+};
+
+static int connect_sockets_connect_process(int argl, void* args) {
+	struct connect_sockets* A = args;
+	ASSERT(Connect(A->sock1, A->port, 1000)==0);
+	return 0;
+}
+
+void connect_sockets(Fid_t sock1, Fid_t lsock, Fid_t* sock2, port_t port)
+{
+	struct connect_sockets A = { 
+		.sock1=sock1, .lsock=lsock, .sock2=sock2, .port=port
+	};
+
+	/* Spawn a child to connect sock1 to port (where lsock must be listening) */
+	Pid_t pid = Exec(connect_sockets_connect_process, sizeof(A), &A);
+	ASSERT(pid != NOPROC);
+
+	/* accept the child's connection here */
+	*sock2 = Accept(lsock);
+	ASSERT(*sock2 != NOFILE);
+
+	/* Clean up child */
+	ASSERT(WaitChild(pid, NULL)==pid);
+}
+
+
+void check_transfer(Fid_t from, Fid_t to)
+{
+	char buffer[12] = {[0]=0};
+	int rc;
+	ASSERT((rc=Write(from,"Hello world", 12))==12);
+	ASSERT((rc=Read(to, buffer, 12))==12);
+	ASSERT((rc=strcmp("Hello world", buffer))==0);
+}
+
+
+BOOT_TEST(test_socket_constructor_many_per_port,
+	"Test that Socket succeeds opening many sockets on the same port"
+	)
+{
+	for(Fid_t f=0; f<MAX_FILEID; f++) {
+		ASSERT(Socket(100)!=NOFILE);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_socket_constructor_out_of_fids,
+	"Test that the socket constructor fails on running out of Fids"
+	)
+{
+	for(int i=0;i<MAX_FILEID;i++)
+		ASSERT(Socket(100)!=NOFILE);
+	for(int i=0;i<MAX_FILEID;i++)
+		ASSERT(Socket(100)==NOFILE);	
+	return 0;
+}
+
+BOOT_TEST(test_socket_constructor_illegal_port,
+	"Test that the socket constructor fails on illegal port"
+	)
+{
+	ASSERT(Socket(NOPORT)!=NOFILE);
 	ASSERT(Socket(1)!=NOFILE);
 	ASSERT(Socket(MAX_PORT)!=NOFILE);
 
@@ -1913,6 +3085,748 @@ static int unblocking_accept_connection(int argl, void* args)
 
 
 
+BOOT_TEST(test_accept_nonblocking,
+	"Test that Accept on a non-blocking listener returns WOULDBLOCK when there are no requests."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(Fcntl(lsock, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	ASSERT(Accept(lsock)==WOULDBLOCK);
+
+	/* The flag is per stream: a connection accepted by a blocking Accept is blocking */
+	Fid_t cli = Socket(NOPORT), srv;
+	ASSERT(Fcntl(lsock, FCNTL_SETFL, 0)==0);
+	connect_sockets(cli, lsock, &srv, 100);
+	ASSERT(Fcntl(srv, FCNTL_GETFL, 0)==0);
+
+	/* Non-blocking socket reads */
+	ASSERT(Fcntl(srv, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	char buf[10];
+	ASSERT(Read(srv, buf, 10)==WOULDBLOCK);
+	ASSERT(Write(cli, "hello", 5)==5);
+	ASSERT(Read(srv, buf, 10)==5);
+	return 0;
+}
+
+
+BOOT_TEST(test_poll_listener,
+	"Test that a listening socket becomes readable when a connection request arrives."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+
+	poll_fd pfd = { .fd = lsock, .events = STREAM_READABLE };
+	ASSERT(Poll(&pfd, 1, 0)==0);
+
+	Fid_t cli = Socket(NOPORT), srv;
+	struct connect_sockets A = { .sock1=cli, .lsock=lsock, .sock2=&srv, .port=100 };
+	Pid_t pid = Exec(connect_sockets_connect_process, sizeof(A), &A);
+	ASSERT(Poll(&pfd, 1, TIMEOUT_INFINITE)==1);
+	ASSERT(pfd.revents==STREAM_READABLE);
+
+	/* Accept will not block now */
+	ASSERT(Fcntl(lsock, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	srv = Accept(lsock);
+	ASSERT(srv!=NOFILE && srv!=WOULDBLOCK);
+	ASSERT(WaitChild(pid, NULL)==pid);
+
+	/* The connected socket */
+	pfd.fd = srv;
+	pfd.events = STREAM_READABLE | STREAM_WRITABLE;
+	ASSERT(Poll(&pfd, 1, 0)==1);
+	ASSERT(pfd.revents==STREAM_WRITABLE);
+	ASSERT(Write(cli, "hello", 5)==5);
+	ASSERT(Poll(&pfd, 1, 0)==1);
+	ASSERT(pfd.revents==(STREAM_READABLE|STREAM_WRITABLE));
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_writev,
+	"Test ReadV and WriteV on connected sockets, and after ShutDown."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT), srv;
+	connect_sockets(cli, lsock, &srv, 100);
+
+	int len = 6;
+	iovec_t msg[2] = { {&len, sizeof(len)}, {"hello", 6} };
+	ASSERT(WriteV(cli, msg, 2)==sizeof(len)+6);
+
+	int rlen;
+	char buf[6];
+	iovec_t in[2] = { {&rlen, sizeof(rlen)}, {buf, 6} };
+	ASSERT(ReadV(srv, in, 2)==sizeof(len)+6);
+	ASSERT(rlen==6 && strcmp(buf, "hello")==0);
+
+	ASSERT(ReadV(lsock, in, 2)==-1);
+	ASSERT(ShutDown(cli, SHUTDOWN_WRITE)==0);
+	ASSERT(WriteV(cli, msg, 2)==-1);
+	ASSERT(ReadV(srv, in, 2)==0);
+	return 0;
+}
+
+
+static int connect_thread(int argl, void* args)
+{
+	return Connect(argl, 100, 1000);
+}
+
+static int connect_thread_port(int argl, void* args)
+{
+	return Connect(argl, (port_t)(intptr_t)args, 1000);
+}
+
+/* Accept without blocking on each listener, until n connections are accepted in all */
+static void accept_all(Fid_t* lsock, int* accepted, int nlisteners, int n)
+{
+	for(int i=0; i<nlisteners; i++)
+		ASSERT(Fcntl(lsock[i], FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	while(n > 0) {
+		for(int i=0; i<nlisteners; i++) {
+			Fid_t s = Accept(lsock[i]);
+			ASSERT(s != NOFILE);
+			if(s != WOULDBLOCK) {
+				ASSERT(Close(s)==0);
+				accepted[i]++; n--;
+			}
+		}
+		Poll(NULL, 0, 10);
+	}
+}
+
+BOOT_TEST(test_reuseport,
+	"Test that several listeners can share a port with SOCKOPT_REUSEPORT, and that requests are spread among them."
+	)
+{
+	Fid_t l[2] = { Socket(100), Socket(100) };
+	Fid_t other = Socket(100);
+
+	ASSERT(SetSockOpt(NOFILE, SOCKOPT_REUSEPORT, 1)==-1);
+	ASSERT(SetSockOpt(l[0], 42, 1)==-1);
+	ASSERT(SetSockOpt(l[0], SOCKOPT_REUSEPORT, 1)==0);
+	ASSERT(SetSockOpt(l[1], SOCKOPT_REUSEPORT, 1)==0);
+	ASSERT(Listen(l[0])==0);
+	ASSERT(Listen(l[1])==0);
+	ASSERT(SetSockOpt(l[0], SOCKOPT_REUSEPORT, 0)==-1);
+
+	/* Both must agree */
+	ASSERT(Listen(other)==-1);
+	ASSERT(Close(other)==0);
+
+	/* Four requests go two to each listener */
+	Fid_t cli[4];
+	Tid_t t[4];
+	for(int i=0; i<4; i++) {
+		cli[i] = Socket(NOPORT);
+		t[i] = CreateThread(connect_thread, cli[i], NULL);
+	}
+	Poll(NULL, 0, 100);
+	int accepted[2] = {0, 0};
+	accept_all(l, accepted, 2, 4);
+	ASSERT(accepted[0]==2 && accepted[1]==2);
+	for(int i=0; i<4; i++) {
+		int rc;
+		ASSERT(ThreadJoin(t[i], &rc)==0 && rc==0);
+		ASSERT(Close(cli[i])==0);
+	}
+
+	/* The requests of a closed listener move to the other */
+	for(int i=0; i<2; i++) {
+		cli[i] = Socket(NOPORT);
+		t[i] = CreateThread(connect_thread, cli[i], NULL);
+	}
+	Poll(NULL, 0, 100);
+	ASSERT(Close(l[0])==0);
+	accepted[1] = 0;
+	accept_all(l+1, accepted+1, 1, 2);
+	for(int i=0; i<2; i++) {
+		int rc;
+		ASSERT(ThreadJoin(t[i], &rc)==0 && rc==0);
+		ASSERT(Close(cli[i])==0);
+	}
+
+	/* When the last listener closes, pending requests fail */
+	cli[0] = Socket(NOPORT);
+	t[0] = CreateThread(connect_thread, cli[0], NULL);
+	Poll(NULL, 0, 100);
+	ASSERT(Close(l[1])==0);
+	int rc;
+	ASSERT(ThreadJoin(t[0], &rc)==0 && rc==-1);
+	return 0;
+}
+
+
+static int connect_thread_long(int argl, void* args)
+{
+	return Connect(argl, 100, 10000);
+}
+
+BOOT_TEST(test_listen_backlog,
+	"Test that Connect fails at once when the backlog of ListenEx is full, and that AcceptMany takes all pending connections."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(ListenEx(lsock, 0)==-1);
+	ASSERT(ListenEx(lsock, MAX_BACKLOG+1)==-1);
+	ASSERT(ListenEx(lsock, 2)==0);
+	ASSERT(ListenEx(lsock, 2)==-1);
+
+	Fid_t fids[8];
+	ASSERT(AcceptMany(lsock, fids, 0)==-1);
+	ASSERT(AcceptMany(NOFILE, fids, 8)==-1);
+	ASSERT(Fcntl(lsock, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	ASSERT(AcceptMany(lsock, fids, 8)==WOULDBLOCK);
+	ASSERT(Fcntl(lsock, FCNTL_SETFL, 0)==0);
+
+	/* Two requests fit, the third one is refused without waiting */
+	Fid_t cli[3];
+	Tid_t t[3];
+	for(int i=0; i<3; i++) {
+		cli[i] = Socket(NOPORT);
+		t[i] = CreateThread(connect_thread_long, cli[i], NULL);
+	}
+	Poll(NULL, 0, 100);
+
+	ASSERT(AcceptMany(lsock, fids, 1)==1);
+	ASSERT(AcceptMany(lsock, fids+1, 8)==1);
+
+	int ok = 0, failed = 0;
+	for(int i=0; i<3; i++) {
+		int rc;
+		ASSERT(ThreadJoin(t[i], &rc)==0);
+		if(rc==0) ok++;
+		if(rc==-1) failed++;
+	}
+	ASSERT(ok==2 && failed==1);
+
+	/* A refused socket is still unconnected */
+	char c;
+	for(int i=0; i<3; i++)
+		ASSERT(Write(cli[i], "x", 1)==1 || Read(cli[i], &c, 1)==-1);
+
+	/* Several pending connections are taken by one call */
+	for(int i=0; i<2; i++) {
+		cli[i] = Socket(NOPORT);
+		t[i] = CreateThread(connect_thread_long, cli[i], NULL);
+	}
+	Poll(NULL, 0, 100);
+	ASSERT(AcceptMany(lsock, fids+2, 8)==2);
+	for(int i=0; i<2; i++) {
+		int rc;
+		ASSERT(ThreadJoin(t[i], &rc)==0 && rc==0);
+	}
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_windows,
+	"Test socket window sizes, the send low watermark, and handing data to a blocked reader."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(SetSockOpt(lsock, SOCKOPT_RCVBUF, 4096)==0);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli = Socket(NOPORT);
+	ASSERT(SetSockOpt(cli, SOCKOPT_SNDBUF, 0)==-1);
+	ASSERT(SetSockOpt(cli, SOCKOPT_SNDBUF, PIPE_MAX_BUFFER_SIZE+1)==-1);
+	ASSERT(SetSockOpt(cli, SOCKOPT_SNDLOWAT, -1)==-1);
+	ASSERT(SetSockOpt(cli, SOCKOPT_SNDBUF, 2048)==0);
+	ASSERT(SetSockOpt(cli, SOCKOPT_SNDLOWAT, 3000)==0);
+
+	Tid_t t = CreateThread(connect_thread, cli, NULL);
+	Fid_t srv = Accept(lsock);
+	int rc;
+	ASSERT(ThreadJoin(t, &rc)==0 && rc==0);
+	ASSERT(srv!=NOFILE);
+
+	/* The window is the larger of the two, and it does not grow */
+	static char buf[8192];
+	int total = 0;
+	ASSERT(Fcntl(cli, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	while((rc = Write(cli, buf, sizeof(buf))) > 0)
+		total += rc;
+	ASSERT(rc==WOULDBLOCK && total==4096);
+
+	/* The writer is woken when 3000 bytes are free */
+	poll_fd pfd = { .fd = cli, .events = STREAM_WRITABLE };
+	ASSERT(Poll(&pfd, 1, 0)==0);
+	ASSERT(Read(srv, buf, 2000)==2000);
+	ASSERT(Poll(&pfd, 1, 0)==0);
+	ASSERT(Read(srv, buf, 1000)==1000);
+	ASSERT(Poll(&pfd, 1, 0)==1);
+
+	/* Resizing a connected window, not below the buffered data */
+	ASSERT(SetSockOpt(srv, SOCKOPT_RCVBUF, 1000)==-1);
+	ASSERT(SetSockOpt(srv, SOCKOPT_RCVBUF, 8192)==0);
+	total = 1096;
+	while((rc = Write(cli, buf, sizeof(buf))) > 0)
+		total += rc;
+	ASSERT(rc==WOULDBLOCK && total==8192);
+	while(total > 0) {
+		rc = Read(srv, buf, sizeof(buf));
+		ASSERT(rc > 0);
+		total -= rc;
+	}
+
+	/* A blocked reader receives the data of the next write */
+	ASSERT(Fcntl(cli, FCNTL_SETFL, 0)==0);
+	struct poll_writer_args A = { .fid = srv, .delay = 20 };
+	t = CreateThread(poll_writer, 0, &A);
+	ASSERT(Read(cli, buf, 10)==1 && buf[0]=='x');
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	ASSERT(Write(srv, "abc", 4)==4);
+	ASSERT(Read(cli, buf, 10)==4 && strcmp(buf, "abc")==0);
+
+	/* The low watermark can be changed on a connected socket */
+	ASSERT(SetSockOpt(srv, SOCKOPT_SNDLOWAT, 0)==0);
+	ASSERT(Close(srv)==0);
+	ASSERT(Read(cli, buf, 10)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_timeouts,
+	"Test the receive and send timeouts of sockets."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(SetSockOpt(lsock, SOCKOPT_RCVTIMEO, -1)==-1);
+	ASSERT(SetSockOpt(lsock, SOCKOPT_RCVTIMEO, 50)==0);
+	ASSERT(Listen(lsock)==0);
+
+	/* Accept times out */
+	ASSERT(Accept(lsock)==TIMEDOUT);
+	Fid_t fids[2];
+	ASSERT(AcceptMany(lsock, fids, 2)==TIMEDOUT);
+
+	Fid_t cli = Socket(NOPORT);
+	ASSERT(SetSockOpt(cli, SOCKOPT_SNDBUF, 1000)==0);
+	ASSERT(SetSockOpt(cli, SOCKOPT_SNDTIMEO, 50)==0);
+	Tid_t t = CreateThread(connect_thread, cli, NULL);
+	Fid_t srv = Accept(lsock);
+	int rc;
+	ASSERT(ThreadJoin(t, &rc)==0 && rc==0);
+	ASSERT(srv!=NOFILE);
+
+	/* Receives time out, on the accepted socket by inheritance */
+	char buf[2000];
+	ASSERT(Read(srv, buf, 10)==TIMEDOUT);
+	ASSERT(SetSockOpt(cli, SOCKOPT_RCVTIMEO, 50)==0);
+	ASSERT(Read(cli, buf, 10)==TIMEDOUT);
+	iovec_t iov = { .base = buf, .len = 10 };
+	ASSERT(ReadV(cli, &iov, 1)==TIMEDOUT);
+
+	/* Sends time out, after writing what fits */
+	ASSERT(Write(cli, buf, 2000)==1000);
+	ASSERT(Write(cli, buf, 1)==TIMEDOUT);
+	ASSERT(WriteV(cli, &iov, 1)==TIMEDOUT);
+
+	/* The data is intact, and a timeout of 0 blocks again */
+	ASSERT(Read(srv, buf, sizeof(buf))==1000);
+	ASSERT(SetSockOpt(srv, SOCKOPT_RCVTIMEO, 0)==0);
+	struct poll_writer_args A = { .fid = cli, .delay = 100 };
+	t = CreateThread(poll_writer, 0, &A);
+	ASSERT(Read(srv, buf, 10)==1 && buf[0]=='x');
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* Datagram sockets only have timeouts */
+	Fid_t d = SocketDgram(200);
+	ASSERT(SetSockOpt(d, SOCKOPT_SNDBUF, 1000)==-1);
+	ASSERT(SetSockOpt(d, SOCKOPT_RCVTIMEO, 50)==0);
+	ASSERT(RecvFrom(d, NULL, buf, 10)==TIMEDOUT);
+	return 0;
+}
+
+
+BOOT_TEST(test_bind,
+	"Test binding sockets to ports of their own, and the allocation of ephemeral ports."
+	)
+{
+	ASSERT(SetEphemeralPorts(0, 10)==-1);
+	ASSERT(SetEphemeralPorts(20, 10)==-1);
+	ASSERT(SetEphemeralPorts(60, MAX_PORT+1)==-1);
+
+	/* A range across a word boundary, with a listener inside */
+	ASSERT(SetEphemeralPorts(62, 66)==0);
+	Fid_t l = Socket(64);
+	ASSERT(Listen(l)==0);
+
+	Fid_t s[5];
+	for(int i=0; i<5; i++)
+		s[i] = Socket(NOPORT);
+	ASSERT(Bind(s[0], ANYPORT)==62);
+	ASSERT(Bind(s[1], ANYPORT)==63);
+	ASSERT(Bind(s[2], ANYPORT)==65);
+	ASSERT(Bind(s[3], ANYPORT)==66);
+	ASSERT(Bind(s[4], ANYPORT)==-1);
+
+	/* Errors */
+	ASSERT(Bind(s[0], ANYPORT)==-1);
+	ASSERT(Bind(l, ANYPORT)==-1);
+	ASSERT(Bind(NOFILE, ANYPORT)==-1);
+	ASSERT(Bind(s[4], 0)==-1);
+	ASSERT(Bind(s[4], MAX_PORT+1)==-1);
+	ASSERT(Bind(s[4], 64)==-1);
+	ASSERT(Bind(s[4], 63)==-1);
+	ASSERT(Bind(Socket(100), 200)==-1);
+
+	/* Closing frees the port, and the lowest free port is chosen */
+	ASSERT(Close(s[1])==0);
+	ASSERT(Bind(s[4], ANYPORT)==63);
+	ASSERT(Close(l)==0);
+	s[1] = Socket(NOPORT);
+	ASSERT(Bind(s[1], ANYPORT)==64);
+
+	/* A bound port is exclusive, but its owner may listen on it */
+	Fid_t other = Socket(65);
+	ASSERT(Listen(other)==-1);
+	ASSERT(SocketDgram(65)==NOFILE);
+	ASSERT(Listen(s[2])==0);
+
+	Fid_t cli = Socket(NOPORT);
+	ASSERT(Bind(cli, MAX_PORT)==MAX_PORT);
+	Tid_t t = CreateThread(connect_thread_port, cli, (void*)65);
+	Fid_t srv = Accept(s[2]);
+	int rc;
+	ASSERT(ThreadJoin(t, &rc)==0 && rc==0);
+	ASSERT(srv!=NOFILE);
+	ASSERT(Write(cli, "hello", 6)==6);
+	char buf[6];
+	ASSERT(Read(srv, buf, 6)==6 && strcmp(buf, "hello")==0);
+
+	/* A connected socket keeps its port until it is closed */
+	Fid_t d = SocketDgram(NOPORT);
+	ASSERT(Bind(d, MAX_PORT)==-1);
+	ASSERT(Close(cli)==0);
+	ASSERT(Bind(d, MAX_PORT)==MAX_PORT);
+
+	/* Datagram sockets bound to ephemeral ports can receive */
+	Fid_t d2 = SocketDgram(NOPORT);
+	ASSERT(SetEphemeralPorts(5000, 6000)==0);
+	port_t p = Bind(d2, ANYPORT);
+	ASSERT(p==5000);
+	port_t from;
+	ASSERT(SendTo(d, p, "ping", 5)==5);
+	ASSERT(RecvFrom(d2, &from, buf, 5)==5 && from==MAX_PORT);
+
+	/* The highest port can be listened on, and connected to */
+	ASSERT(Close(d)==0);
+	Fid_t top = Socket(NOPORT);
+	ASSERT(Bind(top, MAX_PORT)==MAX_PORT);
+	ASSERT(Listen(top)==0);
+	cli = Socket(NOPORT);
+	t = CreateThread(connect_thread_port, cli, (void*)MAX_PORT);
+	srv = Accept(top);
+	ASSERT(ThreadJoin(t, &rc)==0 && rc==0);
+	ASSERT(srv!=NOFILE);
+	ASSERT(Write(cli, "hello", 6)==6);
+	ASSERT(Read(srv, buf, 6)==6 && strcmp(buf, "hello")==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_connection_churn,
+	"Test many short-lived connections, whose sockets and pipes are recycled."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+
+	static char big[16384];
+	char buf[16];
+
+	for(int i=0; i<300; i++) {
+		Fid_t cli = Socket(NOPORT);
+		Tid_t t = CreateThread(connect_thread, cli, NULL);
+		Fid_t srv = Accept(lsock);
+		int rc;
+		ASSERT(ThreadJoin(t, &rc)==0 && rc==0);
+		ASSERT(srv!=NOFILE);
+
+		/* The new connection starts empty */
+		poll_fd pfd[2] = { { .fd=cli, .events=STREAM_READABLE }, { .fd=srv, .events=STREAM_READABLE } };
+		ASSERT(Poll(pfd, 2, 0)==0);
+
+		ASSERT(Write(cli, (char*)&i, sizeof(i))==sizeof(i));
+		ASSERT(Read(srv, buf, sizeof(buf))==sizeof(i) && *(int*)buf==i);
+
+		/* Some connections are closed with unread data, some with grown buffers */
+		if(i % 3 == 0)
+			ASSERT(Write(srv, "left", 4)==4);
+		if(i % 50 == 0) {
+			ASSERT(Fcntl(srv, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+			while(Write(srv, big, sizeof(big)) > 0);
+		}
+
+		ASSERT(Close(cli)==0);
+		ASSERT(Close(srv)==0);
+	}
+	return 0;
+}
+
+
+/* A host client of a socket bridge: send a message, then read the reply until EOF */
+struct bridge_client_args {
+	const char* path;
+	const char* msg;
+	char reply[64];
+	int len;
+};
+
+static void* bridge_client(void* arg)
+{
+	struct bridge_client_args* a = arg;
+	a->len = -1;
+
+	/* Leave the signals to the VM */
+	sigset_t all;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strncpy(addr.sun_path, a->path, sizeof(addr.sun_path)-1);
+
+	/* The VM may not have booted yet */
+	int fd = -1;
+	for(int i=0; i<500 && fd==-1; i++) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(connect(fd, (struct sockaddr*)&addr, sizeof(addr))==-1) {
+			close(fd);
+			fd = -1;
+			usleep(10000);
+		}
+	}
+	if(fd==-1) return NULL;
+
+	if(write(fd, a->msg, strlen(a->msg)) == strlen(a->msg)) {
+		shutdown(fd, SHUT_WR);
+		int n = 0, rc;
+		while((rc = read(fd, a->reply + n, sizeof(a->reply)-1-n)) > 0)
+			n += rc;
+		a->reply[n] = 0;
+		a->len = n;
+	}
+	close(fd);
+	return NULL;
+}
+
+BARE_TEST(test_socket_bridge,
+	"Test that host clients of a socket bridge are accepted by the listeners\n"
+	"of its port, together with local clients."
+	)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/tinyos_bridge_%d", getpid());
+
+	struct bridge_client_args host[2] = { 
+		{ .path=path, .msg="hello" }, { .path=path, .msg="from the host" } 
+	};
+
+	int local_client(int argl, void* args)
+	{
+		Fid_t s = Socket(NOPORT);
+		ASSERT(Connect(s, 100, 5000)==0);
+		ASSERT(Write(s, "local", 5)==5);
+		ASSERT(ShutDown(s, SHUTDOWN_WRITE)==0);
+
+		char buf[16];
+		int n = 0, rc;
+		while((rc = Read(s, buf+n, sizeof(buf)-n)) > 0)
+			n += rc;
+		ASSERT(n==5 && memcmp(buf, "local", 5)==0);
+		return 0;
+	}
+
+	int echo_server(int argl, void* args)
+	{
+		Fid_t lsock = Socket(100);
+		ASSERT(Listen(lsock)==0);
+		Tid_t t = CreateThread(local_client, 0, NULL);
+
+		/* Echo each client, until it shuts down */
+		for(int i=0; i<3; i++) {
+			Fid_t s = Accept(lsock);
+			ASSERT(s!=NOFILE);
+			if(s==NOFILE) break;
+
+			char buf[64];
+			int rc;
+			while((rc = Read(s, buf, sizeof(buf))) > 0)
+				ASSERT(Write(s, buf, rc)==rc);
+			ASSERT(rc==0);
+			ASSERT(Close(s)==0);
+		}
+
+		ASSERT(ThreadJoin(t, NULL)==0);
+		ASSERT(Close(lsock)==0);
+		return 0;
+	}
+
+	pthread_t thr[2];
+	for(int i=0; i<2; i++)
+		ASSERT(pthread_create(&thr[i], NULL, bridge_client, &host[i])==0);
+
+	vm_config vmc;
+	vm_configure(&vmc, NULL, 2, 0);
+	ASSERT(vm_config_bridge(&vmc, 100, path)==0);
+	boot_vm(&vmc, echo_server, 0, NULL);
+
+	for(int i=0; i<2; i++) {
+		ASSERT(pthread_join(thr[i], NULL)==0);
+		ASSERT(host[i].len==strlen(host[i].msg) && strcmp(host[i].reply, host[i].msg)==0);
+	}
+
+	/* The bridge is removed at shutdown */
+	ASSERT(access(path, F_OK)==-1);
+}
+
+
+BOOT_TEST(test_topic,
+	"Test publish/subscribe topics: fan-out, port sharing, errors, and dropping the oldest\n"
+	"messages of a lagging subscriber."
+	)
+{
+	enum { NSUB = 8 };
+	Fid_t pub = SocketTopic(300, TOPIC_PUBLISH);
+	ASSERT(pub!=NOFILE);
+
+	Fid_t sub[NSUB];
+	for(int i=0; i<NSUB; i++)
+		ASSERT((sub[i] = SocketTopic(300, TOPIC_SUBSCRIBE))!=NOFILE);
+
+	/* Errors */
+	ASSERT(SocketTopic(NOPORT, TOPIC_PUBLISH)==NOFILE);
+	ASSERT(SocketTopic(MAX_PORT+1, TOPIC_SUBSCRIBE)==NOFILE);
+	ASSERT(SocketTopic(301, 7)==NOFILE);
+	ASSERT(SocketDgram(300)==NOFILE);
+	Fid_t l = Socket(300);
+	ASSERT(Listen(l)==-1);
+	ASSERT(Close(l)==0);
+	Fid_t d = SocketDgram(400);
+	ASSERT(SocketTopic(400, TOPIC_PUBLISH)==NOFILE);
+	ASSERT(Close(d)==0);
+
+	char buf[MAX_DGRAM_SIZE+1];
+	ASSERT(Write(pub, buf, MAX_DGRAM_SIZE+1)==-1);
+	ASSERT(Read(pub, buf, 10)==-1);
+	ASSERT(Write(sub[0], "x", 1)==-1);
+
+	/* One write reaches every subscriber, whole */
+	poll_fd pfd = { .fd=sub[3], .events=STREAM_READABLE };
+	ASSERT(Poll(&pfd, 1, 0)==0);
+	ASSERT(Write(pub, "hello", 6)==6);
+	ASSERT(Poll(&pfd, 1, 0)==1);
+	for(int i=0; i<NSUB; i++)
+		ASSERT(Read(sub[i], buf, sizeof(buf))==6 && strcmp(buf, "hello")==0);
+	ASSERT(Fcntl(sub[0], FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	ASSERT(Read(sub[0], buf, sizeof(buf))==WOULDBLOCK);
+	ASSERT(SetSockOpt(sub[1], SOCKOPT_RCVTIMEO, 20)==0);
+	ASSERT(Read(sub[1], buf, sizeof(buf))==TIMEDOUT);
+
+	/* A blocked subscriber is woken up */
+	struct poll_writer_args A = { .fid = pub, .delay = 20 };
+	Tid_t t = CreateThread(poll_writer, 0, &A);
+	ASSERT(Read(sub[2], buf, sizeof(buf))==1 && buf[0]=='x');
+	ASSERT(ThreadJoin(t, NULL)==0);
+	for(int i=0; i<NSUB; i++)
+		if(i!=2) ASSERT(Read(sub[i], buf, sizeof(buf))==1);
+
+	/* A lagging subscriber loses the oldest messages; a late one sees only new ones */
+	Fid_t pub2 = SocketTopic(300, TOPIC_PUBLISH);
+	for(int k=0; k<TOPIC_RING_LENGTH+10; k++)
+		ASSERT(Write((k%2) ? pub : pub2, (char*)&k, sizeof(k))==sizeof(k));
+	Fid_t late = SocketTopic(300, TOPIC_SUBSCRIBE);
+	ASSERT(Read(sub[0], buf, sizeof(buf))==sizeof(int) && *(int*)buf==10);
+	for(int k=11; k<TOPIC_RING_LENGTH+10; k++)
+		ASSERT(Read(sub[0], buf, sizeof(buf))==sizeof(int) && *(int*)buf==k);
+	ASSERT(Read(sub[0], buf, sizeof(buf))==WOULDBLOCK);
+	ASSERT(Read(sub[4], buf, 2)==2);
+	ASSERT(Write(pub2, "new", 4)==4);
+	ASSERT(Read(late, buf, sizeof(buf))==4 && strcmp(buf, "new")==0);
+
+	/* The topic holds the port while any of its sockets is open */
+	ASSERT(Close(pub)==0);
+	ASSERT(Close(pub2)==0);
+	ASSERT(Close(late)==0);
+	for(int i=0; i<NSUB-1; i++)
+		ASSERT(Close(sub[i])==0);
+	ASSERT(SocketDgram(300)==NOFILE);
+	ASSERT(Close(sub[NSUB-1])==0);
+	d = SocketDgram(300);
+	ASSERT(d!=NOFILE);
+	ASSERT(Close(d)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_dgram,
+	"Test datagram sockets: message boundaries, sender ports, errors and dropping on overflow."
+	)
+{
+	Fid_t a = SocketDgram(100);
+	Fid_t b = SocketDgram(200);
+	Fid_t anon = SocketDgram(NOPORT);
+	ASSERT(a!=NOFILE && b!=NOFILE && anon!=NOFILE);
+
+	/* Ports are exclusive, also against listeners */
+	ASSERT(SocketDgram(100)==NOFILE);
+	ASSERT(SocketDgram(MAX_PORT+1)==NOFILE);
+	Fid_t l = Socket(100);
+	ASSERT(Listen(l)==-1);
+	ASSERT(Connect(Socket(NOPORT), 100, 100)==-1);
+
+	char buf[MAX_DGRAM_SIZE+1];
+	port_t from;
+
+	/* Errors */
+	ASSERT(SendTo(a, 300, "x", 1)==-1);
+	ASSERT(SendTo(l, 200, "x", 1)==-1);
+	ASSERT(SendTo(a, 200, buf, MAX_DGRAM_SIZE+1)==-1);
+	ASSERT(RecvFrom(l, &from, buf, 10)==-1);
+	ASSERT(RecvFrom(anon, &from, buf, 10)==-1);
+	ASSERT(Write(a, "x", 1)==-1);
+
+	/* Boundaries and senders */
+	ASSERT(SendTo(a, 200, "hello", 6)==6);
+	ASSERT(SendTo(anon, 200, "world", 6)==6);
+	ASSERT(SendTo(b, 200, "self", 5)==5);
+	ASSERT(RecvFrom(b, &from, buf, 100)==6 && from==100 && strcmp(buf, "hello")==0);
+	ASSERT(RecvFrom(b, &from, buf, 3)==3 && from==NOPORT && memcmp(buf, "wor", 3)==0);
+	ASSERT(Read(b, buf, 100)==5 && strcmp(buf, "self")==0);
+
+	/* Readiness and non-blocking */
+	poll_fd pfd = { .fd = b, .events = STREAM_READABLE };
+	ASSERT(Poll(&pfd, 1, 0)==0);
+	ASSERT(Fcntl(b, FCNTL_SETFL, STREAM_NONBLOCK)==0);
+	ASSERT(RecvFrom(b, &from, buf, 100)==WOULDBLOCK);
+	ASSERT(SendTo(a, 200, "again", 6)==6);
+	ASSERT(Poll(&pfd, 1, 0)==1);
+	ASSERT(RecvFrom(b, NULL, buf, 100)==6);
+
+	/* A full queue drops, without blocking the sender */
+	for(int i=0; i<DGRAM_QUEUE_LENGTH+10; i++)
+		ASSERT(SendTo(a, 200, (char*)&i, sizeof(i))==sizeof(i));
+	for(int i=0; i<DGRAM_QUEUE_LENGTH; i++) {
+		int k;
+		ASSERT(RecvFrom(b, NULL, (char*)&k, sizeof(k))==sizeof(k) && k==i);
+	}
+	ASSERT(RecvFrom(b, NULL, buf, 100)==WOULDBLOCK);
+
+	/* Closing frees the port */
+	ASSERT(Close(b)==0);
+	ASSERT(SendTo(a, 200, "x", 1)==-1);
+	ASSERT(SocketDgram(200)!=NOFILE);
+	return 0;
+}
+
+
 BOOT_TEST(test_accept_unblocks_on_close,
 	"Test that Accept will unblock if the listening socket is closed."
 	)
@@ -2191,6 +4105,41 @@ BOOT_TEST(test_shudown_write,
 
 
 
+BOOT_TEST(test_socket_splice,
+	"Test that Splice moves data out of a socket, and refuses to splice a socket into its own peer."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli = Socket(NOPORT), srv;
+	ASSERT(cli!=NOFILE);
+	connect_sockets(cli, lsock, &srv, 100);
+
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	char buf[50], rbuf[50];
+	for(unsigned int i=0; i<sizeof(buf); i++) buf[i] = (char) i;
+
+	ASSERT(Write(cli, buf, sizeof(buf))==sizeof(buf));
+	ASSERT(Splice(srv, cli, 10)==-1);
+	ASSERT(Splice(srv, pipe.write, sizeof(buf))==sizeof(buf));
+	ASSERT(Read(pipe.read, rbuf, sizeof(rbuf))==sizeof(rbuf));
+	ASSERT(memcmp(buf, rbuf, sizeof(buf))==0);
+
+	/* and back into the socket */
+	ASSERT(Write(pipe.write, buf, sizeof(buf))==sizeof(buf));
+	ASSERT(Splice(pipe.read, srv, sizeof(buf))==sizeof(buf));
+	ASSERT(Read(cli, rbuf, sizeof(rbuf))==sizeof(rbuf));
+	ASSERT(memcmp(buf, rbuf, sizeof(buf))==0);
+
+	ASSERT(Splice(lsock, pipe.write, 10)==-1);
+	return 0;
+}
+
+
 TEST_SUITE(socket_tests,
 	"A suite of tests for sockets."
 	)
@@ -2212,6 +4161,18 @@ TEST_SUITE(socket_tests,
 	&test_accept_reusable,
 	&test_accept_fails_on_exhausted_fid,
 	&test_accept_unblocks_on_close,
+	&test_accept_nonblocking,
+	&test_poll_listener,
+	&test_socket_writev,
+	&test_reuseport,
+	&test_listen_backlog,
+	&test_dgram,
+	&test_topic,
+	&test_socket_windows,
+	&test_socket_timeouts,
+	&test_bind,
+	&test_connection_churn,
+	&test_socket_bridge,
 
 	&test_connect_fails_on_bad_fid,
 	&test_connect_fails_on_bad_socket,
@@ -2222,6 +4183,7 @@ TEST_SUITE(socket_tests,
 	&test_socket_small_transfer,
 	&test_socket_single_producer,
 	&test_socket_multi_producer,
+	&test_socket_splice,
 
 	&test_shudown_read,
 	&test_shudown_write,
@@ -2231,6 +4193,143 @@ TEST_SUITE(socket_tests,
 
 
 
+/*********************************************
+ *
+ *
+ *
+ *  Asynchronous I/O ring tests
+ *
+ *
+ *
+ *********************************************/
+
+
+/* Add a submission to a ring */
+static void ring_push(io_ring* q, int opcode, Fid_t fd, void* buf, unsigned int len, uintptr_t user_data)
+{
+	ring_sqe* sqe = &q->sq[q->sq_tail & q->sq_mask];
+	memset(sqe, 0, sizeof(ring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->buf = buf;
+	sqe->len = len;
+	sqe->user_data = user_data;
+	q->sq_tail++;
+}
+
+/* Take a completion from a ring, returning its user_data */
+static uintptr_t ring_pop(io_ring* q, int* res)
+{
+	ASSERT(q->cq_head != q->cq_tail);
+	ring_cqe* cqe = &q->cq[q->cq_head & q->cq_mask];
+	q->cq_head++;
+	*res = cqe->res;
+	return cqe->user_data;
+}
+
+BOOT_TEST(test_ring,
+	"Test asynchronous I/O rings: many reads in flight from one thread,\n"
+	"accept and connect in the same ring, polls, errors and cancellation."
+	)
+{
+	enum { N = 64 };
+	io_ring* q;
+	int res;
+
+	ASSERT(RingCreate(0, &q)==NOFILE);
+	ASSERT(RingCreate(MAX_RING_ENTRIES+1, &q)==NOFILE);
+	ASSERT(SetFileLimit(4*N)==0);
+
+	Fid_t ring = RingCreate(N, &q);
+	ASSERT(ring!=NOFILE);
+	ASSERT(q->sq_mask==N-1 && q->cq_mask==2*N-1);
+	ASSERT(RingEnter(ring, 0, 0, 0)==0);
+
+	/* Many reads in flight */
+	pipe_t p[N];
+	char buf[N][8];
+	for(int i=0; i<N; i++) {
+		ASSERT(Pipe(&p[i])==0);
+		ring_push(q, RING_READ, p[i].read, buf[i], sizeof(buf[i]), i);
+	}
+	ASSERT(RingEnter(ring, N, 0, 0)==N);
+	ASSERT(q->sq_head==N);
+	ASSERT(q->cq_head==q->cq_tail);
+
+	for(int i=N-1; i>=0; i--)
+		ASSERT(Write(p[i].write, (char*)&i, sizeof(i))==sizeof(i));
+	ASSERT(RingEnter(ring, 0, N, TIMEOUT_INFINITE)==0);
+	ASSERT(q->cq_tail - q->cq_head == N);
+	for(int k=0; k<N; k++) {
+		uintptr_t i = ring_pop(q, &res);
+		ASSERT(i < N && res==sizeof(int) && *(int*)buf[i]==(int)i);
+	}
+
+	/* A poll, a write, and an error */
+	ring_push(q, RING_POLL, p[0].write, NULL, 0, 1);
+	q->sq[(q->sq_tail-1) & q->sq_mask].events = STREAM_WRITABLE;
+	ring_push(q, RING_WRITE, p[0].write, "hello", 5, 2);
+	ring_push(q, RING_READ, ring, buf[0], 8, 3);
+	ASSERT(RingEnter(ring, 3, 3, 1000)==3);
+	for(int k=0; k<3; k++) {
+		uintptr_t u = ring_pop(q, &res);
+		if(u==1) ASSERT(res==STREAM_WRITABLE);
+		else if(u==2) ASSERT(res==5);
+		else ASSERT(u==3 && res==-1);
+	}
+	ASSERT(Read(p[0].read, buf[0], 8)==5);
+
+	/* A timeout with nothing completed */
+	ring_push(q, RING_READ, p[0].read, buf[0], 8, 4);
+	ASSERT(RingEnter(ring, 1, 1, 20)==1);
+	ASSERT(q->cq_head==q->cq_tail);
+
+	/* Accept and connect from a single thread */
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t csock = Socket(NOPORT);
+	ring_push(q, RING_ACCEPT, lsock, NULL, 0, 5);
+	ring_push(q, RING_CONNECT, csock, NULL, 0, 6);
+	q->sq[(q->sq_tail-1) & q->sq_mask].port = 100;
+	q->sq[(q->sq_tail-1) & q->sq_mask].timeout = 1000;
+	ASSERT(RingEnter(ring, 2, 2, TIMEOUT_INFINITE)==2);
+	Fid_t asock = NOFILE;
+	for(int k=0; k<2; k++) {
+		uintptr_t u = ring_pop(q, &res);
+		if(u==5) asock = res;
+		else ASSERT(u==6 && res==0);
+	}
+	ASSERT(asock!=NOFILE);
+	ASSERT(Write(csock, "ring", 4)==4);
+	ASSERT(Read(asock, buf[1], 4)==4);
+	ASSERT(memcmp(buf[1], "ring", 4)==0);
+
+	/* A connect to a port with no listener */
+	ASSERT(Close(lsock)==0);
+	Fid_t dsock = Socket(NOPORT);
+	ring_push(q, RING_CONNECT, dsock, NULL, 0, 7);
+	q->sq[(q->sq_tail-1) & q->sq_mask].port = 100;
+	ASSERT(RingEnter(ring, 1, 1, 0)==1);
+	ASSERT(ring_pop(q, &res)==7 && res==-1);
+
+	/* Closing the ring cancels the read of p[0] in flight */
+	ASSERT(Close(ring)==0);
+	ASSERT(Write(p[0].write, "x", 1)==1);
+	ASSERT(Read(p[0].read, buf[0], 8)==1);
+	return 0;
+}
+
+
+TEST_SUITE(ring_tests,
+	"A suite of tests for asynchronous I/O rings."
+	)
+{
+	&test_ring,
+	NULL
+};
+
+
+
 
 /*********************************************
  *
@@ -2572,7 +4671,10 @@ TEST_SUITE(all_tests,
 	//&io_tests,
 	&thread_tests,
 	&pipe_tests,
+	&semaphore_tests,
+	&shm_tests,
 	&socket_tests,
+	&ring_tests,
 	NULL
 };
 